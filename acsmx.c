@@ -77,6 +77,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <CL/opencl.h>
 
 #include "acsmx.h"
@@ -92,28 +100,188 @@
 } while (0)
 
 
-/* ================================= queue ================================== */
+/* ============================ compile thread pool ========================= */
+
+
+/* states handed to a compile thread at once */
+#define ACSM_POOL_CHUNK		256
+
+/* automata with fewer states are compiled by the calling thread alone */
+#define ACSM_POOL_MIN_STATES	(1 << 16)
+
+/* maximum number of compile threads */
+#define ACSM_POOL_MAX_THREADS	64
+
+
+/* dense row state of each trie state, see acsm_update() */
+#define ACSM_ROW_STALE		0x1	/* the row must be recomputed       */
+#define ACSM_ROW_NEW		0x2	/* the row was never uploaded       */
+#define ACSM_ROW_CHANGED	0x4	/* the row differs from the device  */
+
+/* bytes of an arena block, larger requests get a block of their own */
+#define ACSM_ARENA_BLOCK	(1 << 20)
+
+/* alignment of the arena allocations */
+#define ACSM_ARENA_ALIGN	sizeof(void *)
+
+/* fan-out buckets of acsm_report(), 0, 1, 2, 3-4, ... and the rest */
+#define ACSM_REPORT_FANOUTS	10
+
+/* hottest states listed by acsm_report() */
+#define ACSM_REPORT_STATES	10
 
 
 /*
- * simple queue_t node
- */ 
-struct _qnode {
-	int		state;
-	struct _qnode	*next;
+ * a block of the arena that holds the patterns while the state machine is
+ * built; the blocks are released all at once
+ */
+struct _acsm_arena {
+	struct _acsm_arena	*next;
+	size_t			used;
+	size_t			size;
+	unsigned char		data[];
 };
-typedef struct _qnode qnode_t;
 
 
 /*
- * simple queue
- */ 
-struct _queue {
-	qnode_t	*head;
-	qnode_t	*tail;
-	int	count;
+ * a state and its sort keys while the states are renumbered
+ */
+struct _acsm_rank {
+	size_t	hits;		/* visits over the profiled sample */
+	int	bfs;		/* breadth first position in its group */
+	int	state;
+};
+typedef struct _acsm_rank acsm_rank_t;
+
+
+/*
+ * runs a function on each state of the trie, one breadth first level at a
+ * time; the states of a level are claimed in chunks by the threads, which
+ * wait for each other before moving to the next level
+ */
+struct _acsm_pool {
+	acsm_t			*acsm;
+	void			(*fn)(acsm_t *, int, void *);
+	void			*arg;
+	int			*claimed;	/* next unclaimed state per level */
+	int			num_threads;
+	pthread_barrier_t	barrier;
+};
+typedef struct _acsm_pool acsm_pool_t;
+
+
+/* ================================ signatures ============================== */
+
+
+/*
+ * a signature program starts with a header: the number of parts, the part
+ * the anchor lies in and the place of the last anchor byte in that part.
+ * Then each part has its size in bytes, the least and the most bytes of the
+ * gap before it (-1 for any) and the offset of its code in the program. The
+ * code of a part has a word per byte, its mask and its value, a word for a
+ * run of any bytes or a word for a set of alternatives, followed by their
+ * bytes; the verification kernel in ahomatch.cl runs it
+ */
+#define ACSM_SIG_HDR		3	/* words of the program header       */
+#define ACSM_SIG_PART		4	/* words per part                    */
+#define ACSM_SIG_ALT		1	/* opcode of a set of alternatives   */
+#define ACSM_SIG_SKIP		2	/* opcode of a run of any bytes      */
+#define ACSM_SIG_MIN_ANCHOR	2	/* least plain bytes in an anchor    */
+#define ACSM_SIG_MAX_ALTS	0xfff	/* most alternatives, and their size */
+
+#define ACSM_SIG_LEN(sig, k)	((sig)[ACSM_SIG_HDR + ACSM_SIG_PART * (k)])
+#define ACSM_SIG_GAP_MIN(sig, k)					\
+	((sig)[ACSM_SIG_HDR + ACSM_SIG_PART * (k) + 1])
+#define ACSM_SIG_GAP_MAX(sig, k)					\
+	((sig)[ACSM_SIG_HDR + ACSM_SIG_PART * (k) + 2])
+#define ACSM_SIG_CODE(sig, k)						\
+	((sig)[ACSM_SIG_HDR + ACSM_SIG_PART * (k) + 3])
+
+
+/*
+ * a part of a signature while it is compiled
+ */
+struct _acsm_sig_part {
+	int	len;		/* bytes the part spans            */
+	int	gap_min;	/* bytes of the gap before it      */
+	int	gap_max;	/* -1 for any number of bytes      */
+	int	code;		/* first word of its code          */
+};
+typedef struct _acsm_sig_part acsm_sig_part_t;
+
+
+/* ============================ compiled database =========================== */
+
+
+/* compiled database magic and format version */
+#define ACSM_DB_MAGIC	"ACSMDB\0"
+#define ACSM_DB_VERSION	5
+
+/* the database sections start at page boundaries */
+#define ACSM_DB_ALIGN	0x1000
+
+
+/*
+ * compiled database sections
+ */
+enum {
+	ACSM_DB_TRANS,		/* serialized DFA                     */
+	ACSM_DB_OUT,		/* output set offsets                 */
+	ACSM_DB_OUT_IDS,	/* output set pattern ids             */
+	ACSM_DB_VERIFY,		/* case verification per pattern      */
+	ACSM_DB_CASE,		/* original case pattern bytes        */
+	ACSM_DB_PATTERNS,	/* pattern records                    */
+	ACSM_DB_STRINGS,	/* pattern bytes, each NUL terminated */
+	ACSM_DB_SIGS,		/* signature program per pattern      */
+	ACSM_DB_SIG_CODE,	/* signature programs                 */
+	ACSM_DB_SECTIONS
+};
+
+
+/*
+ * compiled database section location
+ */
+struct _acsm_db_section {
+	uint64_t	offset;
+	uint64_t	size;
+};
+
+
+/*
+ * compiled database header, stored in host byte order
+ */
+struct _acsm_db_header {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		num_states;
+	uint32_t		num_classes;
+	uint32_t		state_size;
+	uint32_t		num_patterns;
+	uint32_t		max_pattern_len;
+	uint32_t		num_outputs;
+	uint32_t		fold;
+	uint32_t		num_groups;
+	uint32_t		num_sigs;
+	unsigned char		classmap[ALPHABET_SIZE];
+	struct _acsm_db_section	section[ACSM_DB_SECTIONS];
+};
+typedef struct _acsm_db_header acsm_db_header_t;
+
+
+/*
+ * compiled database pattern record
+ */
+struct _acsm_db_pattern {
+	int32_t		n;
+	int32_t		nocase;
+	int32_t		offset;
+	int32_t		depth;
+	int32_t		iid;
+	int32_t		index;
+	int32_t		next;	/* next pattern of the same state, or -1 */
+	uint32_t	data;	/* offset in the strings section         */
 };
-typedef struct _queue queue_t;
+typedef struct _acsm_db_pattern acsm_db_pattern_t;
 
 
 /* ======================== memory handling wrappers ======================== */
@@ -144,91 +312,117 @@ ac_free(void *p) {
 }
 
 
-/* ================================= queue ================================== */
-
-
 /*
- * initializes a new queue_t
- */ 
-static void
-queue_init(queue_t *s) 
+ * bump allocates zeroed memory from the arena of the state machine
+ */
+static void *
+arena_alloc(acsm_t *acsm, size_t n)
 {
-	s->head = s->tail = 0;
-	s->count = 0;
+	size_t size;
+	struct _acsm_arena *a;
+
+	n = ROUNDUP(n, ACSM_ARENA_ALIGN);
+
+	a = acsm->arena;
+	if (!a || a->size - a->used < n) {
+		size = (n > ACSM_ARENA_BLOCK) ? n : ACSM_ARENA_BLOCK;
+		a = (struct _acsm_arena *)ac_malloc(
+		    sizeof(struct _acsm_arena) + size);
+		MEMASSERT(a, "arena_alloc");
+		a->size = size;
+		a->used = 0;
+
+		/* a large request leaves the current block the next one */
+		if (size > ACSM_ARENA_BLOCK && acsm->arena) {
+			a->next = acsm->arena->next;
+			acsm->arena->next = a;
+			a->used = n;
+			acsm->arena_used += n;
+			return a->data;
+		}
+		a->next = acsm->arena;
+		acsm->arena = a;
+	}
 
-	return;
+	a->used += n;
+	acsm->arena_used += n;
+
+	return a->data + a->used - n;
 }
 
 
 /*
- * adds a tail item to queue
+ * releases the arena of the state machine
  */
 static void
-queue_add(queue_t *s, int state) 
+arena_release(acsm_t *acsm)
 {
-	qnode_t * q;
-	if (!s->head) {
-		q = s->tail = s->head = (qnode_t *)ac_malloc(sizeof(qnode_t));
-		MEMASSERT(q, "queue_add");
-		q->state = state;
-		q->next = 0;
-	} else 	{
-		q = (qnode_t *)ac_malloc(sizeof(qnode_t));
-		MEMASSERT(q, "queue_add");
-		q->state = state;
-		q->next = 0;
-		s->tail->next = q;
-		s->tail = q;
+	struct _acsm_arena *a;
+
+	while ((a = acsm->arena) != NULL) {
+		acsm->arena = a->next;
+		ac_free(a);
 	}
-	s->count++;
+	acsm->arena_used = 0;
+	acsm->arena_dead = 0;
 
 	return;
 }
 
 
 /*
- * removes a head item from queue
- */ 
-static int
-queue_remove(queue_t *s) 
+ * bytes of the arena taken by a pattern and its signature program
+ */
+static size_t
+arena_pattern_size(acsm_pattern_t *p)
 {
-	int state = 0;
-	qnode_t *q;
-
-	if (s->head) {
-		q = s->head;
-		state = q->state;
-		s->head = s->head->next;
-		s->count--;
-		if (!s->head) {
-			s->tail = 0;
-			s->count = 0;
-		}
-		ac_free(q);
-	}
+	size_t n;
 
-	return state;
-}
+	n = ROUNDUP(sizeof(acsm_pattern_t) + 2 * p->n, ACSM_ARENA_ALIGN);
+	if (p->sig)
+		n += ROUNDUP(p->sig_len * sizeof(int), ACSM_ARENA_ALIGN);
 
-
-/*
- * returns the queue count
- */ 
-static int
-queue_count(queue_t *s) 
-{
-	return s->count;
+	return n;
 }
 
 
 /*
- * frees the queue
- */ 
+ * moves the patterns that are still in use to a new arena and releases the
+ * old one, with the memory of the deleted patterns; the list keeps its order
+ */
 static void
-queue_free(queue_t *s) 
+arena_compact(acsm_t *acsm)
 {
-	while (queue_count(s))
-		queue_remove(s);
+	acsm_pattern_t *p;
+	acsm_pattern_t *q;
+	acsm_pattern_t **link;
+	struct _acsm_arena *a;
+	struct _acsm_arena *old;
+
+	old = acsm->arena;
+	acsm->arena = NULL;
+	acsm->arena_used = 0;
+	acsm->arena_dead = 0;
+
+	for (link = &acsm->patterns; (p = *link) != NULL; link = &q->next) {
+		q = (acsm_pattern_t *)arena_alloc(acsm,
+		    sizeof(acsm_pattern_t) + 2 * p->n);
+		*q = *p;
+		q->pattern = (unsigned char *)(q + 1);
+		memcpy(q->pattern, p->pattern, p->n);
+		q->casepattern = q->pattern + p->n;
+		memcpy(q->casepattern, p->casepattern, p->n);
+		if (p->sig) {
+			q->sig = arena_alloc(acsm, p->sig_len * sizeof(int));
+			memcpy(q->sig, p->sig, p->sig_len * sizeof(int));
+		}
+		*link = q;
+	}
+
+	while ((a = old) != NULL) {
+		old = a->next;
+		ac_free(a);
+	}
 
 	return;
 }
@@ -260,7 +454,6 @@ init_xlatcase(void)
 
 /*
  * makes a copy with converted case
- * plz don't use this, i killed it
  */ 
 static inline void
 convert_case_ex(unsigned char *d, unsigned char *s, int m) 
@@ -268,408 +461,2736 @@ convert_case_ex(unsigned char *d, unsigned char *s, int m)
 	int i;
 
 	for (i = 0; i < m; i++)
-		d[i] = s[i];
-		/* d[i] = xlatcase[s[i]]; */
+		d[i] = xlatcase[s[i]];
 
 	return;
 }
 
 
 /*
- * copies a match list entry
- */ 
-static acsm_pattern_t *
-copy_match_list_entry(acsm_pattern_t *px) 
+ * checks if the case of a pattern can change; such a case sensitive pattern
+ * must be verified in a case folded automaton
+ */
+static int
+has_case(unsigned char *s, int m)
 {
-	acsm_pattern_t *p;
+	int i;
 
-	p = (acsm_pattern_t *)ac_malloc(sizeof(acsm_pattern_t));
-	MEMASSERT(p, "copy_match_list_entry");
-	memcpy(p, px, sizeof(acsm_pattern_t));
-	p->next = 0;
+	for (i = 0; i < m; i++)
+		if (xlatcase[s[i]] != s[i] || tolower(s[i]) != s[i])
+			return 1;
 
-	return p;
+	return 0;
 }
 
 
 /*
- * adds a pattern to the list of patterns terminated at this state
- * insert at front of list
- */ 
-static void
-add_match_list_entry(acsm_t *acsm, int state, acsm_pattern_t *px) 
+ * orders patterns by their bytes (a prefix first), then by their index
+ */
+static int
+pattern_cmp(const void *a, const void *b)
 {
-	acsm_pattern_t *p;
+	int r;
+	int n;
+	const acsm_pattern_t *p;
+	const acsm_pattern_t *q;
+
+	p = *(acsm_pattern_t * const *)a;
+	q = *(acsm_pattern_t * const *)b;
+
+	n = (p->n < q->n) ? p->n : q->n;
+	if ((r = memcmp(p->pattern, q->pattern, n)) != 0)
+		return r;
+	if (p->n != q->n)
+		return p->n - q->n;
+
+	return (int)p->index - (int)q->index;
+}
 
-	p = (acsm_pattern_t *)ac_malloc(sizeof(acsm_pattern_t));
-	MEMASSERT(p, "add_match_list_entry");
-	memcpy(p, px, sizeof(acsm_pattern_t));
-	p->next = acsm->state_table[state].match_list;
-	acsm->state_table[state].match_list = p;
-	acsm->state_table[state].num_finals++;
+
+/*
+ * initializes a trie state
+ */
+static inline void
+init_state(acsm_t *acsm, int state, unsigned char byte)
+{
+	acsm->trie[state].child		= ACSM_FAIL_STATE;
+	acsm->trie[state].sibling	= ACSM_FAIL_STATE;
+	acsm->trie[state].fail_state	= 0;
+	acsm->trie[state].output	= -1;
+	acsm->trie[state].match		= -1;
+	acsm->trie[state].byte		= byte;
 
 	return;
 }
 
 
-/* 
- * adds pattern states
- */ 
-static void
-add_pattern_states(acsm_t *acsm, acsm_pattern_t *p) 
+/*
+ * returns the goto transition of a state on a byte, ACSM_FAIL_STATE if
+ * there is none; a root never fails
+ */
+static inline int
+goto_state(acsm_t *acsm, int state, unsigned char c)
 {
-	unsigned char *pattern;
-	int state;
-	int next;
-	int n;
+	int s;
 
-	n = p->n;
-	pattern = p->pattern;
-	state = 0;
+	if (state < acsm->num_groups)
+		return acsm->root_next[state][c];
 
-	/* match up pattern with existing states */ 
-	for (; n > 0; pattern++, n--) {
-		next = acsm->state_table[state].next_state[*pattern];
-		if (next == ACSM_FAIL_STATE)
-			break;
-		state = next;
+	/* the children are sorted by byte */
+	for (s = acsm->trie[state].child; s != ACSM_FAIL_STATE;
+	    s = acsm->trie[s].sibling) {
+		if (acsm->trie[s].byte >= c)
+			return (acsm->trie[s].byte == c) ? s : ACSM_FAIL_STATE;
 	}
 
-	/* add new states for the rest of the pattern bytes, 1 state per byte */
-	for (; n > 0; pattern++, n--) {
-		acsm->num_states++;
-		acsm->state_table[state].next_state[*pattern] =
-		    acsm->num_states;
-		state = acsm->num_states;
+	return ACSM_FAIL_STATE;
+}
+
+
+/*
+ * returns the length of the common prefix of two patterns
+ */
+static inline int
+common_prefix(acsm_pattern_t *p, acsm_pattern_t *q)
+{
+	int l;
+
+	for (l = 0; l < p->n && l < q->n && p->pattern[l] == q->pattern[l]; l++)
+		;
+
+	return l;
+}
+
+
+/*
+ * splits the first bytes into ranges of about the same number of trie
+ * states, one range per group; the patterns are sorted, so a pattern adds
+ * as many states as it has bytes past the prefix it shares with the
+ * previous one
+ */
+static void
+build_groups(acsm_t *acsm, acsm_pattern_t **sorted, int count)
+{
+	int i;
+	int g;
+	size_t sum;
+	size_t total;
+	size_t states[ALPHABET_SIZE];
+	acsm_pattern_t *prev;
+
+	memset(states, 0, sizeof(states));
+	prev = NULL;
+	for (i = 0; i < count; i++) {
+		if (sorted[i]->n == 0)
+			continue;
+		states[sorted[i]->pattern[0]] += sorted[i]->n -
+		    (prev ? common_prefix(sorted[i], prev) : 0);
+		prev = sorted[i];
 	}
 
-	add_match_list_entry(acsm, state, p);
+	total = 0;
+	for (i = 0; i < ALPHABET_SIZE; i++)
+		total += states[i];
+
+	/* close a group once the groups so far hold their share */
+	sum = 0;
+	for (g = 0, i = 0; i < ALPHABET_SIZE; i++) {
+		acsm->group_of[i] = g;
+		sum += states[i];
+		if (g < acsm->num_groups - 1 &&
+		    sum * acsm->num_groups >= total * (g + 1))
+			g++;
+	}
 
 	return;
 }
 
 
 /*
- * builds Non-Deterministic Finite Automata
- */ 
+ * builds the trie with sparse goto edges
+ *
+ * the patterns are inserted in sorted order, so each pattern shares its
+ * path with the previous one up to their common prefix and every new edge
+ * has a larger byte than the edges already leaving its parent; the
+ * children lists end up sorted without any searching
+ *
+ * the groups are ranges of first bytes, so they are built one after the
+ * other, each under its own root, and the states of a group are adjacent
+ */
 static void
-build_NFA(acsm_t *acsm) 
+build_trie(acsm_t *acsm)
 {
 	int i;
-	int r;
-	int s;
-	int fs;
+	int l;
+	int d;
+	int g;
 	int next;
-	queue_t q;
-	queue_t *queue;
-	acsm_pattern_t *mlist;
-	acsm_pattern_t *px;
+	int count;
+	int *path;
+	acsm_pattern_t *p;
+	acsm_pattern_t *prev;
+	acsm_pattern_t **sorted;
 
-	mlist = 0;
-	px = 0;
-	queue = &q;
+	sorted = (acsm_pattern_t **)ac_malloc(sizeof(acsm_pattern_t *) *
+	    (acsm->num_patterns + 1));
+	MEMASSERT(sorted, "build_trie");
 
-	/* init a queue */ 
-	queue_init(queue);
+	/* deleted patterns leave holes in the indices */
+	for (count = 0, p = acsm->patterns; p != NULL; p = p->next)
+		sorted[count++] = p;
+	qsort(sorted, count, sizeof(acsm_pattern_t *), pattern_cmp);
 
-	/* add the state 0 transitions 1st */ 
-	for (i = 0; i < ALPHABET_SIZE; i++) {
-		s = acsm->state_table[0].next_state[i];
-		if (s) {
-			queue_add(queue, s);
-			acsm->state_table[s].fail_state = 0;
-		}
-	}
-
-	/* build the fail state transitions for each valid state */ 
-	while (queue_count(queue) > 0) {
-		r = queue_remove(queue);
-
-		/* find final states for any failure */ 
-		for (i = 0; i < ALPHABET_SIZE; i++) {
-			if ((s = acsm->state_table[r].next_state[i]) !=
-			    ACSM_FAIL_STATE) {
-				queue_add(queue, s);
-				fs = acsm->state_table[r].fail_state;
-
-				/* 
-				 * locate the next valid state for 'i'
-				 * starting at s 
-				 */ 
-				while ((next =
-				    acsm->state_table[fs].next_state[i]) ==
-				    ACSM_FAIL_STATE) {
-					fs = acsm->state_table[fs].fail_state;
-				}
+	/* states on the path of the previous pattern, by depth */
+	path = (int *)ac_malloc(sizeof(int) * (acsm->max_pattern_len + 1));
+	MEMASSERT(path, "build_trie");
 
-				/*
-				 * update 's' state failure state to point to
-				 * the next valid state
-				 */ 
-				acsm->state_table[s].fail_state = next;
-
-				/*
-				 * copy 'next'states match_list to 's' states
-				 * match_list, we copy them so each list can be 
-				 * ac_free'd later, else we could just
-				 * manipulate pointers to fake the copy.
-				 */ 
-				for (mlist = acsm->state_table[next].match_list; 
-				    mlist != NULL ; mlist = mlist->next) {
-					px = copy_match_list_entry(mlist);
-
-					if (!px)
-						printf("ERROR: no memory\n");
-
-					/* insert at front of match_list */ 
-					px->next =
-					    acsm->state_table[s].match_list;
-					acsm->state_table[s].match_list = px;
-					acsm->state_table[s].num_finals++;
-				}
-			}
+	build_groups(acsm, sorted, count);
+
+	/* a root leads back to itself on the bytes it has no edge for */
+	for (g = 0; g < acsm->num_groups; g++) {
+		init_state(acsm, g, 0);
+		acsm->trie[g].fail_state = g;
+		for (i = 0; i < ALPHABET_SIZE; i++)
+			acsm->root_next[g][i] = g;
+	}
+	acsm->num_states = acsm->num_groups;
+
+	for (i = 0; i < acsm->num_patterns; i++) {
+		acsm->out_next[i] = -1;
+		acsm->out_state[i] = -1;
+	}
+
+	prev = NULL;
+	for (i = 0; i < count; i++) {
+		p = sorted[i];
+
+		/* an empty pattern never matches */
+		if (p->n == 0)
+			continue;
+
+		/* a group starts a trie of its own */
+		g = acsm->group_of[p->pattern[0]];
+		if (prev && acsm->group_of[prev->pattern[0]] != g)
+			prev = NULL;
+		path[0] = g;
+
+		/* the common prefix with the previous pattern is in place */
+		l = prev ? common_prefix(p, prev) : 0;
+
+		/* add new states for the rest of the pattern bytes */
+		for (d = l; d < p->n; d++) {
+			next = acsm->num_states++;
+			init_state(acsm, next, p->pattern[d]);
+
+			/* the previous pattern owns the last edge of path[d] */
+			if (d == l && prev && l < prev->n)
+				acsm->trie[path[d + 1]].sibling = next;
+			else
+				acsm->trie[path[d]].child = next;
+			if (d == 0)
+				acsm->root_next[g][p->pattern[d]] = next;
+
+			path[d + 1] = next;
 		}
+
+		/* equal patterns end in the same state, chain them by index */
+		if (l == p->n && prev->n == p->n)
+			acsm->out_next[prev->index] = p->index;
+		else
+			acsm->trie[path[p->n]].output = p->index;
+		acsm->out_state[p->index] = path[p->n];
+
+		prev = p;
 	}
 
-	/* clean up the queue */
-	queue_free(queue);
+	ac_free(path);
+	ac_free(sorted);
 
 	return;
 }
 
 
 /*
- * builds a Deterministic Finite Automaton from NFA
- */ 
-static void
-convert_NFA_to_DFA(acsm_t *acsm) 
+ * returns a new trie state for an edge on byte; the states of deleted
+ * patterns are reused first, then the trie grows with some slack, which
+ * the serialized DFA keeps as spare rows
+ */
+static int
+new_state(acsm_t *acsm, unsigned char byte)
 {
-	int i;
-	int r;
 	int s;
-	queue_t q;
-	queue_t *queue;
+	int max_states;
+	acsm_state_t *trie;
+	unsigned char *dirty;
 
-	queue = &q;
+	if (acsm->free_state != ACSM_FAIL_STATE) {
+		s = acsm->free_state;
+		acsm->free_state = acsm->trie[s].sibling;
+	} else {
+		if (acsm->num_states == acsm->max_states) {
+			max_states = acsm->max_states +
+			    acsm->max_states / 8 + 64;
+			trie = realloc(acsm->trie,
+			    sizeof(acsm_state_t) * max_states);
+			MEMASSERT(trie, "new_state");
+			dirty = realloc(acsm->dirty, max_states);
+			MEMASSERT(dirty, "new_state");
+			memset(dirty + acsm->max_states, 0,
+			    max_states - acsm->max_states);
+			acsm->trie = trie;
+			acsm->dirty = dirty;
+			acsm->max_states = max_states;
+		}
+		s = acsm->num_states++;
+	}
 
-	/* init a queue */ 
-	queue_init(queue);
+	init_state(acsm, s, byte);
+	acsm->dirty[s] = ACSM_ROW_STALE | ACSM_ROW_NEW;
 
-	/* add the state 0 transitions 1st */ 
-	for (i = 0; i < ALPHABET_SIZE; i++) {
-		s = acsm->state_table[0].next_state[i];
-		if (s)
-			queue_add(queue, s);
-	}
+	return s;
+}
 
-	/* start building the next layer of transitions */ 
-	while (queue_count(queue) > 0) {
-		r = queue_remove(queue);
 
-		/* state is a branch state */ 
-		for (i = 0; i < ALPHABET_SIZE; i++) {
-			if ((s = acsm->state_table[r].next_state[i]) !=
-			    ACSM_FAIL_STATE) {
-				queue_add(queue, s);
-			} else {
-				acsm->state_table[r].next_state[i] =
-				    acsm->state_table[acsm->state_table[r].
-				    fail_state].next_state[i];
-			}
-		}
-	}
+/*
+ * adds the edge r -> s, keeping the children of r sorted by byte
+ */
+static void
+link_child(acsm_t *acsm, int r, int s)
+{
+	int *prev;
+	unsigned char c;
+
+	c = acsm->trie[s].byte;
+	for (prev = &acsm->trie[r].child; *prev != ACSM_FAIL_STATE &&
+	    acsm->trie[*prev].byte < c; prev = &acsm->trie[*prev].sibling)
+		;
+	acsm->trie[s].sibling = *prev;
+	*prev = s;
 
-	/* clean up the queue */ 
-	queue_free(queue);
+	if (r < acsm->num_groups)
+		acsm->root_next[r][c] = s;
+	acsm->dirty[r] |= ACSM_ROW_STALE;
 
 	return;
 }
 
 
-/* ================================== API =================================== */
-
-
 /*
- * creates a new Aho-Corasick state machine
- */ 
-acsm_t *
-acsm_new(void) 
+ * removes the edge r -> s and gives s back for reuse
+ */
+static void
+unlink_child(acsm_t *acsm, int r, int s)
 {
-	acsm_t *p;
+	int *prev;
 
-	init_xlatcase();
-	p = (acsm_t *)ac_malloc(sizeof(acsm_t));
-	MEMASSERT(p, "acsm_new");
+	for (prev = &acsm->trie[r].child; *prev != s;
+	    prev = &acsm->trie[*prev].sibling)
+		;
+	*prev = acsm->trie[s].sibling;
 
-	if (p)
-		memset(p, 0, sizeof(acsm_t));
+	if (r < acsm->num_groups)
+		acsm->root_next[r][acsm->trie[s].byte] = r;
+	acsm->dirty[r] |= ACSM_ROW_STALE;
 
-	return p;
+	/* a free state is marked by its failure state */
+	init_state(acsm, s, 0);
+	acsm->trie[s].fail_state = ACSM_FAIL_STATE;
+	acsm->trie[s].sibling = acsm->free_state;
+	acsm->free_state = s;
+
+	return;
 }
 
 
 /*
- * adds a pattern to the list of patterns for this state machine
- */ 
-void
-acsm_add_pattern(acsm_t *acsm, unsigned char *pat, int n, int nocase,
-    int offset, int depth, void *id, int iid) 
+ * orders the states breadth first and records where each depth starts;
+ * a state only depends on shallower states while it is compiled, so the
+ * states of a depth can be compiled in parallel; the roots are the first
+ * depth
+ */
+static void
+build_levels(acsm_t *acsm)
 {
-	acsm_pattern_t *plist;
+	int i;
+	int s;
+	int end;
+	int tail;
+
+	ac_free(acsm->order);
+	ac_free(acsm->levels);
+	acsm->order = (int *)ac_malloc(sizeof(int) * acsm->num_states);
+	MEMASSERT(acsm->order, "build_levels");
+	acsm->levels = (int *)ac_malloc(sizeof(int) *
+	    (acsm->max_pattern_len + 2));
+	MEMASSERT(acsm->levels, "build_levels");
+
+	for (i = 0; i < acsm->num_groups; i++)
+		acsm->order[i] = i;
+	acsm->levels[0] = 0;
+	acsm->num_levels = 0;
+	tail = acsm->num_groups;
+	for (i = 0; i < tail; i = end) {
+		end = tail;
+		acsm->levels[++acsm->num_levels] = end;
+		for (; i < end; i++)
+			for (s = acsm->trie[acsm->order[i]].child;
+			    s != ACSM_FAIL_STATE; s = acsm->trie[s].sibling)
+				acsm->order[tail++] = s;
+	}
 
-	plist = (acsm_pattern_t *)ac_malloc(sizeof(acsm_pattern_t));
-	MEMASSERT(plist, "acsmAddPattern");
-	plist->pattern = (unsigned char *)ac_malloc(n);
-	MEMASSERT(plist->pattern, "acsmAddPattern");
-	convert_case_ex(plist->pattern, pat, n);
-	plist->casepattern = (unsigned char *)ac_malloc(n);
-	MEMASSERT(plist->casepattern, "acsmAddPattern");
-	memcpy(plist->casepattern, pat, n);
+	return;
+}
 
-	plist->n	= n;
-	plist->nocase	= nocase;
-	plist->offset	= offset;
-	plist->depth	= depth;
-	plist->id	= id;
-	plist->iid	= iid;
-	plist->index	= acsm->num_patterns;
-	plist->next	= acsm->patterns;
 
-	acsm->patterns	= plist;
+/*
+ * orders the states by their visits (most first), then breadth first
+ */
+static int
+rank_cmp(const void *a, const void *b)
+{
+	const acsm_rank_t *p;
+	const acsm_rank_t *q;
 
-	acsm->num_patterns++;
+	p = (const acsm_rank_t *)a;
+	q = (const acsm_rank_t *)b;
 
-	if (n > acsm->max_pattern_len)
-		acsm->max_pattern_len = n;
+	if (p->hits != q->hits)
+		return (p->hits > q->hits) ? -1 : 1;
 
-	return;
+	return p->bfs - q->bfs;
 }
 
 
 /*
- * compiles the state machine
- */ 
-void
-acsm_compile(acsm_t *acsm) 
+ * renumbers the states so that the rows the scan reads the most are
+ * adjacent in the serialized DFA; the roots keep their numbers and the
+ * states of each group follow each other breadth first, so the shallow
+ * states, where most transitions stay, share cache lines and pages
+ *
+ * if a sample was profiled with acsm_profile(), the states of a group are
+ * ordered by their visits instead, the unvisited ones breadth first after
+ * them
+ */
+static void
+renumber_states(acsm_t *acsm)
 {
 	int i;
-	int k;
-	acsm_pattern_t *plist;
+	int g;
+	int s;
+	int n;
+	int head;
+	int tail;
+	int num;
+	int *new_of;
+	int *queue;
+	acsm_rank_t *rank;
+	acsm_state_t *trie;
+	unsigned char *dirty;
+
+	new_of = (int *)ac_malloc(sizeof(int) * acsm->num_states);
+	MEMASSERT(new_of, "renumber_states");
+	queue = (int *)ac_malloc(sizeof(int) * acsm->num_states);
+	MEMASSERT(queue, "renumber_states");
+	rank = (acsm_rank_t *)ac_malloc(sizeof(acsm_rank_t) *
+	    acsm->num_states);
+	MEMASSERT(rank, "renumber_states");
+
+	for (s = 0; s < acsm->num_states; s++)
+		new_of[s] = ACSM_FAIL_STATE;
+
+	num = acsm->num_groups;
+	for (g = 0; g < acsm->num_groups; g++) {
+		new_of[g] = g;
+
+		/* the states of the group, breadth first */
+		head = tail = 0;
+		queue[tail++] = g;
+		for (n = 0; head < tail; head++)
+			for (s = acsm->trie[queue[head]].child;
+			    s != ACSM_FAIL_STATE; s = acsm->trie[s].sibling) {
+				queue[tail++] = s;
+				rank[n].hits = (s < acsm->num_hits) ?
+				    acsm->hits[s] : 0;
+				rank[n].bfs = n;
+				rank[n].state = s;
+				n++;
+			}
 
-	/* count number of states */ 
-	acsm->max_states = 1;
-	for (plist = acsm->patterns; plist != NULL; plist = plist->next)
-		acsm->max_states += plist->n;
-	acsm->state_table =
-	    (acsm_state_table_t *)ac_malloc(sizeof(acsm_state_table_t) *
-	    acsm->max_states);
-	MEMASSERT(acsm->state_table, "Could not allocate state table");
-	memset(acsm->state_table, 0, sizeof(acsm_state_table_t) *
+		if (acsm->hits)
+			qsort(rank, n, sizeof(acsm_rank_t), rank_cmp);
+		for (i = 0; i < n; i++)
+			new_of[rank[i].state] = num++;
+	}
+
+	/* the free states of deleted patterns go last */
+	for (s = acsm->free_state; s != ACSM_FAIL_STATE;
+	    s = acsm->trie[s].sibling)
+		new_of[s] = num++;
+
+	trie = (acsm_state_t *)ac_malloc(sizeof(acsm_state_t) *
 	    acsm->max_states);
+	MEMASSERT(trie, "renumber_states");
+	dirty = (unsigned char *)ac_malloc(acsm->max_states);
+	MEMASSERT(dirty, "renumber_states");
 
-	/* initialize state zero as a branch */ 
-	acsm->num_states = 0;
+	for (s = 0; s < acsm->num_states; s++) {
+		trie[new_of[s]] = acsm->trie[s];
+		dirty[new_of[s]] = acsm->dirty[s];
+	}
+	for (s = 0; s < acsm->num_states; s++) {
+		if (trie[s].child != ACSM_FAIL_STATE)
+			trie[s].child = new_of[trie[s].child];
+		if (trie[s].sibling != ACSM_FAIL_STATE)
+			trie[s].sibling = new_of[trie[s].sibling];
+		if (trie[s].fail_state != ACSM_FAIL_STATE)
+			trie[s].fail_state = new_of[trie[s].fail_state];
+	}
 
-	/* initialize all states next_states to FAILED */ 
-	for (k = 0; k < acsm->max_states; k++)
+	for (g = 0; g < acsm->num_groups; g++)
 		for (i = 0; i < ALPHABET_SIZE; i++)
-			acsm->state_table[k].next_state[i] = ACSM_FAIL_STATE;
+			acsm->root_next[g][i] = new_of[acsm->root_next[g][i]];
+	for (i = 0; i < acsm->num_patterns; i++)
+		if (acsm->out_state[i] != -1)
+			acsm->out_state[i] = new_of[acsm->out_state[i]];
+	if (acsm->free_state != ACSM_FAIL_STATE)
+		acsm->free_state = new_of[acsm->free_state];
 
-	/* add each pattern to the state table */ 
-	for (plist = acsm->patterns; plist != NULL; plist = plist->next)
-		add_pattern_states(acsm, plist);
+	ac_free(acsm->trie);
+	ac_free(acsm->dirty);
+	acsm->trie = trie;
+	acsm->dirty = dirty;
 
-	/* set all failed state transitions to return to the 0'th state */ 
-	for (i = 0; i < ALPHABET_SIZE; i++)
-		if (acsm->state_table[0].next_state[i] == ACSM_FAIL_STATE)
-			acsm->state_table[0].next_state[i] = 0;
+	/* the visits were counted for the old numbers */
+	ac_free(acsm->hits);
+	acsm->hits = NULL;
+	acsm->num_hits = 0;
 
-	/* build the NFA  */ 
-	build_NFA(acsm);
+	ac_free(rank);
+	ac_free(queue);
+	ac_free(new_of);
 
-	/* convert the NFA to a DFA */ 
-	convert_NFA_to_DFA(acsm);
+	build_levels(acsm);
 
 	return;
 }
 
 
 /*
- * Creates the serialized DFA state table and transfers it to the device 
+ * returns the number of threads that compile the automaton
  */
-void
-acsm_gen_state_table(acsm_t *acsm, int mapped, cl_context ctx,
-    cl_command_queue queue)
+static int
+pool_threads(acsm_t *acsm)
 {
-	FILE *fp;
-	int i;
-	int j;
-	int k;
-	int e;
-	int state;
-	int max_finals;
-	int *finals;
-	int temp_state[ALPHABET_SIZE];
-	acsm_pattern_t *temp_ml;
+	long n;
 
-	acsm->num_states = acsm->num_states + 1;
+	if (acsm->num_states < ACSM_POOL_MIN_STATES)
+		return 1;
 
-	/* allocate host and device memory for the serialized DFA */
-	acsm->d_trans = clCreateBuffer(ctx,
-	    CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, (size_t)2 *
-	    (size_t)ALPHABET_SIZE * (size_t)acsm->num_states * sizeof(cl_int),
-	    NULL, &e);
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1)
+		return 1;
+
+	return (n > ACSM_POOL_MAX_THREADS) ? ACSM_POOL_MAX_THREADS : (int)n;
+}
+
+
+/*
+ * compile thread: claims chunks of states of a level until none is left
+ * and waits for the other threads before the next level
+ */
+static void *
+pool_worker(void *arg)
+{
+	int i;
+	int l;
+	int end;
+	int last;
+	acsm_t *acsm;
+	acsm_pool_t *pool;
+
+	pool = (acsm_pool_t *)arg;
+	acsm = pool->acsm;
+
+	for (l = 0; l < acsm->num_levels; l++) {
+		last = acsm->levels[l + 1];
+		while ((i = __sync_fetch_and_add(&pool->claimed[l],
+		    ACSM_POOL_CHUNK)) < last) {
+			end = (i + ACSM_POOL_CHUNK < last) ?
+			    i + ACSM_POOL_CHUNK : last;
+			for (; i < end; i++)
+				pool->fn(acsm, acsm->order[i], pool->arg);
+		}
+
+		if (pool->num_threads > 1)
+			pthread_barrier_wait(&pool->barrier);
+	}
+
+	return NULL;
+}
+
+
+/*
+ * runs fn on each state, level by level, with the calling thread and the
+ * compile threads
+ */
+static void
+pool_run(acsm_t *acsm, void (*fn)(acsm_t *, int, void *), void *arg)
+{
+	int i;
+	int e;
+	acsm_pool_t pool;
+	pthread_t threads[ACSM_POOL_MAX_THREADS];
+
+	pool.acsm = acsm;
+	pool.fn = fn;
+	pool.arg = arg;
+	pool.num_threads = pool_threads(acsm);
+	pool.claimed = (int *)ac_malloc(sizeof(int) * acsm->num_levels);
+	MEMASSERT(pool.claimed, "pool_run");
+	memcpy(pool.claimed, acsm->levels, sizeof(int) * acsm->num_levels);
+
+	if (pool.num_threads > 1) {
+		e = pthread_barrier_init(&pool.barrier, NULL,
+		    pool.num_threads);
+		if (e != 0)
+			ERRXV(1, "ERROR: pthread_barrier_init: %d\n", e);
+	}
+
+	for (i = 1; i < pool.num_threads; i++) {
+		e = pthread_create(&threads[i], NULL, pool_worker, &pool);
+		if (e != 0)
+			ERRXV(1, "ERROR: pthread_create: %d thread: %d\n", e, i);
+	}
+
+	pool_worker(&pool);
+
+	for (i = 1; i < pool.num_threads; i++) {
+		e = pthread_join(threads[i], NULL);
+		if (e != 0)
+			ERRXV(1, "ERROR: pthread_join: %d thread: %d\n", e, i);
+	}
+
+	if (pool.num_threads > 1)
+		pthread_barrier_destroy(&pool.barrier);
+	ac_free(pool.claimed);
+
+	return;
+}
+
+
+/*
+ * computes the failure transitions and the outputs of the children of r;
+ * dict holds the closest suffix state ending a pattern of each state
+ *
+ * a row is marked stale if its failure state changes, and the row of r if
+ * a child becomes or stops being a final state, so that acsm_update() only
+ * recomputes those
+ */
+static void
+fail_states(acsm_t *acsm, int r, void *arg)
+{
+	int s;
+	int f;
+	int fs;
+	int next;
+	int last;
+	int match;
+	int *dict;
+
+	dict = (int *)arg;
+
+	for (s = acsm->trie[r].child; s != ACSM_FAIL_STATE;
+	    s = acsm->trie[s].sibling) {
+		/* locate the next valid state starting at r's failure */
+		f = r;
+		if (r >= acsm->num_groups) {
+			fs = acsm->trie[r].fail_state;
+			while ((next = goto_state(acsm, fs,
+			    acsm->trie[s].byte)) == ACSM_FAIL_STATE)
+				fs = acsm->trie[fs].fail_state;
+			f = next;
+		}
+		if (acsm->trie[s].fail_state != f)
+			acsm->dirty[s] |= ACSM_ROW_STALE;
+		acsm->trie[s].fail_state = f;
+
+		/* last pattern ending exactly here */
+		last = acsm->trie[s].output;
+		if (last != -1)
+			while (acsm->out_next[last] != -1 &&
+			    acsm->out_state[acsm->out_next[last]] == s)
+				last = acsm->out_next[last];
+
+		/* first pattern of the output set */
+		match = acsm->trie[s].output;
+		if (match == -1)
+			match = acsm->trie[f].match;
+		if ((match == -1) != (acsm->trie[s].match == -1))
+			acsm->dirty[r] |= ACSM_ROW_STALE;
+		acsm->trie[s].match = match;
+
+		/* link to the patterns of the closest suffix */
+		if (acsm->trie[f].output != -1)
+			dict[s] = f;
+		else
+			dict[s] = dict[f];
+		if (last != -1)
+			acsm->out_next[last] = (dict[s] != -1) ?
+			    acsm->trie[dict[s]].output : -1;
+	}
+
+	return;
+}
+
+
+/*
+ * computes the failure transitions and the outputs of each state
+ *
+ * the patterns ending in a state are chained to the first pattern of the
+ * closest proper suffix that ends a pattern, so the output set of a state
+ * is the chain starting at its first pattern
+ *
+ * the failure state of a child is shallower than the child, so the levels
+ * are processed in order and the states of a level in parallel
+ */
+static void
+build_fail_states(acsm_t *acsm)
+{
+	int g;
+	int *dict;		/* closest suffix state ending a pattern */
+
+	dict = (int *)ac_malloc(sizeof(int) * acsm->num_states);
+	MEMASSERT(dict, "build_fail_states");
+
+	for (g = 0; g < acsm->num_groups; g++)
+		dict[g] = -1;
+	pool_run(acsm, fail_states, dict);
+
+	ac_free(dict);
+
+	return;
+}
+
+
+/*
+ * returns the size of the output set pattern ids; never zero, since
+ * OpenCL buffers can not be empty
+ */
+static inline size_t
+outputs_size(acsm_t *acsm)
+{
+	return (size_t)((acsm->num_outputs > 0) ? acsm->num_outputs : 1) *
+	    sizeof(cl_int);
+}
+
+
+/*
+ * returns the size of the case verification table, one pair per pattern
+ */
+static inline size_t
+verify_size(acsm_t *acsm)
+{
+	return (size_t)((acsm->num_patterns > 0) ? acsm->num_patterns : 1) *
+	    2 * sizeof(cl_int);
+}
+
+
+/*
+ * returns the size of the match window table, one pair per pattern
+ */
+static inline size_t
+window_size(acsm_t *acsm)
+{
+	return (size_t)((acsm->num_patterns > 0) ? acsm->num_patterns : 1) *
+	    2 * sizeof(cl_int);
+}
+
+
+/*
+ * returns the size of the signature table, one program offset per pattern
+ */
+static inline size_t
+sigs_size(acsm_t *acsm)
+{
+	return (size_t)((acsm->num_patterns > 0) ? acsm->num_patterns : 1) *
+	    sizeof(cl_int);
+}
+
+
+/*
+ * returns the size of the signature programs, never zero
+ */
+static inline size_t
+sig_code_size(acsm_t *acsm)
+{
+	return ((acsm->sig_size > 0) ? acsm->sig_size : 1) * sizeof(cl_int);
+}
+
+
+/*
+ * returns the size of the original case pattern bytes, never zero
+ */
+static inline size_t
+case_size(acsm_t *acsm)
+{
+	return (acsm->case_size > 0) ? acsm->case_size : 1;
+}
+
+
+/*
+ * returns the size of the serialized DFA, including the spare rows
+ */
+static inline size_t
+trans_size(acsm_t *acsm)
+{
+	return (size_t)acsm->num_classes * acsm->trans_rows *
+	    acsm->state_size;
+}
+
+
+/*
+ * returns the size of the output set offsets, including the spare rows
+ */
+static inline size_t
+out_size(acsm_t *acsm)
+{
+	return (size_t)(acsm->trans_rows + 1) * sizeof(cl_int);
+}
+
+
+/*
+ * returns the size of all the tables transferred to the device
+ */
+static inline size_t
+tables_size(acsm_t *acsm)
+{
+	return trans_size(acsm) + out_size(acsm) + outputs_size(acsm) +
+	    verify_size(acsm) + window_size(acsm) + case_size(acsm) +
+	    sigs_size(acsm) + sig_code_size(acsm) + ALPHABET_SIZE;
+}
+
+
+/*
+ * returns the narrowest entry that fits every state; the entries are
+ * signed since final states are stored negated
+ */
+static inline int
+fit_state_size(int num_states)
+{
+	if (num_states - 1 <= SCHAR_MAX)
+		return sizeof(cl_char);
+	if (num_states - 1 <= SHRT_MAX)
+		return sizeof(cl_short);
+
+	return sizeof(cl_int);
+}
+
+
+/*
+ * reads a next state entry of the serialized DFA
+ */
+static inline int
+get_trans(acsm_t *acsm, size_t i)
+{
+	switch (acsm->state_size) {
+	case sizeof(cl_char):
+		return ((cl_char *)acsm->h_trans)[i];
+	case sizeof(cl_short):
+		return ((cl_short *)acsm->h_trans)[i];
+	default:
+		return ((cl_int *)acsm->h_trans)[i];
+	}
+}
+
+
+/*
+ * writes a next state entry to the serialized DFA
+ */
+static inline void
+set_trans(acsm_t *acsm, size_t i, int state)
+{
+	switch (acsm->state_size) {
+	case sizeof(cl_char):
+		((cl_char *)acsm->h_trans)[i] = (cl_char)state;
+		break;
+	case sizeof(cl_short):
+		((cl_short *)acsm->h_trans)[i] = (cl_short)state;
+		break;
+	default:
+		((cl_int *)acsm->h_trans)[i] = (cl_int)state;
+		break;
+	}
+
+	return;
+}
+
+
+/*
+ * fills the dense row of r: a copy of its failure state's row, which is
+ * shallower and done already, with the goto edges of r on top; the row of
+ * a root leads back to the root
+ */
+static void
+densify_row(acsm_t *acsm, int r, void *arg)
+{
+	int c;
+	int s;
+	int next;
+	size_t row;
+
+	row = (size_t)acsm->num_classes * acsm->state_size;
+
+	if (r < acsm->num_groups)
+		for (c = 0; c < acsm->num_classes; c++)
+			set_trans(acsm, (size_t)r * acsm->num_classes + c, r);
+	else
+		memcpy((char *)acsm->h_trans + row * r,
+		    (char *)acsm->h_trans + row * acsm->trie[r].fail_state,
+		    row);
+
+	for (s = acsm->trie[r].child; s != ACSM_FAIL_STATE;
+	    s = acsm->trie[s].sibling) {
+		/* final states are stored negated */
+		next = (acsm->trie[s].match != -1) ? -s : s;
+		set_trans(acsm, (size_t)r * acsm->num_classes +
+		    acsm->classmap[acsm->trie[s].byte], next);
+	}
+
+	return;
+}
+
+
+/*
+ * recomputes the dense row of r if it is stale or if the row of its failure
+ * state changed, and marks it changed if it differs from the device copy
+ */
+static void
+patch_row(acsm_t *acsm, int r, void *arg)
+{
+	size_t row;
+	unsigned char *entries;
+	unsigned char old[ALPHABET_SIZE * sizeof(cl_int)];
+
+	if (!(acsm->dirty[r] & ACSM_ROW_STALE) && (r < acsm->num_groups ||
+	    !(acsm->dirty[acsm->trie[r].fail_state] & ACSM_ROW_CHANGED)))
+		return;
+
+	row = (size_t)acsm->num_classes * acsm->state_size;
+	entries = (unsigned char *)acsm->h_trans + row * r;
+
+	memcpy(old, entries, row);
+	densify_row(acsm, r, arg);
+	if ((acsm->dirty[r] & ACSM_ROW_NEW) || memcmp(old, entries, row) != 0)
+		acsm->dirty[r] |= ACSM_ROW_CHANGED;
+
+	return;
+}
+
+
+/*
+ * checks that the serialized DFA can take the trie as is: the entries fit
+ * every state, there are enough rows and each byte of a new edge has a
+ * byte class of its own
+ */
+static int
+layout_fits(acsm_t *acsm)
+{
+	int i;
+	int s;
+	int c;
+	int key;
+
+	if (fit_state_size(acsm->num_states) > acsm->state_size ||
+	    acsm->num_states > acsm->trans_rows)
+		return 0;
+
+	for (s = acsm->num_groups; s < acsm->num_states; s++) {
+		if (!(acsm->dirty[s] & ACSM_ROW_NEW) ||
+		    acsm->trie[s].fail_state == ACSM_FAIL_STATE)
+			continue;
+
+		key = acsm->trie[s].byte;
+		c = acsm->classmap[key];
+		for (i = 0; i < ALPHABET_SIZE; i++)
+			if (acsm->classmap[i] == c &&
+			    (acsm->fold ? xlatcase[i] : i) != key)
+				return 0;
+	}
+
+	return 1;
+}
+
+
+/*
+ * groups the input bytes into equivalence classes; two bytes belong to the
+ * same class if every state of the DFA has the same transition on both
+ *
+ * a byte that labels a trie edge leads to a state no other byte reaches,
+ * so it gets a class of its own; all the other bytes lead back to the
+ * root of the group from every state and share a single class
+ *
+ * a case folded automaton maps both cases of a letter to one class, so
+ * the input is folded by the class lookup at no extra cost
+ */
+static void
+build_byte_classes(acsm_t *acsm)
+{
+	int i;
+	int s;
+	int key;
+	int other;
+	int num_classes;
+	int cls[ALPHABET_SIZE];
+	unsigned char used[ALPHABET_SIZE];
+
+	memset(used, 0, sizeof(used));
+	for (s = acsm->num_groups; s < acsm->num_states; s++)
+		if (acsm->trie[s].fail_state != ACSM_FAIL_STATE)
+			used[acsm->trie[s].byte] = 1;
+
+	for (i = 0; i < ALPHABET_SIZE; i++)
+		cls[i] = -1;
+
+	other = -1;
+	num_classes = 0;
+	for (i = 0; i < ALPHABET_SIZE; i++) {
+		key = acsm->fold ? xlatcase[i] : i;
+		if (used[key]) {
+			if (cls[key] == -1)
+				cls[key] = num_classes++;
+			acsm->classmap[i] = cls[key];
+			continue;
+		}
+		if (other == -1)
+			other = num_classes++;
+		acsm->classmap[i] = other;
+	}
+
+	acsm->num_classes = num_classes;
+
+	return;
+}
+
+
+/*
+ * marks the bytes that leave the root of each group, in 32 bit words; the
+ * other bytes lead back to the root, so the scan may skip them there
+ */
+static void
+build_start_bytes(acsm_t *acsm)
+{
+	int g;
+	int i;
+
+	memset(acsm->start_bytes, 0, sizeof(acsm->start_bytes));
+	for (g = 0; g < acsm->num_groups; g++)
+		for (i = 0; i < ALPHABET_SIZE; i++)
+			if (get_trans(acsm, (size_t)g * acsm->num_classes +
+			    acsm->classmap[i]) != g)
+				acsm->start_bytes[g][i / 32] |= 1U << (i % 32);
+
+	return;
+}
+
+
+/*
+ * builds the output sets in CSR form: the patterns of state s are
+ * h_out_ids[h_out[s]] up to h_out_ids[h_out[s + 1]]
+ */
+static void
+build_outputs(acsm_t *acsm)
+{
+	int s;
+	int p;
+	int num_outputs;
+
+	num_outputs = 0;
+	for (s = 0; s < acsm->num_states; s++)
+		for (p = acsm->trie[s].match; p != -1; p = acsm->out_next[p])
+			num_outputs++;
+	acsm->num_outputs = num_outputs;
+
+	FREE(acsm->h_out_ids);
+	acsm->h_out_ids = MALLOC(outputs_size(acsm));
+	if (!acsm->h_out_ids)
+		 ERR(1, "ERROR: malloc h_out_ids");
+
+	num_outputs = 0;
+	for (s = 0; s < acsm->num_states; s++) {
+		acsm->h_out[s] = num_outputs;
+		for (p = acsm->trie[s].match; p != -1; p = acsm->out_next[p])
+			acsm->h_out_ids[num_outputs++] = p;
+	}
+	acsm->h_out[acsm->num_states] = num_outputs;
+
+	return;
+}
+
+
+/*
+ * collects the original bytes of the case sensitive patterns that a case
+ * folded automaton may match in the wrong case; h_verify holds an offset
+ * into h_case (-1 if the pattern needs no check) and the length of each
+ * pattern
+ */
+static void
+build_case_verify(acsm_t *acsm)
+{
+	size_t off;
+	acsm_pattern_t *p;
+
+	FREE(acsm->h_verify);
+	acsm->h_verify = MALLOC(verify_size(acsm));
+	if (!acsm->h_verify)
+		ERR(1, "ERROR: malloc h_verify");
+
+	acsm->case_size = 0;
+	for (p = acsm->patterns; p != NULL; p = p->next)
+		if (acsm->fold && !p->nocase && has_case(p->casepattern, p->n))
+			acsm->case_size += p->n;
+
+	FREE(acsm->h_case);
+	acsm->h_case = MALLOC(case_size(acsm));
+	if (!acsm->h_case)
+		ERR(1, "ERROR: malloc h_case");
+
+	/* deleted patterns leave holes, see acsm_delete_pattern() */
+	memset(acsm->h_verify, 0, verify_size(acsm));
+
+	off = 0;
+	for (p = acsm->patterns; p != NULL; p = p->next) {
+		acsm->h_verify[2 * p->index] = -1;
+		acsm->h_verify[2 * p->index + 1] = p->n;
+		if (acsm->fold && !p->nocase && has_case(p->casepattern, p->n)) {
+			acsm->h_verify[2 * p->index] = off;
+			memcpy(acsm->h_case + off, p->casepattern, p->n);
+			off += p->n;
+		}
+	}
+
+	return;
+}
+
+
+/*
+ * collects the offset and depth of each pattern in h_window; a pattern
+ * without either matches anywhere
+ */
+static void
+build_windows(acsm_t *acsm)
+{
+	acsm_pattern_t *p;
+
+	FREE(acsm->h_window);
+	acsm->h_window = MALLOC(window_size(acsm));
+	if (!acsm->h_window)
+		ERR(1, "ERROR: malloc h_window");
+
+	/* deleted patterns leave holes, see acsm_delete_pattern() */
+	memset(acsm->h_window, 0, window_size(acsm));
+
+	acsm->windowed = 0;
+	for (p = acsm->patterns; p != NULL; p = p->next) {
+		acsm->h_window[2 * p->index] = p->offset;
+		acsm->h_window[2 * p->index + 1] = p->depth;
+		if (p->offset > 0 || p->depth > 0)
+			acsm->windowed = 1;
+	}
+
+	return;
+}
+
+
+/*
+ * collects the programs of the signatures in h_sig_code; h_sigs holds the
+ * offset of the program of each pattern, -1 for a plain one
+ */
+static void
+build_signatures(acsm_t *acsm)
+{
+	size_t off;
+	acsm_pattern_t *p;
+
+	FREE(acsm->h_sigs);
+	acsm->h_sigs = MALLOC(sigs_size(acsm));
+	if (!acsm->h_sigs)
+		ERR(1, "ERROR: malloc h_sigs");
+
+	acsm->sig_size = 0;
+	for (p = acsm->patterns; p != NULL; p = p->next)
+		acsm->sig_size += p->sig_len;
+
+	FREE(acsm->h_sig_code);
+	acsm->h_sig_code = MALLOC(sig_code_size(acsm));
+	if (!acsm->h_sig_code)
+		ERR(1, "ERROR: malloc h_sig_code");
+
+	/* deleted patterns leave holes, see acsm_delete_pattern() */
+	memset(acsm->h_sigs, 0xff, sigs_size(acsm));
+
+	off = 0;
+	acsm->num_sigs = 0;
+	for (p = acsm->patterns; p != NULL; p = p->next) {
+		if (!p->sig)
+			continue;
+		acsm->h_sigs[p->index] = off;
+		memcpy(acsm->h_sig_code + off, p->sig,
+		    p->sig_len * sizeof(int));
+		off += p->sig_len;
+		acsm->num_sigs++;
+	}
+
+	return;
+}
+
+
+/*
+ * transfers the output set pattern ids, the case verification, the match
+ * window and the signature tables to the device, replacing any previous
+ * copy; their sizes change with the patterns
+ */
+static void
+upload_outputs(acsm_t *acsm, cl_context ctx, cl_command_queue queue)
+{
+	int e;
+
+	if (acsm->d_out_ids)
+		clReleaseMemObject(acsm->d_out_ids);
+	if (acsm->d_verify)
+		clReleaseMemObject(acsm->d_verify);
+	if (acsm->d_window)
+		clReleaseMemObject(acsm->d_window);
+	if (acsm->d_case)
+		clReleaseMemObject(acsm->d_case);
+	if (acsm->d_sigs)
+		clReleaseMemObject(acsm->d_sigs);
+	if (acsm->d_sig_code)
+		clReleaseMemObject(acsm->d_sig_code);
+
+	acsm->d_out_ids = clCreateBuffer(ctx,
+	    CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, outputs_size(acsm),
+	    NULL, &e);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: alloc d_out_ids: %s", clstrerror(e));
+
+	e = clEnqueueWriteBuffer(queue, acsm->d_out_ids, CL_TRUE, 0,
+	    outputs_size(acsm), acsm->h_out_ids, 0, NULL, NULL);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: write d_out_ids: %s", clstrerror(e));
+
+	acsm->d_verify = clCreateBuffer(ctx,
+	    CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, verify_size(acsm),
+	    NULL, &e);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: alloc d_verify: %s", clstrerror(e));
+
+	e = clEnqueueWriteBuffer(queue, acsm->d_verify, CL_TRUE, 0,
+	    verify_size(acsm), acsm->h_verify, 0, NULL, NULL);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: write d_verify: %s", clstrerror(e));
+
+	acsm->d_window = clCreateBuffer(ctx,
+	    CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, window_size(acsm),
+	    NULL, &e);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: alloc d_window: %s", clstrerror(e));
+
+	e = clEnqueueWriteBuffer(queue, acsm->d_window, CL_TRUE, 0,
+	    window_size(acsm), acsm->h_window, 0, NULL, NULL);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: write d_window: %s", clstrerror(e));
+
+	acsm->d_case = clCreateBuffer(ctx,
+	    CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, case_size(acsm),
+	    NULL, &e);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: alloc d_case: %s", clstrerror(e));
+
+	e = clEnqueueWriteBuffer(queue, acsm->d_case, CL_TRUE, 0,
+	    case_size(acsm), acsm->h_case, 0, NULL, NULL);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: write d_case: %s", clstrerror(e));
+
+	acsm->d_sigs = clCreateBuffer(ctx,
+	    CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, sigs_size(acsm),
+	    NULL, &e);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: alloc d_sigs: %s", clstrerror(e));
+
+	e = clEnqueueWriteBuffer(queue, acsm->d_sigs, CL_TRUE, 0,
+	    sigs_size(acsm), acsm->h_sigs, 0, NULL, NULL);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: write d_sigs: %s", clstrerror(e));
+
+	acsm->d_sig_code = clCreateBuffer(ctx,
+	    CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, sig_code_size(acsm),
+	    NULL, &e);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: alloc d_sig_code: %s", clstrerror(e));
+
+	e = clEnqueueWriteBuffer(queue, acsm->d_sig_code, CL_TRUE, 0,
+	    sig_code_size(acsm), acsm->h_sig_code, 0, NULL, NULL);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: write d_sig_code: %s", clstrerror(e));
+
+	return;
+}
+
+
+/*
+ * releases the serialized DFA and the output set offsets, on the host and
+ * on the device, before the automaton is serialized again
+ */
+static void
+release_tables(acsm_t *acsm, int mapped, cl_command_queue queue)
+{
+	if (mapped) {
+		clEnqueueUnmapMemObject(queue, acsm->d_trans, acsm->h_trans, 0,
+		    NULL, NULL);
+		clEnqueueUnmapMemObject(queue, acsm->d_out, acsm->h_out, 0,
+		    NULL, NULL);
+		clFinish(queue);
+	} else if (!acsm->map) {
+		FREE(acsm->h_trans);
+		FREE(acsm->h_out);
+	}
+	acsm->h_trans = NULL;
+	acsm->h_out = NULL;
+
+	/* a state machine kept on the host has no device copy */
+	if (!acsm->d_trans)
+		return;
+
+	clReleaseMemObject(acsm->d_trans);
+	if (acsm->d_trans_image)
+		clReleaseMemObject(acsm->d_trans_image);
+	acsm->d_trans_image = NULL;
+	clReleaseMemObject(acsm->d_out);
+	clReleaseMemObject(acsm->d_classmap);
+	clReleaseMemObject(acsm->d_start);
+	acsm->d_trans = NULL;
+
+	return;
+}
+
+
+/*
+ * frees the trie and the compile state, the patterns are kept
+ */
+static void
+free_trie(acsm_t *acsm)
+{
+	ac_free(acsm->trie);
+	acsm->trie = NULL;
+	acsm->max_states = 0;
+
+	ac_free(acsm->out_next);
+	ac_free(acsm->out_state);
+	ac_free(acsm->dirty);
+	acsm->out_next = NULL;
+	acsm->out_state = NULL;
+	acsm->dirty = NULL;
+
+	ac_free(acsm->order);
+	ac_free(acsm->levels);
+	acsm->order = NULL;
+	acsm->levels = NULL;
+	acsm->num_levels = 0;
+
+	ac_free(acsm->hits);
+	acsm->hits = NULL;
+	acsm->num_hits = 0;
+
+	return;
+}
+
+
+/*
+ * returns the value of a printable hex digit, -1 for any other character
+ */
+static int
+hex_nibble(int c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+
+	return -1;
+}
+
+
+/*
+ * parses the bytes of a signature up to a gap into the code of a part; s
+ * points past the parsed text on return
+ *
+ * ret:   0 on success
+ *       -1 if the signature is malformed
+ */
+static int
+parse_sig_part(char **s, int *code, int *n, acsm_sig_part_t *part)
+{
+	int b;
+	int hi;
+	int lo;
+	int alt;
+	int len;
+	int nalts;
+	char *p;
+	char *end;
+	long skip;
+
+	for (p = *s; *p && *p != '*'; ) {
+		if (*p == '{') {
+			/* {n} is a run of any bytes, {n-m} ends the part */
+			if (p[1] == '-')
+				break;
+			skip = strtol(p + 1, &end, 10);
+			if (end == p + 1)
+				return -1;
+			if (*end == '-')
+				break;
+			if (*end != '}' || skip <= 0 || skip > 0xffffff ||
+			    skip > INT_MAX - part->len)
+				return -1;
+			code[(*n)++] = (ACSM_SIG_SKIP << 24) | (int)skip;
+			part->len += skip;
+			p = end + 1;
+		} else if (*p == '(') {
+			/* alternatives, byte strings of the same size */
+			alt = (*n)++;
+			len = -1;
+			nalts = 0;
+			for (p++; ; p++) {
+				for (b = 0; (hi = hex_nibble(p[0])) != -1 &&
+				    (lo = hex_nibble(p[1])) != -1; b++, p += 2)
+					code[(*n)++] = hi << 4 | lo;
+				if (b == 0 || (len != -1 && b != len))
+					return -1;
+				len = b;
+				if (++nalts > ACSM_SIG_MAX_ALTS ||
+				    len > ACSM_SIG_MAX_ALTS)
+					return -1;
+				if (*p == ')')
+					break;
+				if (*p != '|')
+					return -1;
+			}
+			code[alt] = (ACSM_SIG_ALT << 24) | nalts << 12 | len;
+			part->len += len;
+			p++;
+		} else {
+			/* a byte, either nibble may be any */
+			if (p[0] == '\0' || p[1] == '\0')
+				return -1;
+			hi = (p[0] == '?') ? -2 : hex_nibble(p[0]);
+			lo = (p[1] == '?') ? -2 : hex_nibble(p[1]);
+			if (hi == -1 || lo == -1)
+				return -1;
+			code[(*n)++] = ((hi == -2) ? 0 : 0xf0) << 8 |
+			    ((lo == -2) ? 0 : 0x0f) << 8 |
+			    ((hi == -2) ? 0 : hi << 4) | ((lo == -2) ? 0 : lo);
+			part->len++;
+			p += 2;
+		}
+	}
+	*s = p;
+
+	return 0;
+}
+
+
+/*
+ * compiles a signature to its program and copies its anchor, the longest
+ * run of plain bytes; a signature of plain bytes only has no program
+ *
+ * ret:   0 on success
+ *       -1 if the signature is malformed, has too many parts or no anchor
+ */
+static int
+compile_signature(acsm_t *acsm, char *sig, int **prog, int *prog_len,
+    unsigned char *anchor, int *anchor_len)
+{
+	int i;
+	int k;
+	int n;
+	int pos;
+	int run;
+	int best;
+	int best_part;
+	int best_end;
+	int best_code;
+	int nparts;
+	int *code;
+	char *p;
+	char *end;
+	acsm_sig_part_t parts[ACSM_SIG_MAX_PARTS];
+
+	/* a word per byte at most, and one per set of alternatives */
+	code = MALLOC((strlen(sig) + 1) * sizeof(int));
+	if (!code)
+		ERR(1, "ERROR: malloc signature");
+
+	n = 0;
+	nparts = 0;
+	memset(parts, 0, sizeof(parts));
+	for (p = sig; ; ) {
+		parts[nparts].code = n;
+		if (parse_sig_part(&p, code, &n, &parts[nparts]) != 0 ||
+		    parts[nparts].len == 0)
+			goto fail;
+		nparts++;
+		if (*p == '\0')
+			break;
+
+		/* a gap: '*', {n-m}, {-m} or {n-} */
+		if (nparts == ACSM_SIG_MAX_PARTS)
+			goto fail;
+		parts[nparts].gap_max = -1;
+		if (*p == '*') {
+			p++;
+			continue;
+		}
+		if (*++p != '-') {
+			parts[nparts].gap_min = strtol(p, &end, 10);
+			if (end == p || parts[nparts].gap_min < 0)
+				goto fail;
+			p = end;
+		}
+		if (*p++ != '-')
+			goto fail;
+		if (*p != '}') {
+			parts[nparts].gap_max = strtol(p, &end, 10);
+			if (end == p || *end != '}' ||
+			    parts[nparts].gap_max < parts[nparts].gap_min)
+				goto fail;
+			p = end;
+		}
+		p++;
+	}
+
+	/* the anchor is the longest run of plain bytes */
+	best = 0;
+	best_part = 0;
+	best_end = 0;
+	best_code = 0;
+	for (k = 0; k < nparts; k++) {
+		pos = 0;
+		run = 0;
+		for (i = parts[k].code; pos < parts[k].len; i++) {
+			if ((code[i] >> 24) == ACSM_SIG_ALT) {
+				pos += code[i] & 0xfff;
+				i += ((code[i] >> 12) & 0xfff) *
+				    (code[i] & 0xfff);
+				run = 0;
+			} else if ((code[i] >> 24) == ACSM_SIG_SKIP) {
+				pos += code[i] & 0xffffff;
+				run = 0;
+			} else if ((code[i] >> 8) == 0xff) {
+				pos++;
+				if (++run > best) {
+					best = run;
+					best_part = k;
+					best_end = pos - 1;
+					best_code = i - run + 1;
+				}
+			} else {
+				pos++;
+				run = 0;
+			}
+		}
+	}
+	if (best < ACSM_SIG_MIN_ANCHOR)
+		goto fail;
+
+	for (i = 0; i < best; i++)
+		anchor[i] = code[best_code + i] & 0xff;
+	*anchor_len = best;
+
+	/* plain bytes only, nothing to verify */
+	if (nparts == 1 && best == parts[0].len) {
+		FREE(code);
+		*prog = NULL;
+		*prog_len = 0;
+		return 0;
+	}
+
+	*prog_len = ACSM_SIG_HDR + ACSM_SIG_PART * nparts + n;
+	*prog = arena_alloc(acsm, *prog_len * sizeof(int));
+
+	(*prog)[0] = nparts;
+	(*prog)[1] = best_part;
+	(*prog)[2] = best_end;
+	for (k = 0; k < nparts; k++) {
+		i = ACSM_SIG_HDR + ACSM_SIG_PART * k;
+		(*prog)[i] = parts[k].len;
+		(*prog)[i + 1] = parts[k].gap_min;
+		(*prog)[i + 2] = parts[k].gap_max;
+		(*prog)[i + 3] = ACSM_SIG_HDR + ACSM_SIG_PART * nparts +
+		    parts[k].code;
+	}
+	memcpy(*prog + ACSM_SIG_HDR + ACSM_SIG_PART * nparts, code,
+	    n * sizeof(int));
+	FREE(code);
+
+	return 0;
+
+fail:
+	FREE(code);
+
+	return -1;
+}
+
+
+/* ================================== API =================================== */
+
+
+/*
+ * creates a new Aho-Corasick state machine
+ */ 
+acsm_t *
+acsm_new(void) 
+{
+	acsm_t *p;
+
+	init_xlatcase();
+	p = (acsm_t *)ac_malloc(sizeof(acsm_t));
+	MEMASSERT(p, "acsm_new");
+
+	if (p) {
+		memset(p, 0, sizeof(acsm_t));
+		p->num_groups = 1;
+	}
+
+	return p;
+}
+
+
+/*
+ * sets the number of pattern groups the state machine is compiled to
+ */
+void
+acsm_set_groups(acsm_t *acsm, int num_groups)
+{
+	if (num_groups < 1)
+		num_groups = 1;
+	if (num_groups > ACSM_MAX_GROUPS)
+		num_groups = ACSM_MAX_GROUPS;
+
+	acsm->num_groups = num_groups;
+
+	return;
+}
+
+
+/*
+ * adds a pattern to the list of patterns for this state machine
+ */ 
+void
+acsm_add_pattern(acsm_t *acsm, unsigned char *pat, int n, int nocase,
+    int offset, int depth, void *id, int iid) 
+{
+	acsm_pattern_t *plist;
+
+	/* the pattern and both its copies are a single arena allocation */
+	plist = (acsm_pattern_t *)arena_alloc(acsm,
+	    sizeof(acsm_pattern_t) + 2 * n);
+	plist->pattern = (unsigned char *)(plist + 1);
+	memcpy(plist->pattern, pat, n);
+	plist->casepattern = plist->pattern + n;
+	memcpy(plist->casepattern, pat, n);
+
+	plist->n	= n;
+	plist->nocase	= nocase;
+	plist->offset	= offset;
+	plist->depth	= depth;
+	plist->id	= id;
+	plist->iid	= iid;
+	plist->index	= acsm->num_patterns;
+	plist->next	= acsm->patterns;
+
+	acsm->patterns	= plist;
+
+	acsm->num_patterns++;
+
+	if (n > acsm->max_pattern_len)
+		acsm->max_pattern_len = n;
+
+	return;
+}
+
+
+/*
+ * adds a ClamAV style signature, its anchor to the automaton and its
+ * program to the pattern
+ */
+int
+acsm_add_signature(acsm_t *acsm, char *sig, int offset, int depth, void *id,
+    int iid)
+{
+	int n;
+	int len;
+	int *prog;
+	unsigned char *anchor;
+
+	anchor = MALLOC(strlen(sig) / 2 + 1);
+	if (!anchor)
+		ERR(1, "ERROR: malloc anchor");
+
+	if (compile_signature(acsm, sig, &prog, &len, anchor, &n) != 0) {
+		FREE(anchor);
+		return -1;
+	}
+
+	acsm_add_pattern(acsm, anchor, n, 0, offset, depth, id, iid);
+	acsm->patterns->sig = prog;
+	acsm->patterns->sig_len = len;
+	FREE(anchor);
+
+	return 0;
+}
+
+
+/*
+ * compiles the state machine
+ */ 
+void
+acsm_compile(acsm_t *acsm) 
+{
+	acsm_state_t *trie;
+	acsm_pattern_t *plist;
+
+	/* at most one state per pattern byte, plus the roots */
+	acsm->max_states = acsm->num_groups;
+	acsm->fold = 0;
+	for (plist = acsm->patterns; plist != NULL; plist = plist->next) {
+		acsm->max_states += plist->n;
+		if (plist->nocase)
+			acsm->fold = 1;
+	}
+
+	/*
+	 * a single case insensitive pattern folds the whole automaton; the
+	 * case sensitive patterns are verified on a match instead
+	 */
+	if (acsm->fold)
+		for (plist = acsm->patterns; plist != NULL; plist = plist->next)
+			convert_case_ex(plist->pattern, plist->casepattern,
+			    plist->n);
+	acsm->trie = (acsm_state_t *)ac_malloc(sizeof(acsm_state_t) *
+	    acsm->max_states);
+	MEMASSERT(acsm->trie, "Could not allocate the trie");
+
+	acsm->out_next = (int *)ac_malloc(sizeof(int) *
+	    (acsm->num_patterns + 1));
+	MEMASSERT(acsm->out_next, "Could not allocate the outputs");
+	acsm->out_state = (int *)ac_malloc(sizeof(int) *
+	    (acsm->num_patterns + 1));
+	MEMASSERT(acsm->out_state, "Could not allocate the outputs");
+
+	/* add each pattern to the trie */
+	build_trie(acsm);
+
+	/* give back the states shared by common prefixes */
+	trie = realloc(acsm->trie, sizeof(acsm_state_t) * acsm->num_states);
+	if (trie) {
+		acsm->trie = trie;
+		acsm->max_states = acsm->num_states;
+	}
+	acsm->free_state = ACSM_FAIL_STATE;
+
+	acsm->dirty = (unsigned char *)ac_malloc(acsm->max_states);
+	MEMASSERT(acsm->dirty, "Could not allocate the row states");
+
+	/* number the states breadth first, each group on its own */
+	renumber_states(acsm);
+
+	/* build the failure transitions and the outputs */
+	build_fail_states(acsm);
+
+	return;
+}
+
+
+/*
+ * adds a pattern to a compiled state machine
+ */
+int
+acsm_insert_pattern(acsm_t *acsm, unsigned char *pat, int n, int nocase,
+    int offset, int depth, void *id, int iid)
+{
+	int d;
+	int s;
+	int next;
+	int last;
+	int index;
+	int *out;
+	acsm_pattern_t *p;
+
+	if (!acsm->trie)
+		return -1;
+
+	acsm_add_pattern(acsm, pat, n, nocase, offset, depth, id, iid);
+	p = acsm->patterns;
+	index = p->index;
+
+	out = realloc(acsm->out_next, sizeof(int) * (acsm->num_patterns + 1));
+	MEMASSERT(out, "acsm_insert_pattern");
+	acsm->out_next = out;
+	out = realloc(acsm->out_state, sizeof(int) * (acsm->num_patterns + 1));
+	MEMASSERT(out, "acsm_insert_pattern");
+	acsm->out_state = out;
+
+	acsm->out_next[index] = -1;
+	acsm->out_state[index] = -1;
+
+	/* the first case insensitive pattern folds the whole automaton */
+	if (nocase && !acsm->fold)
+		acsm->recompile = 1;
+
+	/* as does the first one with a window, for the matching program */
+	if ((offset > 0 || depth > 0) && !acsm->windowed)
+		acsm->recompile = 1;
+	if (acsm->recompile || n == 0)
+		return 0;
+
+	if (acsm->fold)
+		convert_case_ex(p->pattern, p->casepattern, n);
+
+	/* follow the pattern as far as it goes and add the rest */
+	s = acsm->group_of[p->pattern[0]];
+	for (d = 0; d < n; d++, s = next) {
+		next = goto_state(acsm, s, p->pattern[d]);
+		if (next == ACSM_FAIL_STATE || next == s) {
+			next = new_state(acsm, p->pattern[d]);
+			link_child(acsm, s, next);
+		}
+	}
+
+	/* append to the patterns ending here, which are sorted by index */
+	if (acsm->trie[s].output == -1) {
+		acsm->trie[s].output = index;
+	} else {
+		last = acsm->trie[s].output;
+		while (acsm->out_next[last] != -1 &&
+		    acsm->out_state[acsm->out_next[last]] == s)
+			last = acsm->out_next[last];
+		acsm->out_next[index] = acsm->out_next[last];
+		acsm->out_next[last] = index;
+	}
+	acsm->out_state[index] = s;
+
+	return 0;
+}
+
+
+/*
+ * removes the patterns with an ID from a compiled state machine
+ */
+int
+acsm_delete_pattern(acsm_t *acsm, int iid)
+{
+	int d;
+	int e;
+	int prev;
+	int count;
+	int *path;
+	acsm_pattern_t *p;
+	acsm_pattern_t **link;
+
+	if (!acsm->trie)
+		return -1;
+
+	path = (int *)ac_malloc(sizeof(int) * (acsm->max_pattern_len + 1));
+	MEMASSERT(path, "acsm_delete_pattern");
+
+	count = 0;
+	link = &acsm->patterns;
+	while ((p = *link) != NULL) {
+		if (p->iid != iid) {
+			link = &p->next;
+			continue;
+		}
+		*link = p->next;
+		count++;
+
+		/* the index is not reused, the pattern leaves a hole */
+		e = acsm->out_state[p->index];
+		if (e != -1 && !acsm->recompile) {
+			/* drop the pattern from the ones ending in e */
+			if (acsm->trie[e].output == (int)p->index) {
+				prev = acsm->out_next[p->index];
+				acsm->trie[e].output = (prev != -1 &&
+				    acsm->out_state[prev] == e) ? prev : -1;
+			} else {
+				for (prev = acsm->trie[e].output;
+				    acsm->out_next[prev] != (int)p->index;
+				    prev = acsm->out_next[prev])
+					;
+				acsm->out_next[prev] = acsm->out_next[p->index];
+			}
+
+			/* prune the states that lead to no pattern anymore */
+			path[0] = acsm->group_of[p->pattern[0]];
+			for (d = 0; d < p->n; d++)
+				path[d + 1] = goto_state(acsm, path[d],
+				    p->pattern[d]);
+			for (d = p->n; d > 0; d--) {
+				if (acsm->trie[path[d]].output != -1 ||
+				    acsm->trie[path[d]].child != ACSM_FAIL_STATE)
+					break;
+				unlink_child(acsm, path[d - 1], path[d]);
+			}
+		}
+		acsm->out_next[p->index] = -1;
+		acsm->out_state[p->index] = -1;
+
+		acsm->arena_dead += arena_pattern_size(p);
+	}
+
+	ac_free(path);
+
+	/* once the deleted patterns take half of the arena, drop them */
+	if (acsm->arena_dead >= ACSM_ARENA_BLOCK &&
+	    acsm->arena_dead >= acsm->arena_used / 2)
+		arena_compact(acsm);
+
+	return count;
+}
+
+
+/*
+ * counts the visits of each state over a block of sample traffic
+ */
+int
+acsm_profile(acsm_t *acsm, unsigned char *buf, size_t n)
+{
+	int g;
+	int s;
+	int next;
+	size_t i;
+	unsigned char c;
+
+	if (!acsm->trie && !acsm->h_trans)
+		return -1;
+
+	if (!acsm->hits) {
+		acsm->hits = (size_t *)ac_malloc(sizeof(size_t) *
+		    acsm->num_states);
+		MEMASSERT(acsm->hits, "acsm_profile");
+		acsm->num_hits = acsm->num_states;
+	}
+
+	/* a serialized DFA is walked as the kernel does, for the report */
+	if (acsm->h_trans) {
+		for (g = 0; g < acsm->num_groups; g++) {
+			s = g;
+			for (i = 0; i < n; i++) {
+				s = get_trans(acsm, (size_t)s *
+				    acsm->num_classes + acsm->classmap[buf[i]]);
+				if (s < 0)
+					s = -s;
+				if (s < acsm->num_hits)
+					acsm->hits[s]++;
+			}
+		}
+		return 0;
+	}
+
+	/* the sparse trie is walked like the DFA, once per group */
+	for (g = 0; g < acsm->num_groups; g++) {
+		s = g;
+		for (i = 0; i < n; i++) {
+			c = acsm->fold ? xlatcase[buf[i]] : buf[i];
+			while ((next = goto_state(acsm, s, c)) ==
+			    ACSM_FAIL_STATE)
+				s = acsm->trie[s].fail_state;
+			s = next;
+			if (s < acsm->num_hits)
+				acsm->hits[s]++;
+		}
+	}
+
+	return 0;
+}
+
+
+/*
+ * renumbers the states, the most visited ones first
+ */
+int
+acsm_reorder(acsm_t *acsm)
+{
+	if (!acsm->trie || acsm->h_trans)
+		return -1;
+
+	renumber_states(acsm);
+
+	return 0;
+}
+
+
+/*
+ * serializes the DFA state table to host memory
+ */
+void
+acsm_serialize(acsm_t *acsm)
+{
+	/* shrink the alphabet to the byte equivalence classes */
+	build_byte_classes(acsm);
+
+	/*
+	 * use the narrowest entry that fits every state; spare rows take the
+	 * states acsm_update() adds, acsm_upload() drops them once the trie
+	 * is gone
+	 */
+	acsm->state_size = fit_state_size(acsm->num_states);
+	acsm->trans_rows = acsm->num_states + acsm->num_states / 8 + 64;
+
+	acsm->h_trans = MALLOC(trans_size(acsm));
+	if (!acsm->h_trans)
+		 ERR(1, "ERROR: malloc h_trans");
+
+	acsm->h_out = MALLOC(out_size(acsm));
+	if (!acsm->h_out)
+		 ERR(1, "ERROR: malloc h_out");
+
+	build_outputs(acsm);
+
+	/* the case sensitive patterns of a case folded automaton */
+	build_case_verify(acsm);
+
+	/* the offset and depth the matches are limited to */
+	build_windows(acsm);
+
+	/* the bytes around the anchors of the signatures */
+	build_signatures(acsm);
+
+	/* densify the rows, level by level */
+	pool_run(acsm, densify_row, NULL);
+	memset(acsm->dirty, 0, acsm->max_states);
+
+	acsm->size = tables_size(acsm);
+
+	return;
+}
+
+
+/*
+ * copies the serialized DFA to its image, after the buffer changed; the
+ * copy is done before the kernels of the other queues run
+ */
+static void
+copy_image(acsm_t *acsm, cl_command_queue queue)
+{
+	int e;
+	size_t origin[3] = { 0, 0, 0 };
+	size_t region[3];
+
+	region[0] = acsm->num_classes;
+	region[1] = acsm->trans_rows;
+	region[2] = 1;
+
+	e = clEnqueueCopyBufferToImage(queue, acsm->d_trans,
+	    acsm->d_trans_image, 0, origin, region, 0, NULL, NULL);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: copy d_trans_image: %s", clstrerror(e));
+
+	clFinish(queue);
+
+	return;
+}
+
+
+/*
+ * binds a copy of the serialized DFA as a 2D image of an entry per texel,
+ * a row per state; the table is read from its buffer if the device can not
+ * take the image
+ */
+static void
+upload_image(acsm_t *acsm, cl_context ctx, cl_command_queue queue)
+{
+	int e;
+	cl_image_format format;
+	cl_image_desc desc;
+
+	format.image_channel_order = CL_R;
+	switch (acsm->state_size) {
+	case sizeof(cl_char):
+		format.image_channel_data_type = CL_SIGNED_INT8;
+		break;
+	case sizeof(cl_short):
+		format.image_channel_data_type = CL_SIGNED_INT16;
+		break;
+	default:
+		format.image_channel_data_type = CL_SIGNED_INT32;
+		break;
+	}
+
+	memset(&desc, 0, sizeof(desc));
+	desc.image_type = CL_MEM_OBJECT_IMAGE2D;
+	desc.image_width = acsm->num_classes;
+	desc.image_height = acsm->trans_rows;
+
+	acsm->d_trans_image = clCreateImage(ctx, CL_MEM_READ_ONLY, &format,
+	    &desc, NULL, &e);
+	if (e != CL_SUCCESS) {
+		acsm->d_trans_image = NULL;
+		return;
+	}
+
+	copy_image(acsm, queue);
+
+	return;
+}
+
+
+/*
+ * transfers the serialized DFA state table to the device
+ */
+void
+acsm_upload(acsm_t *acsm, int mapped, int image, cl_context ctx,
+    cl_command_queue queue)
+{
+	int e;
+	void *h_trans;
+	int *h_out;
+	size_t size;
+	size_t offs_size;
+
+	/* without the trie no state is added, the spare rows are not used */
+	if (!acsm->trie)
+		acsm->trans_rows = acsm->num_states;
+
+	/* the spare rows hold no states yet */
+	size = (size_t)acsm->num_classes * (size_t)acsm->num_states *
+	    acsm->state_size;
+	offs_size = (size_t)(acsm->num_states + 1) * sizeof(cl_int);
+
+	acsm->image = image;
+	acsm->d_trans_image = NULL;
+
+	/* allocate device memory for the serialized DFA */
+	acsm->d_trans = clCreateBuffer(ctx,
+	    CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, trans_size(acsm), NULL,
+	    &e);
 	if (e != CL_SUCCESS)
 		ERRXV(1, "ERROR: alloc d_trans: %s", clstrerror(e));
 
-	if (mapped) {
-		acsm->h_trans = clEnqueueMapBuffer(queue, acsm->d_trans,
-		    CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, (size_t)2 *
-		    (size_t)ALPHABET_SIZE * (size_t)acsm->num_states *
-		    sizeof(int), 0, NULL, NULL, &e);
+	acsm->d_out = clCreateBuffer(ctx,
+	    CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, out_size(acsm), NULL,
+	    &e);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: alloc d_out: %s", clstrerror(e));
+
+	acsm->d_classmap = clCreateBuffer(ctx,
+	    CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
+	    ALPHABET_SIZE * sizeof(cl_uchar), NULL, &e);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: alloc d_classmap: %s", clstrerror(e));
+
+	e = clEnqueueWriteBuffer(queue, acsm->d_classmap, CL_TRUE, 0,
+	    ALPHABET_SIZE * sizeof(cl_uchar), acsm->classmap, 0, NULL, NULL);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: write d_classmap: %s", clstrerror(e));
+
+	build_start_bytes(acsm);
+
+	acsm->d_start = clCreateBuffer(ctx,
+	    CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
+	    sizeof(acsm->start_bytes), NULL, &e);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: alloc d_start: %s", clstrerror(e));
+
+	e = clEnqueueWriteBuffer(queue, acsm->d_start, CL_TRUE, 0,
+	    sizeof(acsm->start_bytes), acsm->start_bytes, 0, NULL, NULL);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: write d_start: %s", clstrerror(e));
+
+	upload_outputs(acsm, ctx, queue);
+
+	if (!mapped) {
+		e = clEnqueueWriteBuffer(queue, acsm->d_trans, CL_TRUE, 0, size,
+		    acsm->h_trans, 0, NULL, NULL);
 		if (e != CL_SUCCESS)
-			ERRXV(1, "ERROR: map d_tans: %s", clstrerror(e));
-	} else {
-		acsm->h_trans = MALLOC(acsm->num_states * 2 * ALPHABET_SIZE *
-		      sizeof(int));
-		if (!acsm->h_trans)
-			 ERR(1, "ERROR: malloc h_trans");
-	}
-
-	/* loop through the states and write the state table to h_trans */
-	for (i = 0; i < acsm->num_states; i++) {
-		/* loop through the transitions */
-		for (j = 0; j < ALPHABET_SIZE; j++) {
-			state = acsm->state_table[i].next_state[j];
-			/* final state */
-			if (acsm->state_table[state].match_list) {
-				acsm->h_trans[i * (2 * ALPHABET_SIZE) + j] =
-				    -state;
-				acsm->h_trans[i * (2 * ALPHABET_SIZE) +
-				    ALPHABET_SIZE + j] = 
-				    acsm->state_table[state].match_list->index;
+			ERRXV(1, "ERROR: write d_trans: %s", clstrerror(e));
+
+		e = clEnqueueWriteBuffer(queue, acsm->d_out, CL_TRUE, 0,
+		    offs_size, acsm->h_out, 0, NULL, NULL);
+		if (e != CL_SUCCESS)
+			ERRXV(1, "ERROR: write d_out: %s", clstrerror(e));
+
+		if (image)
+			upload_image(acsm, ctx, queue);
+
+		return;
+	}
+
+	/* move the host copy to the mapped buffers */
+	h_trans = clEnqueueMapBuffer(queue, acsm->d_trans, CL_TRUE,
+	    CL_MAP_READ | CL_MAP_WRITE, 0, trans_size(acsm), 0, NULL, NULL,
+	    &e);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: map d_tans: %s", clstrerror(e));
+
+	h_out = clEnqueueMapBuffer(queue, acsm->d_out, CL_TRUE,
+	    CL_MAP_READ | CL_MAP_WRITE, 0, out_size(acsm), 0, NULL, NULL, &e);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: map d_out: %s", clstrerror(e));
+
+	memcpy(h_trans, acsm->h_trans, size);
+	memcpy(h_out, acsm->h_out, offs_size);
+
+	/* a loaded database keeps its tables in the file mapping */
+	if (!acsm->map) {
+		FREE(acsm->h_trans);
+		FREE(acsm->h_out);
+	}
+	acsm->h_trans = h_trans;
+	acsm->h_out = h_out;
+
+	if (image)
+		upload_image(acsm, ctx, queue);
+
+	return;
+}
+
+
+/*
+ * Creates the serialized DFA state table and transfers it to the device 
+ */
+void
+acsm_gen_state_table(acsm_t *acsm, int mapped, int image, cl_context ctx,
+    cl_command_queue queue)
+{
+	acsm_serialize(acsm);
+	acsm_upload(acsm, mapped, image, ctx, queue);
+
+	return;
+}
+
+
+/*
+ * applies the inserted and deleted patterns to the serialized DFA and the
+ * device copy, if the state machine was uploaded
+ */
+int
+acsm_update(acsm_t *acsm, int mapped, cl_context ctx, cl_command_queue queue)
+{
+	int e;
+	int s;
+	int t;
+	size_t row;
+
+	if (!acsm->trie || !acsm->h_trans)
+		return -1;
+
+	/* folding changes every pattern, start over */
+	if (acsm->recompile) {
+		free_trie(acsm);
+		acsm->recompile = 0;
+		acsm_compile(acsm);
+		goto relayout;
+	}
+
+	/* the failure links and the outputs are cheap over the sparse trie */
+	build_levels(acsm);
+	build_fail_states(acsm);
+
+	if (!layout_fits(acsm))
+		goto relayout;
+
+	/* only the stale rows and the rows inheriting a change are redone */
+	pool_run(acsm, patch_row, NULL);
+
+	build_outputs(acsm);
+	build_case_verify(acsm);
+	build_windows(acsm);
+	build_signatures(acsm);
+	if (!acsm->d_trans)
+		goto done;
+	upload_outputs(acsm, ctx, queue);
+
+	/* the root rows may have new edges */
+	build_start_bytes(acsm);
+	e = clEnqueueWriteBuffer(queue, acsm->d_start, CL_TRUE, 0,
+	    sizeof(acsm->start_bytes), acsm->start_bytes, 0, NULL, NULL);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: write d_start: %s", clstrerror(e));
+
+	if (!mapped) {
+		/* write the changed rows, merging adjacent ones */
+		row = (size_t)acsm->num_classes * acsm->state_size;
+		for (s = 0; s < acsm->num_states; s = t) {
+			for (t = s; t < acsm->num_states &&
+			    (acsm->dirty[t] & ACSM_ROW_CHANGED); t++)
+				;
+			if (t == s) {
+				t++;
+				continue;
 			}
-			/* normal state */
-			else {
-				acsm->h_trans[i * (2 * ALPHABET_SIZE) + j] =
-				    state;
+			e = clEnqueueWriteBuffer(queue, acsm->d_trans, CL_TRUE,
+			    row * s, row * (t - s), (char *)acsm->h_trans +
+			    row * s, 0, NULL, NULL);
+			if (e != CL_SUCCESS)
+				ERRXV(1, "ERROR: write d_trans: %s",
+				    clstrerror(e));
+		}
+
+		e = clEnqueueWriteBuffer(queue, acsm->d_out, CL_TRUE, 0,
+		    (size_t)(acsm->num_states + 1) * sizeof(cl_int),
+		    acsm->h_out, 0, NULL, NULL);
+		if (e != CL_SUCCESS)
+			ERRXV(1, "ERROR: write d_out: %s", clstrerror(e));
+	}
+
+	if (acsm->d_trans_image)
+		copy_image(acsm, queue);
+
+done:
+	memset(acsm->dirty, 0, acsm->max_states);
+	acsm->size = tables_size(acsm);
+
+	return 0;
+
+relayout:
+	/* a state machine kept on the host is serialized anew only */
+	if (!acsm->d_trans) {
+		FREE(acsm->h_trans);
+		FREE(acsm->h_out);
+		acsm_serialize(acsm);
+		return 1;
+	}
+	release_tables(acsm, mapped, queue);
+	acsm_serialize(acsm);
+	acsm_upload(acsm, mapped, acsm->image, ctx, queue);
+
+	return 1;
+}
+
+
+/*
+ * returns a copy of a serialized table
+ */
+static void *
+copy_table(const void *table, size_t size)
+{
+	void *copy;
+
+	copy = MALLOC(size);
+	if (!copy)
+		ERR(1, "ERROR: malloc table copy");
+	memcpy(copy, table, size);
+
+	return copy;
+}
+
+
+/*
+ * copies the serialized tables of a state machine kept on the host to a new
+ * one, without the trie and the patterns, like acsm_load() returns
+ */
+acsm_t *
+acsm_snapshot(acsm_t *acsm)
+{
+	acsm_t *copy;
+
+	if (!acsm->h_trans || acsm->d_trans)
+		return NULL;
+
+	copy = acsm_new();
+	copy->num_states      = acsm->num_states;
+	copy->num_classes     = acsm->num_classes;
+	copy->state_size      = acsm->state_size;
+	copy->num_patterns    = acsm->num_patterns;
+	copy->max_pattern_len = acsm->max_pattern_len;
+	copy->num_outputs     = acsm->num_outputs;
+	copy->fold            = acsm->fold;
+	copy->num_groups      = acsm->num_groups;
+	copy->windowed        = acsm->windowed;
+	copy->case_size       = acsm->case_size;
+	copy->sig_size        = acsm->sig_size;
+	copy->num_sigs        = acsm->num_sigs;
+	memcpy(copy->classmap, acsm->classmap, ALPHABET_SIZE);
+
+	/* the spare rows stay with the original */
+	copy->trans_rows = acsm->num_states;
+	copy->h_trans    = copy_table(acsm->h_trans, trans_size(copy));
+	copy->h_out      = copy_table(acsm->h_out, out_size(copy));
+	copy->h_out_ids  = copy_table(acsm->h_out_ids, outputs_size(copy));
+	copy->h_verify   = copy_table(acsm->h_verify, verify_size(copy));
+	copy->h_window   = copy_table(acsm->h_window, window_size(copy));
+	copy->h_case     = copy_table(acsm->h_case, case_size(copy));
+	copy->h_sigs     = copy_table(acsm->h_sigs, sigs_size(copy));
+	copy->h_sig_code = copy_table(acsm->h_sig_code, sig_code_size(copy));
+	copy->size       = tables_size(copy);
+
+	return copy;
+}
+
+
+/*
+ * runs the serialized DFA on the host from a state over some bytes
+ */
+int
+acsm_walk(acsm_t *acsm, int state, unsigned char *buf, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		state = get_trans(acsm, (size_t)state * acsm->num_classes +
+		    acsm->classmap[buf[i]]);
+		if (state < 0)
+			state = -state;
+	}
+
+	return state;
+}
+
+
+/*
+ * the bytes around a match that starts before its buffer: the buffer and
+ * the end of the one before
+ */
+struct edge_bytes {
+	const unsigned char	*tail;
+	size_t			tail_len;
+	const unsigned char	*data;
+};
+
+
+/*
+ * byte at position p of the buffer, the bytes before it taken from the end
+ * of the one before
+ */
+static unsigned char
+edge_byte(const struct edge_bytes *b, long p)
+{
+	return (p < 0) ? b->tail[(long)b->tail_len + p] : b->data[p];
+}
+
+
+/*
+ * checks part k of a signature against the bytes at s, as the
+ * verification kernel does; the part lies in the bytes
+ */
+static int
+edge_sig_part(const int *sig, int k, const struct edge_bytes *b, long s)
+{
+	int a;
+	int j;
+	int n;
+	int len;
+	int w;
+	long p;
+	long end;
+	const int *op;
+
+	op = sig + ACSM_SIG_CODE(sig, k);
+	for (p = s, end = s + ACSM_SIG_LEN(sig, k); p < end; ) {
+		w = *op++;
+		if ((w >> 24) == ACSM_SIG_SKIP) {
+			p += w & 0xffffff;
+		} else if ((w >> 24) == ACSM_SIG_ALT) {
+			n = (w >> 12) & 0xfff;
+			len = w & 0xfff;
+			for (a = 0; a < n; a++) {
+				for (j = 0; j < len &&
+				    edge_byte(b, p + j) == op[a * len + j]; j++)
+					;
+				if (j == len)
+					break;
 			}
+			if (a == n)
+				return 0;
+			op += n * len;
+			p += len;
+		} else {
+			if ((edge_byte(b, p) & (w >> 8)) != (w & 0xff))
+				return 0;
+			p++;
 		}
 	}
-	acsm->size = acsm->num_states * (ALPHABET_SIZE * 2) * sizeof(int);
 
-	if (mapped)
-		return;
+	return 1;
+}
 
-	e = clEnqueueWriteBuffer(queue, acsm->d_trans, CL_TRUE, 0, (size_t)2 *
-	    (size_t)ALPHABET_SIZE * (size_t)acsm->num_states * sizeof(cl_int),
-	    acsm->h_trans, 0, NULL, NULL);
-	if (e != CL_SUCCESS)
-		ERRXV(1, "ERROR: write d_trans: %s", clstrerror(e));
+
+/*
+ * checks a signature around the match of its anchor that ends at pos, with
+ * all its parts in [lo, hi); the search of sig_match() in ahomatch.cl
+ */
+static int
+edge_sig_match(const int *sig, const struct edge_bytes *b, long pos,
+    long lo, long hi)
+{
+	int a;
+	int k;
+	int n;
+	long edge;
+	long at[ACSM_SIG_MAX_PARTS];
+
+	n = sig[0];
+	a = sig[1];
+	at[a] = pos - sig[2];
+	if (at[a] < lo || at[a] + ACSM_SIG_LEN(sig, a) > hi ||
+	    !edge_sig_part(sig, a, b, at[a]))
+		return 0;
+
+	/* the parts after the anchor */
+	k = a + 1;
+	if (k < n)
+		at[k] = at[a] + ACSM_SIG_LEN(sig, a) +
+		    ACSM_SIG_GAP_MIN(sig, k);
+	while (k > a && k < n) {
+		edge = hi - ACSM_SIG_LEN(sig, k);
+		if (ACSM_SIG_GAP_MAX(sig, k) >= 0 &&
+		    edge > at[k - 1] + ACSM_SIG_LEN(sig, k - 1) +
+		    ACSM_SIG_GAP_MAX(sig, k))
+			edge = at[k - 1] + ACSM_SIG_LEN(sig, k - 1) +
+			    ACSM_SIG_GAP_MAX(sig, k);
+		for ( ; at[k] <= edge; at[k]++)
+			if (edge_sig_part(sig, k, b, at[k]))
+				break;
+		if (at[k] <= edge) {
+			if (++k < n)
+				at[k] = at[k - 1] + ACSM_SIG_LEN(sig, k - 1) +
+				    ACSM_SIG_GAP_MIN(sig, k);
+			continue;
+		}
+		do
+			k--;
+		while (k > a && ACSM_SIG_GAP_MAX(sig, k + 1) < 0);
+		if (k > a)
+			at[k]++;
+	}
+	if (k < n)
+		return 0;
+
+	/* the parts before the anchor */
+	k = a - 1;
+	if (k >= 0)
+		at[k] = at[a] - ACSM_SIG_GAP_MIN(sig, a) - ACSM_SIG_LEN(sig, k);
+	while (k < a && k >= 0) {
+		edge = lo;
+		if (ACSM_SIG_GAP_MAX(sig, k + 1) >= 0 &&
+		    edge < at[k + 1] - ACSM_SIG_GAP_MAX(sig, k + 1) -
+		    ACSM_SIG_LEN(sig, k))
+			edge = at[k + 1] - ACSM_SIG_GAP_MAX(sig, k + 1) -
+			    ACSM_SIG_LEN(sig, k);
+		for ( ; at[k] >= edge; at[k]--)
+			if (edge_sig_part(sig, k, b, at[k]))
+				break;
+		if (at[k] >= edge) {
+			if (--k >= 0)
+				at[k] = at[k + 1] - ACSM_SIG_GAP_MIN(sig,
+				    k + 1) - ACSM_SIG_LEN(sig, k);
+			continue;
+		}
+		do
+			k++;
+		while (k < a && ACSM_SIG_GAP_MAX(sig, k) < 0);
+		if (k < a)
+			at[k]--;
+	}
+
+	return k < 0;
+}
+
+
+/*
+ * checks a match that starts before the buffer it was found in
+ */
+int
+acsm_check_edge(acsm_t *acsm, int pat, const unsigned char *tail,
+    size_t tail_len, const unsigned char *data, long pos, long hi)
+{
+	int k;
+	int n;
+	int off;
+	long start;
+	struct edge_bytes b;
+
+	b.tail = tail;
+	b.tail_len = tail_len;
+	b.data = data;
+
+	/* the original case, see build_case_verify() */
+	off = acsm->h_verify[2 * pat];
+	n = acsm->h_verify[2 * pat + 1];
+	start = pos - n + 1;
+	if (start < -(long)tail_len)
+		return 0;
+	if (off >= 0)
+		for (k = 0; k < n; k++)
+			if (edge_byte(&b, start + k) != acsm->h_case[off + k])
+				return 0;
+
+	/* the signature, see build_signatures() */
+	if (acsm->h_sigs[pat] >= 0)
+		return edge_sig_match(acsm->h_sig_code + acsm->h_sigs[pat],
+		    &b, pos, -(long)tail_len, hi);
+
+	return 1;
+}
+
+
+/*
+ * most frequent next state of a row of the serialized DFA
+ */
+static int
+row_default(acsm_t *acsm, int state)
+{
+	size_t row = (size_t)state * acsm->num_classes;
+	int i, j, t, n, best, most;
+
+	best = get_trans(acsm, row);
+	most = 0;
+	for (i = 0; i < acsm->num_classes; i++) {
+		t = get_trans(acsm, row + i);
+		for (j = 0; j < i; j++)
+			if (get_trans(acsm, row + j) == t)
+				break;
+		if (j < i)
+			continue;
+		for (n = 0, j = i; j < acsm->num_classes; j++)
+			if (get_trans(acsm, row + j) == t)
+				n++;
+		if (n > most) {
+			most = n;
+			best = t;
+		}
+	}
+
+	return best;
+}
+
+
+/*
+ * generates OpenCL C for the serialized DFA, a switch case per state
+ */
+char *
+acsm_gen_code(acsm_t *acsm, int max_cases)
+{
+	char *code, *p;
+	size_t row;
+	int s, i, j, t, def, cases;
+
+	/* a case per state at least; the rows of large DFAs are not read */
+	if (acsm->num_states > max_cases)
+		return NULL;
+
+	cases = acsm->num_states;
+	for (s = 0; s < acsm->num_states && cases <= max_cases; s++) {
+		row = (size_t)s * acsm->num_classes;
+		def = row_default(acsm, s);
+		for (i = 0; i < acsm->num_classes; i++)
+			if (get_trans(acsm, row + i) != def)
+				cases++;
+	}
+	if (cases > max_cases)
+		return NULL;
+
+	/* at most 80 bytes per case, of a state or of a class */
+	code = malloc((size_t)cases * 80 + 256);
+	if (code == NULL)
+		return NULL;
+
+	p = code;
+	p += sprintf(p, "int\nnext_state(int state, uchar c)\n{\n"
+	    "\tswitch (state) {\n");
+	for (s = 0; s < acsm->num_states; s++) {
+		row = (size_t)s * acsm->num_classes;
+		def = row_default(acsm, s);
+		p += sprintf(p, "\tcase %d:\n", s);
+
+		for (i = 0; i < acsm->num_classes; i++)
+			if (get_trans(acsm, row + i) != def)
+				break;
+		if (i == acsm->num_classes) {
+			p += sprintf(p, "\t\treturn %d;\n", def);
+			continue;
+		}
+
+		/* a case per next state, with the classes that lead to it */
+		p += sprintf(p, "\t\tswitch (c) {\n");
+		for (i = 0; i < acsm->num_classes; i++) {
+			t = get_trans(acsm, row + i);
+			if (t == def)
+				continue;
+			for (j = 0; j < i; j++)
+				if (get_trans(acsm, row + j) == t)
+					break;
+			if (j < i)
+				continue;
+
+			p += sprintf(p, "\t\tcase %d:", i);
+			for (j = i + 1; j < acsm->num_classes; j++)
+				if (get_trans(acsm, row + j) == t)
+					p += sprintf(p, " case %d:", j);
+			p += sprintf(p, "\n\t\t\treturn %d;\n", t);
+		}
+		p += sprintf(p, "\t\tdefault:\n\t\t\treturn %d;\n\t\t}\n",
+		    def);
+	}
+	sprintf(p, "\tdefault:\n\t\treturn 0;\n\t}\n}\n");
+
+	return code;
+}
+
+
+/*
+ * releases the serialized DFA and the other tables, on the host and on
+ * the device
+ */
+void
+acsm_release(acsm_t *acsm, int mapped, cl_command_queue queue)
+{
+	/* the tables of a state machine kept on the host are not mapped */
+	if (!acsm->d_trans)
+		mapped = 0;
+	else {
+		clReleaseMemObject(acsm->d_out_ids);
+		clReleaseMemObject(acsm->d_verify);
+		clReleaseMemObject(acsm->d_window);
+		clReleaseMemObject(acsm->d_case);
+		clReleaseMemObject(acsm->d_sigs);
+		clReleaseMemObject(acsm->d_sig_code);
+	}
+	release_tables(acsm, mapped, queue);
+
+	acsm->d_out_ids = NULL;
+	acsm->d_verify = NULL;
+	acsm->d_window = NULL;
+	acsm->d_case = NULL;
+	acsm->d_sigs = NULL;
+	acsm->d_sig_code = NULL;
+
+	/* a loaded database keeps its tables in the file mapping */
+	if (!acsm->map) {
+		FREE(acsm->h_out_ids);
+		FREE(acsm->h_verify);
+		FREE(acsm->h_case);
+		FREE(acsm->h_sigs);
+		FREE(acsm->h_sig_code);
+	}
+	acsm->h_out_ids = NULL;
+	acsm->h_verify = NULL;
+	acsm->h_case = NULL;
+	acsm->h_sigs = NULL;
+	acsm->h_sig_code = NULL;
+
+	/* built from the pattern records of a loaded database too */
+	FREE(acsm->h_window);
+	acsm->h_window = NULL;
 
 	return;
 }
 
+
 /*
  * returns a newly allocated table containing all patterns contained
  * in this acsm_t
@@ -678,20 +3199,34 @@ acsm_pattern_t *
 acsm_get_patterns_table(acsm_t *acsm)
 {
 	int i;
-	acsm_pattern_t *p = NULL, *q = NULL;
+	size_t size;
+	unsigned char *str;
+	acsm_pattern_t *p = NULL;
 
 	if (acsm == NULL) {
 		return NULL;
 	}
 
-	acsm_pattern_t *patterns =
-		MALLOC(acsm->num_patterns * sizeof(acsm_pattern_t));
+	/* the strings follow the table, in the same allocation */
+	size = acsm->num_patterns * sizeof(acsm_pattern_t);
+	for (p = acsm->patterns; p; p = p->next)
+		size += p->n + 1;
+
+	acsm_pattern_t *patterns = MALLOC(size);
+	MEMASSERT(patterns, "acsm_get_patterns_table");
+
+	/* deleted patterns leave empty entries */
+	memset(patterns, 0, acsm->num_patterns * sizeof(acsm_pattern_t));
 
+	str = (unsigned char *)&patterns[acsm->num_patterns];
 	p = acsm->patterns;
 	while (p) {
 		int x = p->index;
-		patterns[x].pattern     = strndup(p->pattern, p->n);
-		patterns[x].casepattern = strndup(p->casepattern, p->n);
+		memcpy(str, p->casepattern, p->n);
+		str[p->n] = '\0';
+		patterns[x].pattern     = str;
+		patterns[x].casepattern = str;
+		str += p->n + 1;
 		patterns[x].n           = p->n;
 		patterns[x].nocase      = p->nocase;
 		patterns[x].offset      = p->offset;
@@ -704,34 +3239,437 @@ acsm_get_patterns_table(acsm_t *acsm)
 		p = p->next;
 	}
 
-	for (i = 0; i < acsm->max_states; i++) {
-		p = acsm->state_table[i].match_list;
-		if (p && (p->next)) {
-			q = &patterns[p->index];
+	/* link the patterns that end in the same state or in a suffix */
+	for (i = 0; i < acsm->num_patterns; i++)
+		if (acsm->out_next[i] != -1)
+			patterns[i].next = &patterns[acsm->out_next[i]];
 
-			while (q->next)
-				q = q->next;
+	return patterns;
+}
 
-			while (p && (p->next)) {
-				q->next = &patterns[p->next->index];
-				p = p->next;
-				q = q->next;
-			}
+
+/*
+ * pads a compiled database with zeros up to the next section
+ */
+static int
+db_pad(FILE *fp, size_t *off, size_t to)
+{
+	for (; *off < to; (*off)++)
+		if (fputc(0, fp) == EOF)
+			return -1;
+
+	return 0;
+}
+
+
+/*
+ * writes the serialized DFA and the pattern metadata to a compiled database
+ */
+int
+acsm_dump(acsm_t *acsm, acsm_pattern_t *patterns, const char *path)
+{
+	int i;
+	FILE *fp;
+	size_t off;
+	size_t size;
+	uint32_t str_off;
+	acsm_pattern_t *p;
+	acsm_db_header_t hdr;
+	acsm_db_pattern_t rec;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, ACSM_DB_MAGIC, sizeof(hdr.magic));
+	hdr.version         = ACSM_DB_VERSION;
+	hdr.num_states      = acsm->num_states;
+	hdr.num_classes     = acsm->num_classes;
+	hdr.state_size      = acsm->state_size;
+	hdr.num_patterns    = acsm->num_patterns;
+	hdr.max_pattern_len = acsm->max_pattern_len;
+	memcpy(hdr.classmap, acsm->classmap, ALPHABET_SIZE);
+
+	hdr.section[ACSM_DB_TRANS].size = (uint64_t)acsm->num_states *
+	    acsm->num_classes * acsm->state_size;
+	hdr.num_outputs     = acsm->num_outputs;
+	hdr.section[ACSM_DB_OUT].size = (uint64_t)(acsm->num_states + 1) *
+	    sizeof(cl_int);
+	hdr.section[ACSM_DB_OUT_IDS].size = outputs_size(acsm);
+	hdr.fold            = acsm->fold;
+	hdr.num_groups      = acsm->num_groups;
+	hdr.num_sigs        = acsm->num_sigs;
+	hdr.section[ACSM_DB_VERIFY].size = verify_size(acsm);
+	hdr.section[ACSM_DB_CASE].size = case_size(acsm);
+	hdr.section[ACSM_DB_PATTERNS].size = (uint64_t)acsm->num_patterns *
+	    sizeof(acsm_db_pattern_t);
+	for (i = 0; i < acsm->num_patterns; i++)
+		hdr.section[ACSM_DB_STRINGS].size += patterns[i].n + 1;
+	hdr.section[ACSM_DB_SIGS].size = sigs_size(acsm);
+	hdr.section[ACSM_DB_SIG_CODE].size = sig_code_size(acsm);
+
+	off = sizeof(hdr);
+	for (i = 0; i < ACSM_DB_SECTIONS; i++) {
+		off = ROUNDUP(off, ACSM_DB_ALIGN);
+		hdr.section[i].offset = off;
+		off += hdr.section[i].size;
+	}
+
+	if ((fp = fopen(path, "wb")) == NULL)
+		return -1;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto fail;
+	off = sizeof(hdr);
+
+	/* serialized DFA and output sets, straight from host memory */
+	size = hdr.section[ACSM_DB_TRANS].size;
+	if (db_pad(fp, &off, hdr.section[ACSM_DB_TRANS].offset) ||
+	    fwrite(acsm->h_trans, 1, size, fp) != size)
+		goto fail;
+	off += size;
+
+	size = hdr.section[ACSM_DB_OUT].size;
+	if (db_pad(fp, &off, hdr.section[ACSM_DB_OUT].offset) ||
+	    fwrite(acsm->h_out, 1, size, fp) != size)
+		goto fail;
+	off += size;
+
+	size = hdr.section[ACSM_DB_OUT_IDS].size;
+	if (db_pad(fp, &off, hdr.section[ACSM_DB_OUT_IDS].offset) ||
+	    fwrite(acsm->h_out_ids, 1, size, fp) != size)
+		goto fail;
+	off += size;
+
+	size = hdr.section[ACSM_DB_VERIFY].size;
+	if (db_pad(fp, &off, hdr.section[ACSM_DB_VERIFY].offset) ||
+	    fwrite(acsm->h_verify, 1, size, fp) != size)
+		goto fail;
+	off += size;
+
+	size = hdr.section[ACSM_DB_CASE].size;
+	if (db_pad(fp, &off, hdr.section[ACSM_DB_CASE].offset) ||
+	    fwrite(acsm->h_case, 1, size, fp) != size)
+		goto fail;
+	off += size;
+
+	/* pattern records, chained by table index */
+	if (db_pad(fp, &off, hdr.section[ACSM_DB_PATTERNS].offset))
+		goto fail;
+	str_off = 0;
+	for (i = 0; i < acsm->num_patterns; i++) {
+		p = &patterns[i];
+		rec.n      = p->n;
+		rec.nocase = p->nocase;
+		rec.offset = p->offset;
+		rec.depth  = p->depth;
+		rec.iid    = p->iid;
+		rec.index  = p->index;
+		rec.next   = p->next ? (int32_t)(p->next - patterns) : -1;
+		rec.data   = str_off;
+		str_off += p->n + 1;
+		if (fwrite(&rec, sizeof(rec), 1, fp) != 1)
+			goto fail;
+	}
+	off += hdr.section[ACSM_DB_PATTERNS].size;
+
+	/* pattern bytes */
+	if (db_pad(fp, &off, hdr.section[ACSM_DB_STRINGS].offset))
+		goto fail;
+	for (i = 0; i < acsm->num_patterns; i++)
+		if (fwrite(patterns[i].casepattern, 1, patterns[i].n, fp) !=
+		    (size_t)patterns[i].n || fputc('\0', fp) == EOF)
+			goto fail;
+	off += hdr.section[ACSM_DB_STRINGS].size;
+
+	/* signature programs */
+	size = hdr.section[ACSM_DB_SIGS].size;
+	if (db_pad(fp, &off, hdr.section[ACSM_DB_SIGS].offset) ||
+	    fwrite(acsm->h_sigs, 1, size, fp) != size)
+		goto fail;
+	off += size;
+
+	size = hdr.section[ACSM_DB_SIG_CODE].size;
+	if (db_pad(fp, &off, hdr.section[ACSM_DB_SIG_CODE].offset) ||
+	    fwrite(acsm->h_sig_code, 1, size, fp) != size)
+		goto fail;
+	off += size;
+
+	return fclose(fp) ? -1 : 0;
+
+fail:
+	fclose(fp);
+
+	return -1;
+}
+
+
+/*
+ * checks that the signature program at off, with its parts and their code,
+ * lies in the signature programs of a compiled database
+ */
+static int
+db_check_sig(const int *code, size_t size, int off)
+{
+	int k;
+	int n;
+	int w;
+	long p;
+	const int *sig;
+	size_t op;
+
+	if (off < 0 || (size_t)off + ACSM_SIG_HDR > size)
+		return -1;
+	sig = code + off;
+	if (sig[0] < 1 || sig[0] > ACSM_SIG_MAX_PARTS ||
+	    (size_t)off + ACSM_SIG_HDR + ACSM_SIG_PART * sig[0] > size ||
+	    sig[1] < 0 || sig[1] >= sig[0] || sig[2] < 0 ||
+	    sig[2] >= ACSM_SIG_LEN(sig, sig[1]))
+		return -1;
+
+	for (k = 0; k < sig[0]; k++) {
+		if (ACSM_SIG_LEN(sig, k) < 1 || ACSM_SIG_GAP_MIN(sig, k) < 0 ||
+		    ACSM_SIG_GAP_MAX(sig, k) < -1 || ACSM_SIG_CODE(sig, k) < 0)
+			return -1;
+
+		/* every word the part runs is in the programs */
+		op = (size_t)off + ACSM_SIG_CODE(sig, k);
+		for (p = 0; p < ACSM_SIG_LEN(sig, k); ) {
+			if (op >= size)
+				return -1;
+			w = code[op++];
+			if ((w >> 24) == ACSM_SIG_SKIP) {
+				if ((w & 0xffffff) == 0)
+					return -1;
+				p += w & 0xffffff;
+			} else if ((w >> 24) == ACSM_SIG_ALT) {
+				n = (w >> 12) & 0xfff;
+				if (n == 0 || (w & 0xfff) == 0 ||
+				    op + (size_t)n * (w & 0xfff) > size)
+					return -1;
+				op += (size_t)n * (w & 0xfff);
+				p += w & 0xfff;
+			} else
+				p++;
 		}
 	}
 
-	/* print patterns and connections between them (i.e., common prefix) */
-	//for (i=0; i<acsm->num_patterns; i++) {
-	//	printf("%d %d %s", patterns[i].index, patterns[i].iid, patterns[i].pattern);
-	//	p = patterns[i].next;
-	//	while (p) {
-	//		printf(" -> %d %s", p->index, p->pattern);
-	//		p = p->next;
-	//	}
-	//	printf("\n");
-	//}
+	return 0;
+}
+
 
-	return patterns;
+/*
+ * checks the tables of a mapped database against its header, so that no
+ * state, output or pattern index read from it leads out of its tables
+ */
+static int
+db_check(acsm_t *acsm, acsm_db_header_t *hdr, acsm_db_pattern_t *rec)
+{
+	int i;
+	int t;
+	int off;
+	size_t j;
+	size_t n;
+
+	for (i = 0; i < ALPHABET_SIZE; i++)
+		if (acsm->classmap[i] >= acsm->num_classes)
+			return -1;
+
+	n = (size_t)acsm->num_states * acsm->num_classes;
+	for (j = 0; j < n; j++) {
+		t = get_trans(acsm, j);
+		if (t <= -acsm->num_states || t >= acsm->num_states)
+			return -1;
+	}
+
+	/* the output sets follow each other */
+	if (acsm->h_out[0] < 0 ||
+	    acsm->h_out[acsm->num_states] > acsm->num_outputs)
+		return -1;
+	for (i = 0; i < acsm->num_states; i++)
+		if (acsm->h_out[i] > acsm->h_out[i + 1])
+			return -1;
+	for (i = 0; i < acsm->num_outputs; i++)
+		if (acsm->h_out_ids[i] < 0 ||
+		    acsm->h_out_ids[i] >= acsm->num_patterns)
+			return -1;
+
+	for (i = 0; i < acsm->num_patterns; i++) {
+		if (rec[i].n < 0 || rec[i].n > acsm->max_pattern_len ||
+		    rec[i].index < 0 || rec[i].index >= acsm->num_patterns ||
+		    rec[i].next < -1 || rec[i].next >= acsm->num_patterns ||
+		    rec[i].data + (uint64_t)rec[i].n >=
+		    hdr->section[ACSM_DB_STRINGS].size)
+			return -1;
+
+		off = acsm->h_verify[2 * i];
+		if (off < -1 || acsm->h_verify[2 * i + 1] < 0 || (off >= 0 &&
+		    (size_t)off + acsm->h_verify[2 * i + 1] > acsm->case_size))
+			return -1;
+
+		if (acsm->h_sigs[i] < -1 || (acsm->h_sigs[i] >= 0 &&
+		    db_check_sig(acsm->h_sig_code, acsm->sig_size,
+		    acsm->h_sigs[i]) != 0))
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * maps a compiled database and returns its automaton and pattern table
+ */
+int
+acsm_load(const char *path, acsm_t **loaded, acsm_pattern_t **patterns)
+{
+	int i;
+	int fd;
+	struct stat st;
+	unsigned char *map;
+	acsm_t *acsm;
+	acsm_db_header_t *hdr;
+	acsm_db_pattern_t *rec;
+	acsm_pattern_t *table;
+	unsigned char *strings;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return 1;
+
+	if (fstat(fd, &st) == -1 ||
+	    st.st_size < (off_t)sizeof(hdr->magic)) {
+		close(fd);
+		return 1;
+	}
+
+	/* shared read-only mapping; the pages are shared between processes */
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 1;
+
+	hdr = (acsm_db_header_t *)map;
+	if (memcmp(hdr->magic, ACSM_DB_MAGIC, sizeof(hdr->magic)) != 0) {
+		munmap(map, st.st_size);
+		return 1;
+	}
+
+	/* from here on it is a database; refuse one that can not be used */
+	if (st.st_size < (off_t)sizeof(acsm_db_header_t)) {
+		fprintf(stderr, "ERROR: '%s' is truncated\n", path);
+		goto fail;
+	}
+
+	if (hdr->version != ACSM_DB_VERSION) {
+		fprintf(stderr, "ERROR: '%s' is a version %u database, "
+		    "expected %d; recompile the patterns\n", path,
+		    hdr->version, ACSM_DB_VERSION);
+		goto fail;
+	}
+
+	for (i = 0; i < ACSM_DB_SECTIONS; i++)
+		if (hdr->section[i].offset > (uint64_t)st.st_size ||
+		    hdr->section[i].size > (uint64_t)st.st_size -
+		    hdr->section[i].offset ||
+		    hdr->section[i].offset % sizeof(cl_int) != 0) {
+			fprintf(stderr, "ERROR: '%s' is truncated\n", path);
+			goto fail;
+		}
+
+	if (hdr->num_states < 1 || hdr->num_states > INT_MAX ||
+	    hdr->num_classes < 1 || hdr->num_classes > ALPHABET_SIZE ||
+	    (hdr->state_size != sizeof(cl_char) &&
+	    hdr->state_size != sizeof(cl_short) &&
+	    hdr->state_size != sizeof(cl_int)) ||
+	    hdr->num_patterns > INT_MAX || hdr->num_outputs > INT_MAX ||
+	    hdr->max_pattern_len > hdr->section[ACSM_DB_STRINGS].size ||
+	    hdr->section[ACSM_DB_TRANS].size != (uint64_t)hdr->num_states *
+	    hdr->num_classes * hdr->state_size ||
+	    hdr->section[ACSM_DB_OUT].size != (uint64_t)(hdr->num_states + 1) *
+	    sizeof(cl_int) ||
+	    hdr->section[ACSM_DB_OUT_IDS].size <
+	    (uint64_t)hdr->num_outputs * sizeof(cl_int) ||
+	    hdr->section[ACSM_DB_VERIFY].size <
+	    (uint64_t)hdr->num_patterns * 2 * sizeof(cl_int) ||
+	    hdr->section[ACSM_DB_PATTERNS].size != (uint64_t)hdr->num_patterns *
+	    sizeof(acsm_db_pattern_t) ||
+	    hdr->section[ACSM_DB_SIGS].size <
+	    (uint64_t)hdr->num_patterns * sizeof(cl_int) ||
+	    hdr->num_groups < 1 || hdr->num_groups > ACSM_MAX_GROUPS ||
+	    hdr->num_groups > hdr->num_states) {
+		fprintf(stderr, "ERROR: '%s' is corrupted\n", path);
+		goto fail;
+	}
+
+	acsm = acsm_new();
+	acsm->map             = map;
+	acsm->map_size        = st.st_size;
+	acsm->num_states      = hdr->num_states;
+	acsm->num_classes     = hdr->num_classes;
+	acsm->state_size      = hdr->state_size;
+	acsm->num_patterns    = hdr->num_patterns;
+	acsm->max_pattern_len = hdr->max_pattern_len;
+	memcpy(acsm->classmap, hdr->classmap, ALPHABET_SIZE);
+	acsm->h_trans = map + hdr->section[ACSM_DB_TRANS].offset;
+	acsm->h_out   = (int *)(map + hdr->section[ACSM_DB_OUT].offset);
+	acsm->num_outputs = hdr->num_outputs;
+	acsm->h_out_ids = (int *)(map + hdr->section[ACSM_DB_OUT_IDS].offset);
+	acsm->fold    = hdr->fold;
+	acsm->num_groups = hdr->num_groups;
+	acsm->h_verify = (int *)(map + hdr->section[ACSM_DB_VERIFY].offset);
+	acsm->h_case  = map + hdr->section[ACSM_DB_CASE].offset;
+	acsm->case_size = hdr->section[ACSM_DB_CASE].size;
+	acsm->h_sigs  = (int *)(map + hdr->section[ACSM_DB_SIGS].offset);
+	acsm->h_sig_code = (int *)(map + hdr->section[ACSM_DB_SIG_CODE].offset);
+	acsm->sig_size = hdr->section[ACSM_DB_SIG_CODE].size / sizeof(cl_int);
+	acsm->num_sigs = hdr->num_sigs;
+
+	rec = (acsm_db_pattern_t *)(map +
+	    hdr->section[ACSM_DB_PATTERNS].offset);
+	if (db_check(acsm, hdr, rec) != 0) {
+		fprintf(stderr, "ERROR: '%s' is corrupted\n", path);
+		acsm_free(acsm);
+		return -1;
+	}
+
+	/* the windows are in the pattern records */
+	acsm->h_window = MALLOC(window_size(acsm));
+	if (!acsm->h_window)
+		ERR(1, "ERROR: malloc h_window");
+	memset(acsm->h_window, 0, window_size(acsm));
+	acsm->trans_rows = acsm->num_states;
+	acsm->size    = tables_size(acsm);
+
+	/* the pattern table points to the strings in the mapping */
+	table = MALLOC(acsm->num_patterns * sizeof(acsm_pattern_t));
+	if (!table)
+		ERR(1, "ERROR: malloc patterns");
+
+	strings = map + hdr->section[ACSM_DB_STRINGS].offset;
+	for (i = 0; i < acsm->num_patterns; i++) {
+		table[i].pattern     = strings + rec[i].data;
+		table[i].casepattern = strings + rec[i].data;
+		table[i].n           = rec[i].n;
+		table[i].nocase      = rec[i].nocase;
+		table[i].offset      = rec[i].offset;
+		table[i].depth       = rec[i].depth;
+		table[i].id          = NULL;
+		table[i].iid         = rec[i].iid;
+		table[i].index       = rec[i].index;
+		table[i].next        = rec[i].next < 0 ? NULL :
+		    &table[rec[i].next];
+
+		acsm->h_window[2 * i] = rec[i].offset;
+		acsm->h_window[2 * i + 1] = rec[i].depth;
+		if (rec[i].offset > 0 || rec[i].depth > 0)
+			acsm->windowed = 1;
+	}
+	*loaded = acsm;
+	*patterns = table;
+
+	return 0;
+
+fail:
+	munmap(map, st.st_size);
+
+	return -1;
 }
 
 
@@ -755,6 +3693,36 @@ acsm_get_states(acsm_t *acsm)
 }
 
 
+/*
+ * returns the number of pattern groups
+ */
+int
+acsm_get_groups(acsm_t *acsm)
+{
+	return acsm->num_groups;
+}
+
+
+/*
+ * returns the number of byte equivalence classes
+ */
+int
+acsm_get_classes(acsm_t *acsm)
+{
+	return acsm->num_classes;
+}
+
+
+/*
+ * returns the size of a serialized DFA entry
+ */
+int
+acsm_get_state_size(acsm_t *acsm)
+{
+	return acsm->state_size;
+}
+
+
 /*
  * returns the automaton size in bytes
  */
@@ -766,37 +3734,203 @@ acsm_get_size(acsm_t *acsm)
 
 
 /*
- * cleans the memory and keeps the serialized DFA state table
- */ 
+ * returns the largest fan-out of a bucket of the report: 0, 1, 2, 4, ...
+ */
+static inline int
+fanout_limit(int bucket)
+{
+	return (bucket > 0) ? 1 << (bucket - 1) : 0;
+}
+
+
+/*
+ * reports the depth, fan-out and, if profiled, visit profile of the states
+ */
 void
-acsm_cleanup(acsm_t *acsm) 
+acsm_report(acsm_t *acsm, int levels, FILE *fp)
 {
-	int i;
-	acsm_pattern_t *mlist, *ilist;
+	int c, i, s, t;
+	int head, tail;
+	int fanout, bucket;
+	int num_levels;
+	int unreachable;
+	int finals;
+	int *depth, *queue;
+	int *per_depth, *final_depth;
+	int fanouts[ACSM_REPORT_FANOUTS];
+	size_t row;
+	size_t seen;
+	size_t total;
+	size_t *visits;
+	char label[16];
+	acsm_rank_t *rank;
+	static const double shares[] = { 0.5, 0.9, 0.99 };
+
+	row = (size_t)acsm->num_classes * acsm->state_size;
+
+	depth = (int *)ac_malloc(sizeof(int) * acsm->num_states);
+	queue = (int *)ac_malloc(sizeof(int) * acsm->num_states);
+	MEMASSERT(depth && queue, "acsm_report");
+	memset(fanouts, 0, sizeof(fanouts));
+
+	/*
+	 * a breadth first walk of the DFA from the roots; only the edges of
+	 * the trie lead a level deeper, so they are the fan-out of a state
+	 */
+	for (s = 0; s < acsm->num_states; s++)
+		depth[s] = -1;
+	head = tail = 0;
+	for (s = 0; s < acsm->num_groups; s++) {
+		depth[s] = 0;
+		queue[tail++] = s;
+	}
+	num_levels = 1;
+	while (head < tail) {
+		s = queue[head++];
+		fanout = 0;
+		for (c = 0; c < acsm->num_classes; c++) {
+			t = get_trans(acsm, (size_t)s * acsm->num_classes + c);
+			if (t < 0)
+				t = -t;
+			if (depth[t] == -1) {
+				depth[t] = depth[s] + 1;
+				queue[tail++] = t;
+				if (depth[t] + 1 > num_levels)
+					num_levels = depth[t] + 1;
+			}
+			if (depth[t] == depth[s] + 1)
+				fanout++;
+		}
+		for (bucket = 0; bucket < ACSM_REPORT_FANOUTS - 1 &&
+		    fanout > fanout_limit(bucket); bucket++)
+			;
+		fanouts[bucket]++;
+	}
+	unreachable = acsm->num_states - tail;
+
+	per_depth = (int *)ac_malloc(sizeof(int) * num_levels);
+	final_depth = (int *)ac_malloc(sizeof(int) * num_levels);
+	visits = (size_t *)ac_malloc(sizeof(size_t) * num_levels);
+	MEMASSERT(per_depth && final_depth && visits, "acsm_report");
+	finals = 0;
+	total = 0;
+	for (s = 0; s < acsm->num_states; s++) {
+		if (depth[s] == -1)
+			continue;
+		per_depth[depth[s]]++;
+		if (acsm->h_out[s] < acsm->h_out[s + 1]) {
+			final_depth[depth[s]]++;
+			finals++;
+		}
+		if (s < acsm->num_hits) {
+			visits[depth[s]] += acsm->hits[s];
+			total += acsm->hits[s];
+		}
+	}
 
-	for (i = 0; i < acsm->max_states; i++) {
-		mlist = acsm->state_table[i].match_list;
-		while (mlist) {
-			ilist = mlist;
-			mlist = mlist->next;
-			ac_free(ilist);
+	fprintf(fp, "------------- AUTOMATON -------------\n");
+	fprintf(fp, "Patterns:            %d\n", acsm->num_patterns);
+	fprintf(fp, "Groups:              %d\n", acsm->num_groups);
+	fprintf(fp, "States:              %d\n", acsm->num_states);
+	fprintf(fp, "Final states:        %d\n", finals);
+	if (unreachable)
+		fprintf(fp, "Unreachable states:  %d\n", unreachable);
+	fprintf(fp, "Byte classes:        %d\n", acsm->num_classes);
+	fprintf(fp, "Row size (bytes):    %zu\n", row);
+	fprintf(fp, "Size (MB):           %.3f\n",
+	    (double)acsm->size / 1048576);
+
+	/*
+	 * the rows down to each depth are the working set of a scan that
+	 * stays that shallow; the depths past the listed ones are summed up
+	 */
+	fprintf(fp, "\nDepth  States    Final     Rows (KB)%s\n",
+	    total ? "   Visits (%)" : "");
+	for (i = 0, t = 0; i < num_levels; i++) {
+		t += per_depth[i];
+		if (i > levels) {
+			per_depth[levels] += per_depth[i];
+			final_depth[levels] += final_depth[i];
+			visits[levels] += visits[i];
 		}
-		acsm->state_table[i].match_list = NULL;
+		if (i >= levels && i < num_levels - 1)
+			continue;
+		snprintf(label, sizeof(label), "%s%d", i < levels ? "" : ">=",
+		    i < levels ? i : levels);
+		c = i < levels ? i : levels;
+		fprintf(fp, "%-5s  %-8d  %-8d  ", label, per_depth[c],
+		    final_depth[c]);
+		if (total)
+			fprintf(fp, "%-10.3f  %.2f\n", (double)t * row / 1024,
+			    100.0 * visits[c] / total);
+		else
+			fprintf(fp, "%.3f\n", (double)t * row / 1024);
 	}
 
-	ac_free(acsm->state_table);
-	acsm->state_table = NULL;
+	fprintf(fp, "\nFan-out    States\n");
+	for (i = 0; i < ACSM_REPORT_FANOUTS; i++) {
+		if (i == ACSM_REPORT_FANOUTS - 1)
+			snprintf(label, sizeof(label), ">%d",
+			    fanout_limit(i - 1));
+		else if (fanout_limit(i) - fanout_limit(i - 1) > 1)
+			snprintf(label, sizeof(label), "%d-%d",
+			    fanout_limit(i - 1) + 1, fanout_limit(i));
+		else
+			snprintf(label, sizeof(label), "%d", fanout_limit(i));
+		fprintf(fp, "%-9s  %d\n", label, fanouts[i]);
+	}
 
-	mlist = acsm->patterns;
+	/* the states that take most of the visits of the sample */
+	if (total) {
+		rank = (acsm_rank_t *)ac_malloc(sizeof(acsm_rank_t) *
+		    acsm->num_hits);
+		MEMASSERT(rank, "acsm_report");
+		for (s = 0; s < acsm->num_hits; s++) {
+			rank[s].hits = acsm->hits[s];
+			rank[s].bfs = s;
+			rank[s].state = s;
+		}
+		qsort(rank, acsm->num_hits, sizeof(acsm_rank_t), rank_cmp);
+
+		fprintf(fp, "\nVisits:              %zu\n", total);
+		for (i = 0, s = 0, seen = 0; i < LEN(shares); i++) {
+			while (s < acsm->num_hits && seen < shares[i] * total)
+				seen += rank[s++].hits;
+			fprintf(fp, "%2.0f%% of the visits:   %d states, "
+			    "%.3f KB\n", shares[i] * 100, s,
+			    (double)s * row / 1024);
+		}
 
-	while (mlist) {
-		ilist = mlist;
-		mlist = mlist->next;
-		ac_free(ilist->pattern);
-		ac_free(ilist->casepattern);
-		ac_free(ilist);
+		fprintf(fp, "\nState     Depth  Visits (%%)\n");
+		for (s = 0; s < ACSM_REPORT_STATES && s < acsm->num_hits &&
+		    rank[s].hits; s++)
+			fprintf(fp, "%-8d  %-5d  %.2f\n", rank[s].state,
+			    depth[rank[s].state],
+			    100.0 * rank[s].hits / total);
+		ac_free(rank);
 	}
+	fprintf(fp, "-------------------------------------\n\n");
+
+	ac_free(depth);
+	ac_free(queue);
+	ac_free(per_depth);
+	ac_free(final_depth);
+	ac_free(visits);
+
+	return;
+}
+
+
+/*
+ * cleans the memory and keeps the serialized DFA state table
+ */ 
+void
+acsm_cleanup(acsm_t *acsm) 
+{
+	free_trie(acsm);
 
+	/* the patterns are all in the arena */
+	arena_release(acsm);
 	acsm->patterns = NULL;
 
 	return;
@@ -809,7 +3943,456 @@ acsm_cleanup(acsm_t *acsm)
 void
 acsm_free(acsm_t *acsm) 
 {
+	if (acsm->map)
+		munmap(acsm->map, acsm->map_size);
+	arena_release(acsm);
 	ac_free(acsm);
 
 	return;
 }
+
+
+#ifdef ACSMX_TEST
+
+#define TEST_PATTERNS	300	/* patterns of the first compilation */
+#define TEST_ROUNDS	8	/* rounds of deleted and inserted patterns */
+#define TEST_DELTA	12	/* patterns deleted and inserted per round */
+#define TEST_TEXT	(1 << 16)
+#define TEST_CHURN	100000	/* patterns replaced in the arena test */
+
+/*
+ * a pattern of the tests, and whether it is in the state machine
+ */
+struct test_pattern {
+	unsigned char	bytes[8];
+	int		n;
+	int		live;
+};
+
+/*
+ * fills a pattern with 3 to 8 random bytes out of the first letters
+ */
+static void
+random_pattern(struct test_pattern *p, int letters)
+{
+	int i;
+
+	p->n = 3 + rand() % 6;
+	for (i = 0; i < p->n; i++)
+		p->bytes[i] = 'a' + rand() % letters;
+	p->live = 1;
+}
+
+/*
+ * scans the bytes with the serialized DFA and returns a digest of the
+ * pattern IDs reported at each position, the same for the same matches
+ * whatever the numbering of the states and of the patterns
+ */
+static unsigned long
+scan_digest(acsm_t *acsm, acsm_pattern_t *patterns, unsigned char *buf,
+    size_t n, int *count)
+{
+	int s;
+	int k;
+	size_t i;
+	unsigned long d;
+	unsigned long h;
+
+	d = 0;
+	s = 0;
+	*count = 0;
+	for (i = 0; i < n; i++) {
+		s = acsm_walk(acsm, s, buf + i, 1);
+		for (k = acsm->h_out[s]; k < acsm->h_out[s + 1]; k++) {
+			h = (i + 1) * 2654435761UL +
+			    patterns[acsm->h_out_ids[k]].iid;
+			d += h * h;
+			(*count)++;
+		}
+	}
+
+	return d;
+}
+
+/*
+ * compiles the live patterns anew and returns the digest of the text; the
+ * IDs are their places in the array, or those of arg1
+ */
+static unsigned long
+fresh_digest(struct test_pattern *pats, int *iids, int num,
+    unsigned char *text, int *count)
+{
+	int i;
+	unsigned long d;
+	acsm_t *acsm;
+	acsm_pattern_t *patterns;
+
+	acsm = acsm_new();
+	for (i = 0; i < num; i++)
+		if (pats[i].live)
+			acsm_add_pattern(acsm, pats[i].bytes, pats[i].n, 0, 0,
+			    0, NULL, iids ? iids[i] : i);
+	acsm_compile(acsm);
+	acsm_serialize(acsm);
+	patterns = acsm_get_patterns_table(acsm);
+
+	d = scan_digest(acsm, patterns, text, TEST_TEXT, count);
+
+	FREE(patterns);
+	acsm_release(acsm, 0, NULL);
+	acsm_cleanup(acsm);
+	acsm_free(acsm);
+
+	return d;
+}
+
+/*
+ * dumps the state machine with n bytes at off of a section of the
+ * database, or of its header for -1, overwritten, and returns what
+ * acsm_load() makes of it
+ */
+static int
+load_corrupted(acsm_t *acsm, acsm_pattern_t *patterns, const char *path,
+    int section, size_t off, const void *bytes, size_t n)
+{
+	int e;
+	int fd;
+	acsm_t *copy;
+	acsm_db_header_t hdr;
+	acsm_pattern_t *loaded;
+
+	if (acsm_dump(acsm, patterns, path) != 0 ||
+	    (fd = open(path, O_RDWR)) == -1)
+		return 0;
+	if (section >= 0 && pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr))
+		off += hdr.section[section].offset;
+	e = pwrite(fd, bytes, n, off);
+	close(fd);
+	if (e != (int)n)
+		return 0;
+
+	e = acsm_load(path, &copy, &loaded);
+	if (e == 0) {
+		FREE(loaded);
+		acsm_free(copy);
+	}
+
+	return e;
+}
+
+int main(int argc, char *argv[]) {
+
+	int i;
+	int k;
+	int r;
+	int num;
+	int count;
+	int fresh_count;
+	int ok;
+	int failed = 0;
+	unsigned long d;
+	unsigned char *text;
+	acsm_t *acsm;
+	acsm_t *copy;
+	int fd;
+	char path[64];
+	FILE *fp;
+	acsm_pattern_t *patterns;
+	acsm_pattern_t *loaded;
+	struct test_pattern *pats;
+	int iids[TEST_PATTERNS];
+
+	srand(1);
+
+	pats = MALLOC((TEST_PATTERNS + TEST_ROUNDS * TEST_DELTA + 1) *
+	    sizeof(struct test_pattern));
+	text = MALLOC(TEST_TEXT);
+	for (i = 0; i < TEST_TEXT; i++)
+		text[i] = 'a' + rand() % 9;
+
+	/********************************************************************/
+
+	printf("Testing incremental updates against a fresh compilation... ");
+
+	acsm = acsm_new();
+	for (num = 0; num < TEST_PATTERNS; num++) {
+		random_pattern(&pats[num], 8);
+		acsm_add_pattern(acsm, pats[num].bytes, pats[num].n, 0, 0, 0,
+		    NULL, num);
+	}
+	acsm_compile(acsm);
+	acsm_serialize(acsm);
+
+	/* the bytes are in classes of their own, the spare rows take it all */
+	ok = 1;
+	for (r = 0; r < TEST_ROUNDS; r++) {
+		for (k = 0; k < TEST_DELTA; k++) {
+			i = rand() % num;
+			if (pats[i].live && acsm_delete_pattern(acsm, i) != 1)
+				ok = 0;
+			pats[i].live = 0;
+
+			random_pattern(&pats[num], 8);
+			acsm_insert_pattern(acsm, pats[num].bytes, pats[num].n,
+			    0, 0, 0, NULL, num);
+			num++;
+		}
+		if (acsm_update(acsm, 0, NULL, NULL) != 0)
+			ok = 0;
+	}
+
+	patterns = acsm_get_patterns_table(acsm);
+	if (scan_digest(acsm, patterns, text, TEST_TEXT, &count) !=
+	    fresh_digest(pats, NULL, num, text, &fresh_count) ||
+	    count != fresh_count)
+		ok = 0;
+	FREE(patterns);
+
+	/* a byte with no class of its own needs a new layout */
+	pats[num].n = 4;
+	memcpy(pats[num].bytes, "abzz", 4);
+	pats[num].live = 1;
+	acsm_insert_pattern(acsm, pats[num].bytes, 4, 0, 0, 0, NULL, num);
+	num++;
+	r = acsm_update(acsm, 0, NULL, NULL);
+
+	patterns = acsm_get_patterns_table(acsm);
+	d = scan_digest(acsm, patterns, text, TEST_TEXT, &count);
+
+	/* the copy for the device has the same tables */
+	copy = acsm_snapshot(acsm);
+	if (!ok || r != 1 || copy == NULL || count == 0 ||
+	    d != fresh_digest(pats, NULL, num, text, &fresh_count) ||
+	    count != fresh_count ||
+	    d != scan_digest(copy, patterns, text, TEST_TEXT, &count) ||
+	    count != fresh_count) {
+		printf("FAILED\n");
+		failed++;
+	} else
+		printf("OK\n");
+
+	if (copy) {
+		acsm_release(copy, 0, NULL);
+		acsm_free(copy);
+	}
+	FREE(patterns);
+	acsm_release(acsm, 0, NULL);
+	acsm_cleanup(acsm);
+	acsm_free(acsm);
+
+	/********************************************************************/
+
+	printf("Testing the pattern arena under insert and delete churn... ");
+
+	/* the first patterns are replaced over and over, the arena stays */
+	acsm = acsm_new();
+	for (i = 0; i < TEST_PATTERNS; i++) {
+		iids[i] = i;
+		acsm_add_pattern(acsm, pats[i].bytes, pats[i].n, 0, 0, 0,
+		    NULL, i);
+		pats[i].live = 1;
+	}
+	acsm_compile(acsm);
+	acsm_serialize(acsm);
+
+	ok = 1;
+	for (k = 0; k < TEST_CHURN; k++) {
+		i = k % TEST_PATTERNS;
+		if (acsm_delete_pattern(acsm, iids[i]) != 1)
+			ok = 0;
+		random_pattern(&pats[i], 8);
+		iids[i] = TEST_PATTERNS + k;
+		acsm_insert_pattern(acsm, pats[i].bytes, pats[i].n, 0, 0, 0,
+		    NULL, iids[i]);
+		if (acsm->arena_used > 2 * ACSM_ARENA_BLOCK)
+			ok = 0;
+	}
+	acsm_update(acsm, 0, NULL, NULL);
+
+	patterns = acsm_get_patterns_table(acsm);
+	d = scan_digest(acsm, patterns, text, TEST_TEXT, &count);
+	if (!ok || d != fresh_digest(pats, iids, TEST_PATTERNS, text,
+	    &fresh_count) || count != fresh_count) {
+		printf("FAILED\n");
+		failed++;
+	} else
+		printf("OK\n");
+
+	FREE(patterns);
+	acsm_release(acsm, 0, NULL);
+	acsm_cleanup(acsm);
+	acsm_free(acsm);
+
+	/********************************************************************/
+
+	printf("Testing signatures checked against the buffer before... ");
+
+	acsm = acsm_new();
+	acsm_add_signature(acsm, "5858{2-4}41424344", 0, 0, NULL, 0);
+	acsm_add_signature(acsm, "5959*41424345", 0, 0, NULL, 1);
+	acsm_compile(acsm);
+	acsm_serialize(acsm);
+
+	/* the anchors end at the fourth byte of the buffer */
+	if (acsm_check_edge(acsm, 0, (unsigned char *)"....XX..", 8,
+	    (unsigned char *)"ABCD....", 3, 8) != 1 ||
+	    acsm_check_edge(acsm, 0, (unsigned char *)"..XX....", 8,
+	    (unsigned char *)"ABCD....", 3, 8) != 1 ||
+	    acsm_check_edge(acsm, 0, (unsigned char *)".XX.....", 8,
+	    (unsigned char *)"ABCD....", 3, 8) != 0 ||
+	    acsm_check_edge(acsm, 0, (unsigned char *)"XX", 2,
+	    (unsigned char *)"ABCD....", 3, 8) != 0 ||
+	    acsm_check_edge(acsm, 1, (unsigned char *)"YY......", 8,
+	    (unsigned char *)"ABCE....", 3, 8) != 1 ||
+	    acsm_check_edge(acsm, 1, (unsigned char *)"Y.......", 8,
+	    (unsigned char *)"ABCE....", 3, 8) != 0) {
+		printf("FAILED\n");
+		failed++;
+	} else
+		printf("OK\n");
+
+	acsm_release(acsm, 0, NULL);
+	acsm_cleanup(acsm);
+	acsm_free(acsm);
+
+	/********************************************************************/
+
+	printf("Testing malformed signatures... ");
+
+	acsm = acsm_new();
+	if (acsm_add_signature(acsm, "41??42", 0, 0, NULL, 0) != -1 ||
+	    acsm_add_signature(acsm, "4142{2-", 0, 0, NULL, 0) != -1 ||
+	    acsm_add_signature(acsm, "4142(43|4444)", 0, 0, NULL, 0) != -1 ||
+	    acsm_add_signature(acsm, "41424", 0, 0, NULL, 0) != -1 ||
+	    acsm_add_signature(acsm, "4x4243", 0, 0, NULL, 0) != -1 ||
+	    acsm_add_signature(acsm, "4142{2}43??44(45|46)", 0, 0, NULL,
+	    0) != 0 || acsm->num_patterns != 1) {
+		printf("FAILED\n");
+		failed++;
+	} else
+		printf("OK\n");
+
+	acsm_cleanup(acsm);
+	acsm_free(acsm);
+
+	/********************************************************************/
+
+	printf("Testing the compiled database round trip... ");
+
+	acsm = acsm_new();
+	for (i = 0; i < num; i++)
+		if (pats[i].live)
+			acsm_add_pattern(acsm, pats[i].bytes, pats[i].n, 0, 0,
+			    0, NULL, i);
+	acsm_add_pattern(acsm, (unsigned char *)"AbcD", 4, 1, 0, 0, NULL,
+	    num);
+	acsm_add_signature(acsm, "5858{2-4}41424344", 0, 0, NULL, num + 1);
+	acsm_compile(acsm);
+	acsm_serialize(acsm);
+	patterns = acsm_get_patterns_table(acsm);
+	d = scan_digest(acsm, patterns, text, TEST_TEXT, &count);
+
+	/* the signature is the last pattern added */
+	k = acsm->num_patterns - 1;
+
+	snprintf(path, sizeof(path), "/tmp/acsmx_test.XXXXXX");
+	fd = mkstemp(path);
+	if (fd != -1)
+		close(fd);
+
+	copy = NULL;
+	if (fd != -1 && acsm_dump(acsm, patterns, path) == 0 &&
+	    acsm_load(path, &copy, &loaded) != 0)
+		copy = NULL;
+	if (copy == NULL ||
+	    d != scan_digest(copy, loaded, text, TEST_TEXT, &fresh_count) ||
+	    count != fresh_count || copy->fold != 1 ||
+	    loaded[k].iid != num + 1 ||
+	    acsm_check_edge(copy, k, (unsigned char *)"....XX..", 8,
+	    (unsigned char *)"ABCD....", 3, 8) != 1) {
+		printf("FAILED\n");
+		failed++;
+	} else
+		printf("OK\n");
+
+	if (copy) {
+		FREE(loaded);
+		acsm_release(copy, 0, NULL);
+		acsm_free(copy);
+	}
+
+	/********************************************************************/
+
+	printf("Testing that damaged databases are refused... ");
+
+	/* each of them is reported and none is taken for a pattern file */
+	r = ACSM_DB_VERSION + 1;
+	ok = (load_corrupted(acsm, patterns, path, -1,
+	    offsetof(acsm_db_header_t, version), &r, sizeof(r)) == -1);
+	r = 3;
+	ok &= (load_corrupted(acsm, patterns, path, -1,
+	    offsetof(acsm_db_header_t, state_size), &r, sizeof(r)) == -1);
+	r = acsm->num_classes;
+	ok &= (load_corrupted(acsm, patterns, path, -1,
+	    offsetof(acsm_db_header_t, classmap) + 'a', &r, 1) == -1);
+	r = 0x7f7f7f7f;
+	ok &= (load_corrupted(acsm, patterns, path, ACSM_DB_TRANS,
+	    acsm->state_size * 7, &r, acsm->state_size) == -1);
+	r = acsm->num_patterns;
+	ok &= (load_corrupted(acsm, patterns, path, ACSM_DB_OUT_IDS, 0, &r,
+	    sizeof(r)) == -1);
+	ok &= (load_corrupted(acsm, patterns, path, ACSM_DB_PATTERNS,
+	    offsetof(acsm_db_pattern_t, index), &r, sizeof(r)) == -1);
+	r = acsm->sig_size;
+	ok &= (load_corrupted(acsm, patterns, path, ACSM_DB_SIGS,
+	    k * sizeof(int), &r, sizeof(r)) == -1);
+	r = ACSM_SIG_MAX_PARTS + 1;
+	ok &= (load_corrupted(acsm, patterns, path, ACSM_DB_SIG_CODE,
+	    acsm->h_sigs[k] * sizeof(int), &r, sizeof(r)) == -1);
+
+	/* a database cut short, even within its header */
+	ok &= (acsm_dump(acsm, patterns, path) == 0 &&
+	    truncate(path, sizeof(acsm_db_header_t) - 1) == 0 &&
+	    acsm_load(path, &copy, &loaded) == -1);
+
+	if (!ok) {
+		printf("FAILED\n");
+		failed++;
+	} else
+		printf("OK\n");
+
+	FREE(patterns);
+	acsm_release(acsm, 0, NULL);
+	acsm_cleanup(acsm);
+	acsm_free(acsm);
+
+	/********************************************************************/
+
+	printf("Testing that other files are not loaded as a database... ");
+
+	/* a pattern file, a file shorter than a header and no file */
+	fp = fopen(path, "w");
+	if (fp) {
+		for (i = 0; i < 1024; i++)
+			fprintf(fp, "%d pattern\n", i);
+		fclose(fp);
+	}
+	if (fp == NULL || acsm_load(path, &copy, &loaded) != 1) {
+		printf("FAILED\n");
+		failed++;
+	} else if (truncate(path, 16) != 0 ||
+	    acsm_load(path, &copy, &loaded) != 1 ||
+	    unlink(path) != 0 || acsm_load(path, &copy, &loaded) != 1) {
+		printf("FAILED\n");
+		failed++;
+	} else
+		printf("OK\n");
+
+	/********************************************************************/
+
+	FREE(pats);
+	FREE(text);
+
+	return failed;
+}
+#endif
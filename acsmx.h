@@ -46,6 +46,12 @@
 /* default Fail State */
 #define ACSM_FAIL_STATE	-1
 
+/* maximum number of pattern groups, see acsm_set_groups() */
+#define ACSM_MAX_GROUPS	16
+
+/* maximum number of parts of a signature, see acsm_add_signature() */
+#define ACSM_SIG_MAX_PARTS	16
+
 
 /* Aho-Corasick state machine pattern */
 struct _acsm_pattern {
@@ -59,18 +65,22 @@ struct _acsm_pattern {
 	void			*id;
 	int			iid;
 	unsigned int		index;
+	int			*sig;		/* signature program, or NULL */
+	int			sig_len;
 };
 typedef struct _acsm_pattern acsm_pattern_t;
 
 
-/* Aho-Corasick state machine state table */
-struct _acsm_state_table {
-	int		next_state[ALPHABET_SIZE];
+/* Aho-Corasick state machine trie state, the goto edges are kept sparse */
+struct _acsm_state {
+	int		child;		/* first child, children sorted by byte */
+	int		sibling;	/* next child of the same parent        */
 	int		fail_state;
-	int		num_finals;
-	acsm_pattern_t	*match_list;
+	int		output;		/* first pattern ending in this state   */
+	int		match;		/* pattern reported in this state       */
+	unsigned char	byte;		/* byte of the edge from the parent     */
 };
-typedef struct _acsm_state_table acsm_state_table_t;
+typedef struct _acsm_state acsm_state_t;
 
 
 /* Aho-Corasick state machine */
@@ -81,9 +91,56 @@ struct _acsm {
 	size_t			size;
 	acsm_pattern_t		*patterns;
 	int			num_patterns;
-	acsm_state_table_t	*state_table;
-	int			*h_trans;
+	struct _acsm_arena	*arena;		/* the patterns, in blocks    */
+	size_t			arena_used;	/* bytes handed out           */
+	size_t			arena_dead;	/* of them, deleted patterns  */
+	acsm_state_t		*trie;
+	int			num_groups;	/* roots, states 0 to K - 1   */
+	unsigned char		group_of[ALPHABET_SIZE]; /* per first byte */
+	int			root_next[ACSM_MAX_GROUPS][ALPHABET_SIZE];
+	int			*out_next;
+	int			*out_state;	/* state each pattern ends in */
+	int			*order;		/* states, breadth first      */
+	int			*levels;	/* first state of each depth  */
+	int			num_levels;
+	unsigned char		*dirty;		/* dense row state per state  */
+	size_t			*hits;		/* visits per state, profiled */
+	int			num_hits;
+	int			free_state;	/* states of deleted patterns */
+	int			recompile;
+	int			num_classes;
+	unsigned char		classmap[ALPHABET_SIZE];
+	cl_uint			start_bytes[ACSM_MAX_GROUPS][ALPHABET_SIZE / 32];
+	int			state_size;
+	int			trans_rows;	/* rows, including spare ones */
+	void			*h_trans;
+	int			*h_out;
+	int			num_outputs;
+	int			*h_out_ids;
+	int			fold;
+	int			*h_verify;
+	int			*h_window;	/* offset, depth per pattern  */
+	int			windowed;	/* a pattern has a window     */
+	unsigned char		*h_case;
+	size_t			case_size;
+	int			*h_sigs;	/* signature per pattern      */
+	int			*h_sig_code;
+	size_t			sig_size;
+	int			num_sigs;
 	cl_mem			d_trans;
+	cl_mem			d_trans_image;	/* copy of d_trans, or NULL   */
+	int			image;		/* bind the table as an image */
+	cl_mem			d_out;
+	cl_mem			d_out_ids;
+	cl_mem			d_verify;
+	cl_mem			d_window;
+	cl_mem			d_case;
+	cl_mem			d_sigs;
+	cl_mem			d_sig_code;
+	cl_mem			d_classmap;
+	cl_mem			d_start;
+	void			*map;
+	size_t			map_size;
 };
 typedef struct _acsm acsm_t;
 
@@ -103,19 +160,77 @@ acsm_new(void);
  * arg0: Aho-Corasick state machine
  * arg1: a string containing the pattern
  * arg2: pattern size in bytes
- * arg3: a flag indicating case sensitivity
- * arg4: pattern offset (depricated)
- * arg4: pattern depth (depricated)
- * arg5: callback handler (depricated)
- * arg6: pattern ID
+ * arg3: a flag indicating case insensitivity
+ * arg4: pattern offset, a match must start at least offset bytes into the
+ *       input (0 for anywhere)
+ * arg5: pattern depth, a match must end within depth bytes from the offset
+ *       (0 for anywhere)
+ * arg6: callback handler (depricated)
+ * arg7: pattern ID
  */
 void
 acsm_add_pattern(acsm_t *, unsigned char *, int, int, int, int, void *, int);
 
 
+/*
+ * adds a ClamAV style hex signature to the list of patterns for this state
+ * machine
+ *
+ * besides hex bytes the signature may hold '??' (any byte), 'a?' and '?a'
+ * (any nibble), '(aa|bb)' (one of byte strings of the same size), '{n}'
+ * (n bytes), '{n-m}', '{-m}' and '{n-}' (n to m bytes) and '*' (any number
+ * of bytes). The longest run of plain bytes is added to the automaton as a
+ * pattern; the rest of the signature is compiled to a program that the
+ * verification kernel runs around each match of it, see acsm_serialize().
+ * A signature of plain bytes only is added as a plain pattern
+ *
+ * arg0: Aho-Corasick state machine
+ * arg1: NUL terminated printable hex signature
+ * arg2: pattern offset, see acsm_add_pattern()
+ * arg3: pattern depth, see acsm_add_pattern()
+ * arg4: callback handler (depricated)
+ * arg5: pattern ID
+ *
+ * ret:   0 on success
+ *       -1 if the signature is malformed, has more than ACSM_SIG_MAX_PARTS
+ *          parts or no run of at least two plain bytes
+ */
+int
+acsm_add_signature(acsm_t *, char *, int, int, void *, int);
+
+
+/*
+ * splits the patterns into groups, each with an automaton of its own, when
+ * the state machine is compiled; must be called before acsm_compile()
+ *
+ * the automata share the serialized DFA: group g is rooted at state g and
+ * its states follow each other, so a scan for a group only touches a slice
+ * of the table, which for large pattern sets may fit a cache the whole
+ * table does not. The patterns are grouped by their first byte, in ranges
+ * that hold about the same number of states; a chunk is scanned once per
+ * group
+ *
+ * arg0: Aho-Corasick state machine
+ * arg1: number of groups, 1 to ACSM_MAX_GROUPS (default: 1)
+ */
+void
+acsm_set_groups(acsm_t *, int);
+
+
 /*
  * compiles the state machine
  *
+ * the trie and its failure transitions are built with sparse goto edges;
+ * the dense rows are only created by acsm_serialize(), straight into the
+ * serialized DFA, so the construction needs a few words per state
+ *
+ * the states are numbered breadth first, each group after the other, so
+ * the shallow states share cache lines in the serialized DFA
+ *
+ * the failure transitions and the dense rows of a state only depend on
+ * shallower states, so large automata are compiled one depth at a time
+ * with a thread per online processor
+ *
  * arg0: Aho-Corasick state machine
  */
 void
@@ -123,19 +238,301 @@ acsm_compile(acsm_t *);
 
 
 /*
- * creates the serialized DFA state table and transfers it to the device
+ * adds a pattern to a compiled state machine; the change reaches the
+ * serialized DFA with acsm_update()
+ *
+ * must be called before acsm_cleanup(), the trie is needed
+ *
+ * arg0: Aho-Corasick state machine
+ * arg1: a string containing the pattern
+ * arg2: pattern size in bytes
+ * arg3: a flag indicating case insensitivity
+ * arg4: pattern offset, see acsm_add_pattern()
+ * arg5: pattern depth, see acsm_add_pattern()
+ * arg6: callback handler (depricated)
+ * arg7: pattern ID
+ *
+ * ret:   0 on success
+ *       -1 if the state machine has no trie
+ */
+int
+acsm_insert_pattern(acsm_t *, unsigned char *, int, int, int, int, void *,
+    int);
+
+
+/*
+ * removes the patterns with the given ID from a compiled state machine;
+ * the change reaches the serialized DFA with acsm_update()
+ *
+ * the index of a removed pattern is not reused, so the pattern table of
+ * acsm_get_patterns_table() has an empty entry in its place
+ *
+ * the memory of the removed patterns stays in the pattern arena until
+ * they take half of it, and 1 MB at least; the call then moves the
+ * patterns left to a new arena and frees the old one. Any pointer to an
+ * acsm_pattern_t of the state machine, or to its pattern and casepattern
+ * bytes, is no longer valid after the call; the tables returned by
+ * acsm_get_patterns_table() are copies and are not affected
+ *
+ * arg0: Aho-Corasick state machine
+ * arg1: pattern ID
+ *
+ * ret:  the number of patterns removed
+ *       -1 if the state machine has no trie
+ */
+int
+acsm_delete_pattern(acsm_t *, int);
+
+
+/*
+ * counts how often each state is visited over a block of sample traffic,
+ * for acsm_reorder(); may be called for several blocks, each is scanned
+ * from the roots
+ *
+ * must be called after acsm_compile(); once the state machine is
+ * serialized, or loaded, its serialized DFA is walked instead and the
+ * counts serve acsm_report() only
+ *
+ * arg0: Aho-Corasick state machine
+ * arg1: sample bytes
+ * arg2: number of bytes
+ *
+ * ret:   0 on success
+ *       -1 if the state machine has neither a trie nor a serialized DFA
+ */
+int
+acsm_profile(acsm_t *, unsigned char *, size_t);
+
+
+/*
+ * renumbers the states so that the rows read the most are adjacent in the
+ * serialized DFA: the states of each group, in the visit order counted by
+ * acsm_profile(), the unvisited ones breadth first
+ *
+ * acsm_compile() already numbers the states breadth first, so the top
+ * levels of the trie, where most transitions stay, are contiguous; this
+ * packs the rows that the profiled traffic reads into fewer cache lines and
+ * pages still
+ *
+ * must be called before acsm_serialize()
+ *
+ * arg0: Aho-Corasick state machine
+ *
+ * ret:   0 on success
+ *       -1 if the state machine has no trie or is serialized already
+ */
+int
+acsm_reorder(acsm_t *);
+
+
+/*
+ * serializes the DFA state table to host memory
+ *
+ * the input bytes are first grouped into equivalence classes (bytes that
+ * lead to the same next state from every state), so each row holds
+ * num_classes entries instead of ALPHABET_SIZE; the byte to class map is
+ * transferred to the device along with the table
+ *
+ * a transition into a final state is stored negated; the patterns that
+ * matched are kept in separate output sets, in CSR form (per state offsets
+ * into a table of pattern ids), so the transition table holds next states
+ * only and every pattern ending in a state is reported
+ *
+ * the entries are the narrowest signed integers that can hold all states
+ * (8, 16 or 32 bits, see acsm_get_state_size())
+ *
+ * if any pattern is case insensitive the automaton is built over case
+ * folded bytes and the byte classes fold the input; the case sensitive
+ * patterns that contain letters are then checked against their original
+ * bytes when they match
+ *
+ * the offset and depth of each pattern go to a table of their own; the
+ * kernel checks them against the position of a match in its input, so the
+ * matches outside their window are never reported
+ *
+ * the programs of the signatures are collected in a table of their own,
+ * with the offset of its program (or -1) per pattern; after the matching
+ * kernel, a verification kernel runs the program of each anchor match over
+ * the bytes around it and drops the matches of the signatures that fail
+ *
+ * arg0: Aho-Corasick state machine
+ */
+void
+acsm_serialize(acsm_t *);
+
+
+/*
+ * transfers the serialized DFA state table to the device
+ *
+ * along with the table goes a bitmap per group of the bytes that leave its
+ * root; the matching kernel skips the input that starts no pattern while
+ * at a root without reading the table
+ *
+ * the table may also be bound as a 2D image, a row per state and a column
+ * per byte class, that the matching kernel reads through the texture
+ * cache, apart from the input; the image is a copy of the buffer, which is
+ * still the one mapped and patched (see acsm_update()), and it is left out
+ * if the device can not take it, e.g., the rows exceed its image height
+ *
+ * arg0: Aho-Corasick state machine
+ * arg1: memory mapped buffers flag
+ * arg2: image flag
+ * arg3: OpenCL context
+ * arg4: OpenCL command queue
+ */
+void
+acsm_upload(acsm_t *, int, int, cl_context, cl_command_queue);
+
+
+/*
+ * applies the patterns inserted and deleted since the last serialization
+ * to the serialized DFA and its device copy
+ *
+ * the failure transitions are recomputed over the sparse trie; only the
+ * dense rows that are stale, or whose failure state's row changed, are
+ * recomputed, and only the rows that differ are written to the device, in
+ * ranges of adjacent rows (mapped buffers are patched in place); the output
+ * sets, the case verification, the window and the signature tables are
+ * transferred anew
+ *
+ * if the serialized DFA can not take the new states (wider entries, more
+ * rows than the spare ones or new byte classes), the automaton has to be
+ * case folded or it gets its first pattern with a window, it is serialized
+ * and transferred anew; the device buffers change, and so may the state
+ * size and the options the matching program is built for; the program is
+ * also built for the longest pattern, which an insertion may change even
+ * if the tables are patched in place, and a small automaton for its
+ * transitions (see acsm_gen_code())
+ *
+ * a state machine serialized but never uploaded is updated on the host
+ * only, the context and the queue are not used; acsm_snapshot() takes a
+ * copy of its tables for the device
  *
  * arg0: Aho-Corasick state machine
  * arg1: memory mapped buffers flag
  * arg2: OpenCL context
  * arg3: OpenCL command queue
+ *
+ * ret:   0 if the tables were patched in place
+ *        1 if the tables were serialized and transferred anew
+ *       -1 if the state machine has no trie or was not serialized
+ */
+int
+acsm_update(acsm_t *, int, cl_context, cl_command_queue);
+
+
+/*
+ * copies the serialized tables of a state machine that was not uploaded to
+ * a new one, without its trie, its patterns and its spare rows, as loaded
+ * by acsm_load(); the copy is uploaded and the original keeps taking
+ * updates on the host
+ *
+ * arg0: Aho-Corasick state machine, serialized
+ *
+ * ret: the copy, freed by acsm_release() and acsm_free()
+ *      NULL if the state machine was not serialized or was uploaded
+ */
+acsm_t *
+acsm_snapshot(acsm_t *);
+
+
+/*
+ * runs the serialized DFA on the host, e.g., to find the state of a stream
+ * in another automaton; the bytes are mapped to their classes first
+ *
+ * arg0: Aho-Corasick state machine
+ * arg1: state to start from
+ * arg2: bytes
+ * arg3: number of bytes
+ *
+ * ret:  the state after the last byte
+ */
+int
+acsm_walk(acsm_t *, int, unsigned char *, size_t);
+
+
+/*
+ * checks a match that the kernel could not check in full since it starts
+ * before the buffer it was found in, see ocl_aho_match_edges(): the bytes
+ * before the buffer are taken from the end of the buffer before, which
+ * the file continues in this one
+ *
+ * the original case of the pattern is checked and, if it is the anchor of
+ * a signature, the signature; its parts may lie in arg2 and in arg4 up to
+ * arg6
+ *
+ * arg0: Aho-Corasick state machine, serialized
+ * arg1: pattern index
+ * arg2: end of the buffer before
+ * arg3: number of bytes of arg2
+ * arg4: buffer of the match
+ * arg5: position of the last byte of the match in arg4
+ * arg6: end of the bytes of arg4 that follow each other in the file of
+ *       the match
+ *
+ * ret:  1 if the pattern matches
+ *       0 if it does not, or if it needs bytes before those of arg2
+ */
+int
+acsm_check_edge(acsm_t *, int, const unsigned char *, size_t,
+    const unsigned char *, long, long);
+
+
+/*
+ * generates the serialized DFA as OpenCL C source: a function
+ * int next_state(int state, uchar c) of a switch on the state and, in
+ * each state, a switch on the byte class whose default is the most
+ * frequent next state of the row, so that the transitions are constants
+ * of the program instead of loads from the table; final states are
+ * negative, as in the table
+ *
+ * the code holds the table as serialized; it has to be generated and the
+ * program built again after acsm_update()
+ *
+ * the size of the code goes with the number of its cases, a case per
+ * state and one per byte class that does not lead to the default of its
+ * row; only small automata are worth it
+ *
+ * arg0: Aho-Corasick state machine, serialized
+ * arg1: most cases of the code
+ *
+ * ret:  the source, freed with free()
+ *       NULL if the code needs more cases or the allocation fails
+ */
+char *
+acsm_gen_code(acsm_t *, int);
+
+
+/*
+ * releases the serialized DFA and the other tables transferred to the
+ * device by acsm_upload(), along with their host copies; the tables of a
+ * state machine serialized but never uploaded are freed on the host
+ *
+ * arg0: Aho-Corasick state machine
+ * arg1: memory mapped buffers flag, as given to acsm_upload()
+ * arg2: OpenCL command queue the buffers were mapped with
  */
 void
-acsm_gen_state_table(acsm_t *, int, cl_context, cl_command_queue);
+acsm_release(acsm_t *, int, cl_command_queue);
+
+
+/*
+ * creates the serialized DFA state table and transfers it to the device,
+ * see acsm_serialize() and acsm_upload()
+ *
+ * arg0: Aho-Corasick state machine
+ * arg1: memory mapped buffers flag
+ * arg2: image flag, see acsm_upload()
+ * arg3: OpenCL context
+ * arg4: OpenCL command queue
+ */
+void
+acsm_gen_state_table(acsm_t *, int, int, cl_context, cl_command_queue);
 
 /*
  * returns a newly allocated table containing all patterns contained
- * in this acsm_t
+ * in this acsm_t; the table and the NUL terminated copies of the patterns
+ * are a single allocation, freed with FREE()
  *
  * arg0: Aho-Corasick state machine
  *
@@ -145,6 +542,45 @@ acsm_gen_state_table(acsm_t *, int, cl_context, cl_command_queue);
 acsm_pattern_t *
 acsm_get_patterns_table(acsm_t *acsm);
 
+/*
+ * writes the serialized DFA and the pattern metadata to a compiled
+ * database; must be called after acsm_serialize() and before acsm_cleanup()
+ *
+ * the database is a versioned header followed by page aligned sections
+ * (transition table, output sets, pattern records, pattern bytes and
+ * signature programs) so it can be mapped and uploaded as is by acsm_load()
+ *
+ * arg0: Aho-Corasick state machine
+ * arg1: patterns table, see acsm_get_patterns_table()
+ * arg2: database path
+ *
+ * ret:  0 on success
+ *       -1 on I/O error, errno is set
+ */
+int
+acsm_dump(acsm_t *, acsm_pattern_t *, const char *);
+
+
+/*
+ * maps a compiled database read-only; the serialized DFA stays in the
+ * mapping, so processes that load the same database share the pages
+ *
+ * the returned automaton is ready for acsm_upload(); every state, output
+ * and pattern index in the tables is checked to stay in them
+ *
+ * arg0: database path
+ * arg1: returns the Aho-Corasick state machine
+ * arg2: returns the patterns table, pointing into the mapping
+ *
+ * ret:  0 on success
+ *       1 if the file is not a compiled database
+ *       -1 if it is a database of another version, truncated or corrupted;
+ *       the reason is printed
+ */
+int
+acsm_load(const char *, acsm_t **, acsm_pattern_t **);
+
+
 /*
  * returns the size of the largest pattern
  *
@@ -167,6 +603,39 @@ int
 acsm_get_states(acsm_t *);
 
 
+/*
+ * returns the number of pattern groups, see acsm_set_groups()
+ *
+ * arg0: Aho-Corasick state machine
+ *
+ * ret:  number of groups, the roots are the states 0 to groups - 1
+ */
+int
+acsm_get_groups(acsm_t *);
+
+
+/*
+ * returns the number of byte equivalence classes
+ *
+ * arg0: Aho-Corasick state machine
+ *
+ * ret:  number of byte classes (row width of the serialized DFA)
+ */
+int
+acsm_get_classes(acsm_t *);
+
+
+/*
+ * returns the size of a serialized DFA entry
+ *
+ * arg0: Aho-Corasick state machine
+ *
+ * ret:  size of a state entry in bytes (1, 2 or 4)
+ */
+int
+acsm_get_state_size(acsm_t *);
+
+
 /*
  * returns the automaton size in bytes
  *
@@ -179,7 +648,28 @@ acsm_get_size(acsm_t *);
 
 
 /*
- * cleans the memory and keeps the serialized DFA state table
+ * reports the shape of the serialized DFA: the states and final states
+ * per depth, with the working set of the rows down to each depth, the
+ * fan-out of the states (their children in the trie) and, if the state
+ * machine was profiled after its serialization (see acsm_profile()), the
+ * visits per depth, the states that take most of the visits and the
+ * hottest states
+ *
+ * the depth of a state is the length of the shortest input that leads to
+ * it from its root
+ *
+ * arg0: Aho-Corasick state machine, serialized or loaded
+ * arg1: number of depths listed, the deeper ones are summed up
+ * arg2: stream the report is written to
+ */
+void
+acsm_report(acsm_t *, int, FILE *);
+
+
+/*
+ * cleans the memory and keeps the serialized DFA state table; the
+ * patterns are kept in large blocks while the state machine is built and
+ * are all released here at once
  *
  * arg0: Aho-Corasick state machine
  */
@@ -188,7 +678,7 @@ acsm_cleanup(acsm_t *);
 
 
 /*
- * frees all acsm memory
+ * frees all acsm memory, unmaps a loaded database
  *
  * arg0: Aho-Corasick state machine
  */
@@ -1,26 +1,266 @@
+/*
+ * STATE_T is the type of the serialized DFA entries (char, short or int),
+ * selected by the host according to the number of states
+ */
+#ifndef STATE_T
+#define STATE_T int
+#endif
+
+/*
+ * the host builds the program for the values of a run, so that the loops
+ * have known bounds and the code a run does not need is compiled out: the
+ * result cells per chunk, the longest pattern, the width of the rows and
+ * the number of pattern groups. The kernel arguments stand in for the
+ * values not given.
+ */
+#ifndef MAX_RESULTS
+#define MAX_RESULTS	max_results
+#endif
+#ifndef MAX_PAT_SIZE
+#define MAX_PAT_SIZE	max_pat_size
+#endif
+#ifndef NUM_CLASSES
+#define NUM_CLASSES	num_classes
+#endif
+#ifndef NUM_GROUPS
+#define NUM_GROUPS	num_groups
+#endif
+
+/*
+ * the serialized DFA is read from constant memory if the host found that
+ * the whole table fits there (TRANS_CONSTANT); otherwise the first
+ * LOCAL_ROWS rows, of NUM_CLASSES entries, are copied to local memory by
+ * each work-group and only the deeper states are read from global memory.
+ * The states are numbered breadth first, so the top rows take most of the
+ * lookups.
+ *
+ * With TRANS_IMAGE, the table is an image of a texel per entry, a row per
+ * state, read through the texture cache that the input does not go
+ * through.
+ *
+ * With TRANS_CODE, the host generated the DFA of a small automaton as a
+ * function next_state() put before this source (see acsm_gen_code()), and
+ * the table argument is not read; its value is a hash of the code.
+ */
+#if defined(TRANS_IMAGE)
+#define TRANS_ARG	__read_only image2d_t trans
+#elif defined(TRANS_CONSTANT)
+#define TRANS_ARG	__constant STATE_T *trans
+#else
+#define TRANS_ARG	__global STATE_T *trans
+#endif
+
+#if defined(TRANS_CODE)
+#define NEXT_STATE(s, c)	(next_state((s), (c)))
+#elif defined(TRANS_IMAGE)
+__constant sampler_t trans_sampler = CLK_NORMALIZED_COORDS_FALSE |
+    CLK_ADDRESS_NONE | CLK_FILTER_NEAREST;
+
+#define NEXT_STATE(s, c)						\
+	(read_imagei(trans, trans_sampler, (int2)((c), (s))).x)
+#elif defined(LOCAL_ROWS)
+#define NEXT_STATE(s, c)						\
+	((s) < LOCAL_ROWS ? top[NUM_CLASSES * (s) + (c)] :		\
+	    trans[width * (unsigned long)(s) + (unsigned long)(c)])
+#else
+#define NEXT_STATE(s, c)						\
+	(trans[width * (unsigned long)(s) + (unsigned long)(c)])
+#endif
+
+/*
+ * position in the data buffer of word w of the chunks laid one after the
+ * other; if words is set, the host interleaved the words of the chunks,
+ * each words long: word k of every chunk is stored next to word k of the
+ * others, so that the threads of a group read adjacent words
+ */
+long
+word_pos(long w, int words, unsigned int chunks)
+{
+	if (words == 0)
+		return w;
+
+	return (w % words) * chunks + w / words;
+}
+
+/*
+ * position in the data buffer of byte p of the chunks laid one after the
+ * other, see word_pos()
+ */
+long
+byte_pos(long p, int words, unsigned int chunks)
+{
+	return word_pos(p / sizeof(uint4), words, chunks) * sizeof(uint4) +
+	    p % sizeof(uint4);
+}
+
+/*
+ * a result cell of a match that starts before the buffer, which the host
+ * checks against the end of the buffer before, see ocl_aho_match_edges()
+ */
+#define RESULT_EDGE(pat)	(-2 - (pat))
+
+/*
+ * the position of a result cell whose signature may continue past the end
+ * of the buffer, which the host checks against the next buffer, see
+ * ocl_aho_match_edges(); the macro is its own inverse
+ */
+#define RESULT_DEFER(pos)	(-1 - (pos))
+
+#ifdef CASE_FOLD
+/*
+ * checks the original case of a pattern ending at pos; the case folded
+ * automaton matched it regardless of case. verify holds the offset of the
+ * original bytes (-1 for no check) and the pattern size. Returns 1 if the
+ * case matches, 0 if not and -1 if the pattern starts in a previous
+ * buffer and the bytes in this one match: the rest is left to the host.
+ */
+int
+case_match(__global uchar *bytes, long pos, int2 verify,
+    __global uchar *case_bytes, int words, unsigned int chunks)
+{
+	int k;
+	long start = pos - verify.y + 1;
+
+	if (verify.x < 0)
+		return 1;
+
+	for (k = max(-start, 0L); k < verify.y; k++)
+		if (bytes[byte_pos(start + k, words, chunks)] !=
+		    case_bytes[verify.x + k])
+			return 0;
+
+	return (start < 0) ? -1 : 1;
+}
+#endif
+
+#ifdef WINDOW
+/*
+ * checks that a pattern of size n ending at the file offset end lies in
+ * its window: it starts at window.x or later and, if window.y is set, ends
+ * within window.y bytes from there
+ */
+int
+in_window(int2 window, long end, int n)
+{
+	if (end - n + 1 < window.x)
+		return 0;
+	if (window.y > 0 && end >= (long)window.x + window.y)
+		return 0;
+
+	return 1;
+}
+#endif
+
+/*
+ * reports every pattern of the output set of the final state at pos, as
+ * long as the thread has result cells left; returns the matches so far.
+ * base + pos is the file offset of pos. A match whose case is left to the
+ * host is stored flagged, see RESULT_EDGE(). The anchor of a signature is
+ * not counted once the cells are full: sigverify can not check it there.
+ */
+int
+report_matches(__global int *out, __global int *out_ids,
+    __global int2 *verify, __global int2 *window, __global uchar *case_bytes,
+    __global int *sigs, __global uchar *bytes, int state, long pos, long base,
+    __global int *results, __global int *results2, unsigned int chunks,
+    int words, int id, int matches, int max_results)
+{
+	int k;
+	int cased = 1;
+
+	for (k = out[state]; k < out[state + 1]; k++) {
+#ifdef CASE_FOLD
+		cased = case_match(bytes, pos, verify[out_ids[k]], case_bytes,
+		    words, chunks);
+		if (cased == 0)
+			continue;
+#endif
+#ifdef WINDOW
+		if (!in_window(window[out_ids[k]], base + pos,
+		    verify[out_ids[k]].y))
+			continue;
+#endif
+		if (matches >= MAX_RESULTS - 1 && sigs[out_ids[k]] >= 0)
+			continue;
+		matches++;
+		if (matches < MAX_RESULTS) {
+			results[matches * chunks + id] = (cased < 0) ?
+			    RESULT_EDGE(out_ids[k]) : out_ids[k];
+			results2[matches * chunks + id] = pos; // add index for absolute offset
+		}
+	}
+
+	return matches;
+}
+
+/*
+ * tells whether a byte leaves the root of a group; start holds a bit per
+ * byte, in 32 bit words
+ */
+int
+start_byte(__constant uint *start, uchar b)
+{
+	return (start[b >> 5] >> (b & 31)) & 1;
+}
+
+/*
+ * tells whether any of the 16 bytes leaves the root of a group
+ */
+int
+start_any(__constant uint *start, uchar *b)
+{
+	int k;
+	uint any = 0;
+
+	for (k = 0; k < 16; k++)
+		any |= start[b[k] >> 5] >> (b[k] & 31);
+
+	return any & 1;
+}
+
 __kernel void
-ahomatch(__global int *trans, __global uint4 *data, __global int *indices, 
-    __global int *sizes, __global int*results, __global int*results2,
+ahomatch(TRANS_ARG, __global int *out,
+    __global int *out_ids, __global int2 *verify, __global int2 *window,
+    __global uchar *case_bytes, __global int *sigs,
+    __constant uchar *classmap, __constant uint *start_bytes,
+    __global uint4 *data, __global int *indices, 
+    __global int *sizes, __global long *offsets,
+    __global int*results, __global int*results2,
     const unsigned int chunks, const unsigned long data_size,
-    const long last_state, const int max_pat_size, const int max_results)
+    __global int *last_states, const int max_pat_size, const int max_results,
+    const int num_classes, const int num_groups, const int words)
 {
-#define ALPHABET_SIZE	256
 #define CEILDIV(x, y) (((x) + (y) - 1) / (y))
 
+	int g;
 	int i;
 	int j;
 	int id, lid;
 	int index;
 	int size;
+	long base;
 	int matches = 0; // count the matches per thread
-	long state, state_prev;
+	int state;
 	unsigned char c;
 	unsigned char *p_c16;
 	uint4 c16;
+	__constant uint *start;
+	/* a row holds the next state for each byte class */
+	unsigned long width = (unsigned long)NUM_CLASSES;
+#ifdef LOCAL_ROWS
+	__local STATE_T top[LOCAL_ROWS * NUM_CLASSES];
+#endif
 
 	id  = get_global_id(0);
 	lid = get_local_id(0);
 
+#ifdef LOCAL_ROWS
+	/* every thread of the group, in range or not, copies its share */
+	for (i = lid; i < LOCAL_ROWS * NUM_CLASSES; i += get_local_size(0))
+		top[i] = trans[i];
+	barrier(CLK_LOCAL_MEM_FENCE);
+#endif
+
 	matches = 0;
 	// XXX no need to reset the whole array;
 	//for (i = 0; i < max_results; i++) {
@@ -28,139 +268,440 @@ ahomatch(__global int *trans, __global uint4 *data, __global int *indices,
 	//	//results2[max_results * id + i] = -1;
 	//}
 
+	/* a thread past the last chunk has no cells; results[id] is a cell */
 	if (id >= chunks)
-		goto end;
+		return;
 
 	index = indices[id];
-	size = sizes[id];
+
+	/* the file offset of the data at index 0 of the buffer */
+	base = offsets[id] - index;
 
 	/*
-	 * The first thread is assigned with the state of the last tread of 
-	 * the previous kernel call so we can grep the matches splitted over 
-	 * two data buffers
+	 * Each group of patterns has an automaton of its own, rooted at
+	 * state g of the table; the chunk is scanned once per group so that
+	 * only the rows of one group are in use at a time
 	 */
-	if (id == 0) //XXX check also if stream mode is on
-		state = last_state;
-	else
-		state = 0;
-
-	size = CEILDIV(size, sizeof(uint4));
-
-	/* fetch 16 chars */
-	for (i = 0; i < size; i++) {
-		c16 = *(data + index / sizeof(uint4) + i);
-		p_c16 = (unsigned char *)&c16;
-
-		/* loop on the fetched data */
-		for (j = 0; j < sizeof(uint4); j++) {
-			c = p_c16[j];
-
-			state_prev = state;
-			state = *(trans + (unsigned long)(ALPHABET_SIZE * 2) *
-			    (unsigned long)state + (unsigned long)c);
-
-			/* match */
-			if (state < 0) {
-				matches++;
-				state = -state;
-				if (matches < max_results) {
-					results[matches * chunks + id] =
-					    *(trans +
-					    (unsigned long)(ALPHABET_SIZE * 2) *
-					    (unsigned long)(state_prev) +
-					    (unsigned long)c +
-					    (unsigned long)ALPHABET_SIZE);
-					results2[matches * chunks + id] = index + i * sizeof(uint4) + j; // add index for absolute offset
+	for (g = 0; g < NUM_GROUPS; g++) {
+		size = sizes[id];
+
+		/* the bytes that leave the root of the group */
+		start = start_bytes + g * (256 / 32);
+
+		/*
+		 * The first thread is assigned with the state of the last
+		 * tread of the previous kernel call so we can grep the matches
+		 * splitted over two data buffers
+		 */
+		if (id == 0)
+			state = last_states[g];
+		else
+			state = g;
+
+		size = CEILDIV(size, sizeof(uint4));
+
+		/* fetch 16 chars */
+		for (i = 0; i < size; i++) {
+			c16 = data[word_pos(index / sizeof(uint4) + i, words,
+			    chunks)];
+			p_c16 = (unsigned char *)&c16;
+
+			/*
+			 * At the root, the bytes that start no pattern lead
+			 * back to the root; skip them without reading the
+			 * table, a whole word at a time if none starts one
+			 */
+			if (state == g && !start_any(start, p_c16))
+				continue;
+
+			/* loop on the fetched data */
+			for (j = 0; j < sizeof(uint4); j++) {
+				if (state == g && !start_byte(start, p_c16[j]))
+					continue;
+
+				c = classmap[p_c16[j]];
+
+				state = NEXT_STATE(state, c);
+
+				/* match, report every pattern */
+				if (state < 0) {
+					state = -state;
+					matches = report_matches(out, out_ids,
+					    verify, window, case_bytes, sigs,
+					    (__global uchar *)data, state,
+					    index + i * sizeof(uint4) + j, base,
+					    results, results2, chunks, words,
+					    id, matches, MAX_RESULTS);
 				}
 			}
 		}
-	}
 
+		/*
+		 * The last thread saves its state for the first thread of the
+		 * next bufferand returns. This will grep the matches splitted
+		 * over two data buffers. This is for stream mode.
+		 */
+		if (id == chunks -1) {
+			results[chunks * MAX_RESULTS + g] = state;
+			continue;
+		}
 
-	/* stream mode
-	 * if stream mode is off goto end;
-	 * otherwise continue
-	 */
 
-	/*
-	 * The last thread saves its state for the first thread of the next
-	 * bufferand returns. This will grep the matches splitted over two data
-	 * buffers. This is for stream mode.
-	 */
-	if (id == chunks -1) {
-		results[chunks * max_results] = state;
-		goto end;
-	}
+		/*
+		 * All threads except for the last one reach this point. If
+		 * their last state is the root, they do not have a match in
+		 * progress so they return
+		 */
+		if (state == g)
+			continue;
 
 
-	/*
-	 * All threads except for the last one reach this point. If their last 
-	 * state is zero, they do not have a match in progress so they return
-	 */
-	if (state == 0)
-		goto end;
+		/* 
+		 * All threads except for the final that have a match in
+		 * progress after they have consumed their data chunk continue
+		 * up to this step. We let them continue over the next thread's
+		 * data for max pattern size bytes. This will grep the matches
+		 * splitted over the data chunks of two different threads. This
+		 * is for stream mode.
+		 */
+		size += (CEILDIV(MAX_PAT_SIZE, sizeof(uint4)));
 
+		/* fetch 16 chars */
+		for ( ; i < size; i++) {
+			/* guard the end of data buffer */
+			if (i * sizeof(uint4) + index + sizeof(uint4) >
+			    data_size)
+				goto next;
 
-	/* 
-	 * All threads except for the final that have a match in progress after
-	 * they have consumed their data chunk continue up to this step. We let 
-	 * them continue over the next thread's data for max pattern size bytes.
-	 * This will grep the matches splitted over the data chunks of two
-	 * different threads. This is for stream mode.
-	 */
-	size += (CEILDIV(max_pat_size, sizeof(uint4)));
+			c16 = data[word_pos(index / sizeof(uint4) + i, words,
+			    chunks)];
+			p_c16 = (unsigned char *)&c16;
 
-	/* fetch 16 chars */
-	for ( ; i < size; i++) {
-		/* guard the end of data buffer */
-		if (i * sizeof(uint4) + index + sizeof(uint4) > data_size)
-			goto end;
+			/* loop on the fetched data */
+			for (j = 0; j < sizeof(uint4); j++) {
+				c = classmap[p_c16[j]];
 
-		c16 = *(data + index / sizeof(uint4) + i);
-		p_c16 = (unsigned char *)&c16;
+				state = NEXT_STATE(state, c);
 
-		/* loop on the fetched data */
-		for (j = 0; j < sizeof(uint4); j++) {
-			c = p_c16[j];
+				/*
+				 * If the continued match fails, return here so 
+				 * this thread does not grep duplicate matches
+				 */
+				if (state == g)
+					goto next;
 
-			state_prev = state;
-			state = *(trans + (unsigned long)(ALPHABET_SIZE * 2) *
-			    (unsigned long)state + (unsigned long)c);
+				/* match, report every pattern */
+				if (state < 0) {
+					state = -state;
+					matches = report_matches(out, out_ids,
+					    verify, window, case_bytes, sigs,
+					    (__global uchar *)data, state,
+					    index + i * sizeof(uint4) + j, base,
+					    results, results2, chunks, words,
+					    id, matches, MAX_RESULTS);
 
-			/*
-			 * If the continued match fails, return here so 
-			 * this thread does not grep duplicate matches
-			 */
-			if (state == 0)
-				goto end;
-
-			/* match */
-			if (state < 0) {
-				matches++;
-				state = -state;
-				if (matches < max_results) {
-					results[matches * chunks + id] =
-					    *(trans +
-					    (unsigned long)(ALPHABET_SIZE * 2) *
-					    (unsigned long)(state_prev) +
-					    (unsigned long)c +
-					    (unsigned long)ALPHABET_SIZE);
-					results2[matches * chunks + id] = index + i * sizeof(uint4) + j; // add index for absolute offset
+					/* ATTENTION HERE
+					 * This one might make you lose some
+					 * matches depending on your application
+					 */
+					goto next;
 				}
-
-				/* ATTENTION HERE
-				 * This one might make you lose some matches 
-				 * depending on your application
-				 */
-				goto end;
 			}
 		}
+next:
+		;
 	}
 
-end:
 	results[id] = matches;
 	results2[id] = matches;
 
 	return;
 }
-	
+
+/*
+ * signature programs, see acsm_add_signature(): a header, a few words per
+ * part and the code of the parts
+ */
+#define SIG_HDR		3
+#define SIG_PART	4
+#define SIG_ALT		1
+#define SIG_SKIP	2
+#define SIG_MAX_PARTS	16
+
+#define SIG_LEN(sig, k)		((sig)[SIG_HDR + SIG_PART * (k)])
+#define SIG_GAP_MIN(sig, k)	((sig)[SIG_HDR + SIG_PART * (k) + 1])
+#define SIG_GAP_MAX(sig, k)	((sig)[SIG_HDR + SIG_PART * (k) + 2])
+#define SIG_CODE(sig, k)	((sig)[SIG_HDR + SIG_PART * (k) + 3])
+
+/*
+ * checks part k of a signature against the bytes at s; the part lies in
+ * the buffer
+ */
+int
+sig_part(__global int *sig, int k, __global uchar *bytes, long s, int words,
+    unsigned int chunks)
+{
+	int a;
+	int j;
+	int n;
+	int len;
+	int w;
+	long p;
+	long end;
+	__global int *op;
+
+	op = sig + SIG_CODE(sig, k);
+	for (p = s, end = s + SIG_LEN(sig, k); p < end; ) {
+		w = *op++;
+		if ((w >> 24) == SIG_SKIP) {
+			p += w & 0xffffff;
+		} else if ((w >> 24) == SIG_ALT) {
+			n = (w >> 12) & 0xfff;
+			len = w & 0xfff;
+			for (a = 0; a < n; a++) {
+				for (j = 0; j < len && bytes[byte_pos(p + j,
+				    words, chunks)] == op[a * len + j]; j++)
+					;
+				if (j == len)
+					break;
+			}
+			if (a == n)
+				return 0;
+			op += n * len;
+			p += len;
+		} else {
+			if ((bytes[byte_pos(p, words, chunks)] & (w >> 8)) !=
+			    (w & 0xff))
+				return 0;
+			p++;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * checks a signature around the match of its anchor that ends at pos;
+ * the parts after the anchor are placed as early as they match, the parts
+ * before it as late, and a part is moved only if the ones further out
+ * could not be placed and the gap to them is bounded. All the parts must
+ * lie in [lo, hi).
+ */
+int
+sig_match(__global int *sig, __global uchar *bytes, long pos, long lo,
+    long hi, int words, unsigned int chunks)
+{
+	int a;
+	int k;
+	int n;
+	long edge;
+	long at[SIG_MAX_PARTS];
+
+	n = sig[0];
+	a = sig[1];
+	at[a] = pos - sig[2];
+	if (at[a] < lo || at[a] + SIG_LEN(sig, a) > hi ||
+	    !sig_part(sig, a, bytes, at[a], words, chunks))
+		return 0;
+
+	/* the parts after the anchor */
+	k = a + 1;
+	if (k < n)
+		at[k] = at[a] + SIG_LEN(sig, a) + SIG_GAP_MIN(sig, k);
+	while (k > a && k < n) {
+		edge = hi - SIG_LEN(sig, k);
+		if (SIG_GAP_MAX(sig, k) >= 0)
+			edge = min(edge, at[k - 1] + SIG_LEN(sig, k - 1) +
+			    SIG_GAP_MAX(sig, k));
+		for ( ; at[k] <= edge; at[k]++)
+			if (sig_part(sig, k, bytes, at[k], words, chunks))
+				break;
+		if (at[k] <= edge) {
+			if (++k < n)
+				at[k] = at[k - 1] + SIG_LEN(sig, k - 1) +
+				    SIG_GAP_MIN(sig, k);
+			continue;
+		}
+		do
+			k--;
+		while (k > a && SIG_GAP_MAX(sig, k + 1) < 0);
+		if (k > a)
+			at[k]++;
+	}
+	if (k < n)
+		return 0;
+
+	/* the parts before the anchor */
+	k = a - 1;
+	if (k >= 0)
+		at[k] = at[a] - SIG_GAP_MIN(sig, a) - SIG_LEN(sig, k);
+	while (k < a && k >= 0) {
+		edge = lo;
+		if (SIG_GAP_MAX(sig, k + 1) >= 0)
+			edge = max(edge, at[k + 1] - SIG_GAP_MAX(sig, k + 1) -
+			    SIG_LEN(sig, k));
+		for ( ; at[k] >= edge; at[k]--)
+			if (sig_part(sig, k, bytes, at[k], words, chunks))
+				break;
+		if (at[k] >= edge) {
+			if (--k >= 0)
+				at[k] = at[k + 1] - SIG_GAP_MIN(sig, k + 1) -
+				    SIG_LEN(sig, k);
+			continue;
+		}
+		do
+			k++;
+		while (k < a && SIG_GAP_MAX(sig, k) < 0);
+		if (k < a)
+			at[k]--;
+	}
+
+	return k < 0;
+}
+
+/*
+ * bytes a signature may span before the part of its anchor, -1 for any
+ * number
+ */
+long
+sig_reach(__global int *sig)
+{
+	int k;
+	long reach;
+
+	reach = 0;
+	for (k = sig[1]; k > 0; k--) {
+		if (SIG_GAP_MAX(sig, k) < 0)
+			return -1;
+		reach += SIG_GAP_MAX(sig, k) + SIG_LEN(sig, k - 1);
+	}
+
+	return reach;
+}
+
+/*
+ * bytes a signature may span after the end of its anchor, -1 for any
+ * number
+ */
+long
+sig_ahead(__global int *sig)
+{
+	int k;
+	long ahead;
+
+	ahead = SIG_LEN(sig, sig[1]) - 1 - sig[2];
+	for (k = sig[1] + 1; k < sig[0]; k++) {
+		if (SIG_GAP_MAX(sig, k) < 0)
+			return -1;
+		ahead += SIG_GAP_MAX(sig, k) + SIG_LEN(sig, k);
+	}
+
+	return ahead;
+}
+
+/*
+ * finds the bytes of the buffer around chunk id that follow each other in
+ * its file: the chunks before and after it that are full and continue it
+ */
+void
+file_span(__global int *indices, __global int *sizes, __global long *offsets,
+    unsigned int chunks, int id, long *lo, long *hi)
+{
+	int c;
+
+	for (c = id; c > 0 && indices[c - 1] + sizes[c - 1] == indices[c] &&
+	    offsets[c - 1] + sizes[c - 1] == offsets[c]; c--)
+		;
+	*lo = indices[c];
+
+	for (c = id; c + 1 < chunks &&
+	    indices[c] + sizes[c] == indices[c + 1] &&
+	    offsets[c] + sizes[c] == offsets[c + 1]; c++)
+		;
+	*hi = indices[c] + sizes[c];
+}
+
+/* a result cell whose match was dropped after the count was taken */
+#define RESULT_DROPPED	-1
+
+/*
+ * runs after ahomatch: checks the signature of every anchor match of a
+ * chunk and keeps the matches that pass, in place, along with the plain
+ * and the flagged ones. A signature that fails but may have parts in the
+ * buffer before, which the chunk continues, is flagged for the host; one
+ * that may have parts past the end of the buffer, which the chunk reaches,
+ * has its position flagged for the host to check against the next. The
+ * plain matches beyond the result cells are counted as they are, so the
+ * count may still exceed the cells kept; the anchors beyond them are not
+ * counted, see report_matches(). The cells freed are marked dropped.
+ */
+__kernel void
+sigverify(__global int *sigs, __global int *sig_code, __global uchar *data,
+    __global int *indices, __global int *sizes, __global long *offsets,
+    __global int *results, __global int *results2,
+    const unsigned int chunks, const int max_results, const int words)
+{
+	int k;
+	int id;
+	int pat;
+	int kept;
+	int after;
+	int before;
+	int stored;
+	int matches;
+	int spanned;
+	long pos;
+	long lo;
+	long hi;
+	long end;
+	long reach;
+	long ahead;
+	__global int *sig;
+
+	id = get_global_id(0);
+	if (id >= chunks)
+		return;
+
+	matches = results[id];
+	stored = min(matches, MAX_RESULTS - 1);
+	end = indices[chunks - 1] + sizes[chunks - 1];
+
+	kept = 0;
+	spanned = 0;
+	for (k = 1; k <= stored; k++) {
+		pat = results[k * chunks + id];
+		pos = results2[k * chunks + id];
+		if (pat >= 0 && sigs[pat] >= 0) {
+			if (!spanned) {
+				file_span(indices, sizes, offsets, chunks, id,
+				    &lo, &hi);
+				spanned = 1;
+			}
+			sig = sig_code + sigs[pat];
+			if (!sig_match(sig, data, pos, lo, hi, words, chunks)) {
+				reach = sig_reach(sig);
+				ahead = sig_ahead(sig);
+				before = lo == 0 && (reach < 0 ||
+				    pos - sig[2] - reach < lo);
+				after = hi == end && (ahead < 0 ||
+				    pos + ahead >= hi);
+				if (!before && !after)
+					continue;
+				if (before)
+					pat = RESULT_EDGE(pat);
+				if (after)
+					pos = RESULT_DEFER(pos);
+			}
+		}
+		kept++;
+		results[kept * chunks + id] = pat;
+		results2[kept * chunks + id] = pos;
+	}
+	for (k = kept + 1; k <= stored; k++)
+		results[k * chunks + id] = RESULT_DROPPED;
+
+	results[id] = matches - stored + kept;
+	results2[id] = matches - stored + kept;
+
+	return;
+}
@@ -75,7 +75,7 @@ ReleasePartialSums(struct databuf *db) {
  */
 struct databuf *
 databuf_new(size_t max_chunks, size_t max_chunk_size, int max_results,
-    int mapped, struct clconf *clconf) //TODO XXX clconf should placed first arg
+    int mapped, int interleaved, struct clconf *clconf) //TODO XXX clconf should placed first arg
 {
 	int i;
 	int e;
@@ -91,8 +91,14 @@ databuf_new(size_t max_chunks, size_t max_chunk_size, int max_results,
 
 	db->cl                 = clconf;
 	db->mapped             = mapped;
+	db->interleaved        = interleaved && !mapped &&
+	    max_chunk_size % sizeof(cl_uint4) == 0;
+	db->words              = 0;
+	db->h_words            = NULL;
 	db->max_results        = max_results;
-	db->last_state         = 0;
+	/* each group's stream starts at its root, see acsm_set_groups() */
+	for (i = 0; i < ACSM_MAX_GROUPS; i++)
+		db->last_state[i] = i;
 	db->max_chunks         = max_chunks;
 	db->max_chunk_size     = max_chunk_size;
 	db->size               = db->max_chunks * db->max_chunk_size;
@@ -121,19 +127,33 @@ databuf_new(size_t max_chunks, size_t max_chunk_size, int max_results,
 	if (e != CL_SUCCESS)
 		ERRXV(1, "ERROR: alloc d_sizes: %s", clstrerror(e));
 
+	db->d_offsets = clCreateBuffer(ctx,
+	    CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
+	    db->max_chunks * sizeof(cl_long), NULL, &e);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: alloc d_offsets: %s", clstrerror(e));
+
 	db->d_results = clCreateBuffer(ctx,
 	    CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
-	    (db->max_results * db->max_chunks + 1) * sizeof(cl_int), NULL, &e);
+	    (db->max_results * db->max_chunks + ACSM_MAX_GROUPS) *
+	    sizeof(cl_int), NULL, &e);
 
 	if (e != CL_SUCCESS)
 		ERRXV(1, "ERROR: alloc d_results: %s", clstrerror(e));
 
 	db->d_results2 = clCreateBuffer(ctx,
 	    CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
-	    (db->max_results * db->max_chunks + 1) * sizeof(cl_int), NULL, &e);
+	    (db->max_results * db->max_chunks + ACSM_MAX_GROUPS) *
+	    sizeof(cl_int), NULL, &e);
 	if (e != CL_SUCCESS)
 		ERRXV(1, "ERROR: alloc d_results2: %s", clstrerror(e));
 
+	db->d_states = clCreateBuffer(ctx,
+	    CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
+	    ACSM_MAX_GROUPS * sizeof(cl_int), NULL, &e);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: alloc d_states: %s", clstrerror(e));
+
 	db->d_prefixsum = clCreateBuffer(ctx,
 	    CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR,
 	    db->max_chunks * sizeof(cl_int), NULL, &e);
@@ -175,17 +195,23 @@ databuf_new(size_t max_chunks, size_t max_chunk_size, int max_results,
 		if (e != CL_SUCCESS)
 			ERRXV(1, "ERROR: map d_sizes: %s", clstrerror(e));
 
+		db->h_offsets = clEnqueueMapBuffer(queue, db->d_offsets,
+		    CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0,
+		    db->max_chunks * sizeof(cl_long), 0, NULL, NULL, &e);
+		if (e != CL_SUCCESS)
+			ERRXV(1, "ERROR: map d_offsets: %s", clstrerror(e));
+
 		db->h_results = clEnqueueMapBuffer(queue, db->d_results,
 		    CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0,
-		    (db->max_results * db->max_chunks + 1) * sizeof(int), 0,
-		    NULL, NULL, &e);
+		    (db->max_results * db->max_chunks + ACSM_MAX_GROUPS) *
+		    sizeof(int), 0, NULL, NULL, &e);
 		if (e != CL_SUCCESS)
 			ERRXV(1, "ERROR: map d_results: %s", clstrerror(e));
 
 		db->h_results2 = clEnqueueMapBuffer(queue, db->d_results2,
 		    CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0,
-		    (db->max_results * db->max_chunks + 1) * sizeof(int), 0,
-		    NULL, NULL, &e);
+		    (db->max_results * db->max_chunks + ACSM_MAX_GROUPS) *
+		    sizeof(int), 0, NULL, NULL, &e);
 		if (e != CL_SUCCESS)
 			ERRXV(1, "ERROR: map d_results2: %s", clstrerror(e));
 
@@ -215,6 +241,13 @@ databuf_new(size_t max_chunks, size_t max_chunk_size, int max_results,
 		if (!db->h_data)
 			ERR(1, "ERROR: malloc h_data");
 
+		/* the data is interleaved to a copy of its own */
+		if (db->interleaved) {
+			db->h_words = MALLOC(db->size * sizeof(unsigned char));
+			if (!db->h_words)
+				ERR(1, "ERROR: malloc h_words");
+		}
+
 		db->h_indices = MALLOC(db->max_chunks * sizeof(int));
 		if(!db->h_indices)
 			ERR(1, "ERROR: malloc h_indices");
@@ -223,13 +256,17 @@ databuf_new(size_t max_chunks, size_t max_chunk_size, int max_results,
 		if(!db->h_sizes)
 			ERR(1, "ERROR: malloc h_sizes");
 
-		db->h_results = MALLOC((db->max_results * db->max_chunks + 1) *
-		    sizeof(int));
+		db->h_offsets = MALLOC(db->max_chunks * sizeof(cl_long));
+		if(!db->h_offsets)
+			ERR(1, "ERROR: malloc h_offsets");
+
+		db->h_results = MALLOC((db->max_results * db->max_chunks +
+		    ACSM_MAX_GROUPS) * sizeof(int));
 		if(!db->h_results)
 			ERR(1, "ERROR: malloc h_results");
 
-		db->h_results2 = MALLOC((db->max_results * db->max_chunks + 1) *
-		    sizeof(int));
+		db->h_results2 = MALLOC((db->max_results * db->max_chunks +
+		    ACSM_MAX_GROUPS) * sizeof(int));
 		if(!db->h_results2)
 			ERR(1, "ERROR: malloc h_results2");
 
@@ -268,15 +305,15 @@ databuf_new(size_t max_chunks, size_t max_chunk_size, int max_results,
 
 		db->p_results = clCreateBuffer(ctx,
 		    CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
-		    (db->max_results * db->max_chunks + 1) * sizeof(cl_int),
-		    db->h_results, &e);
+		    (db->max_results * db->max_chunks + ACSM_MAX_GROUPS) *
+		    sizeof(cl_int), db->h_results, &e);
 		if (e != CL_SUCCESS)
 			ERRXV(1, "ERROR: pin h_results: %s", clstrerror(e));
 
 		db->p_results2 = clCreateBuffer(ctx,
 		    CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR,
-		    (db->max_results * db->max_chunks + 1) * sizeof(cl_int),
-		    db->h_results2, &e);
+		    (db->max_results * db->max_chunks + ACSM_MAX_GROUPS) *
+		    sizeof(cl_int), db->h_results2, &e);
 		if (e != CL_SUCCESS)
 			ERRXV(1, "ERROR: pin h_results2: %s", clstrerror(e));
 
@@ -309,10 +346,18 @@ databuf_new(size_t max_chunks, size_t max_chunk_size, int max_results,
 	if (!db->file_ids)
 		ERR(1, "ERROR: malloc file_ids");
 
+	/* matches left to the next buffer, see ocl_aho_match_edges() */
+	db->h_deferred = MALLOC(db->max_chunks * db->max_results * 2 *
+	    sizeof(int));
+	if (!db->h_deferred)
+		ERR(1, "ERROR: malloc h_deferred");
+	db->num_deferred = 0;
+
 	/* initialize the meta-data */
 	for (i = 0; i < max_chunks; i++) {
 		db->h_sizes[i]   = db->max_chunk_size;
 		db->h_indices[i] = db->max_chunk_size * i;
+		db->h_offsets[i] = 0;
 		db->file_ids[i]  = -1;
 	}
 
@@ -324,7 +369,8 @@ databuf_new(size_t max_chunks, size_t max_chunk_size, int max_results,
  * adds bytes to the data buffer using file descriptor
  */
 int
-databuf_add_fd(struct databuf *db, int fd, int id, size_t *rd_bytes)
+databuf_add_fd(struct databuf *db, int fd, int id, size_t off,
+    size_t *rd_bytes)
 {
 	int i;
 	size_t size;
@@ -350,6 +396,7 @@ databuf_add_fd(struct databuf *db, int fd, int id, size_t *rd_bytes)
 	cur_chunks = size / db->max_chunk_size;
 	for (i = db->chunks; i < db->chunks + cur_chunks; i++) {
 		db->h_sizes[i]   = db->max_chunk_size;
+		db->h_offsets[i] = off + (i - db->chunks) * db->max_chunk_size;
 		db->file_ids[i]  = id;
 	}
 
@@ -369,8 +416,10 @@ databuf_add_fd(struct databuf *db, int fd, int id, size_t *rd_bytes)
 			     db->h_sizes[db->chunks] + i] = 0;
 		}
 
-		/* assign it its file id */
+		/* assign it its file id and offset */
 		db->file_ids[db->chunks] = id;
+		db->h_offsets[db->chunks] = off + cur_chunks *
+		    db->max_chunk_size;
 
 		/* one more chunk for the missaligned one */
 		db->chunks++;
@@ -410,7 +459,8 @@ databuf_add_fd(struct databuf *db, int fd, int id, size_t *rd_bytes)
  * adds lines to the data buffer using file descriptor
  */
 int
-databuf_add_fp(struct databuf *db, FILE *fp, int id, int aligned, size_t *rd_bytes, size_t *rd_lines)
+databuf_add_fp(struct databuf *db, FILE *fp, int id, size_t off, int aligned,
+    size_t *rd_bytes, size_t *rd_lines)
 {
 	char *buf;
 	unsigned int toread;
@@ -426,6 +476,9 @@ databuf_add_fp(struct databuf *db, FILE *fp, int id, int aligned, size_t *rd_byt
 
 		len = strnlen(buf, toread);
 
+		/* the line starts where the previous one ended */
+		db->h_offsets[db->chunks] = off + *rd_bytes;
+
 		*rd_bytes += len;
 
 		if (buf[len - 1] == '\n') {
@@ -509,6 +562,7 @@ databuf_add_chunk(struct databuf *db, char *chunk, size_t len, int id, char alig
 	/* set the indices, sizes and file ids of the new data */
 	db->h_indices[db->chunks] = db->bytes;
 	db->h_sizes[db->chunks] = len;
+	db->h_offsets[db->chunks] = 0; /* the chunk is an input of its own */
 	db->file_ids[db->chunks] = id;
 
 	/* increase the chunks in the data buffer */
@@ -553,9 +607,11 @@ databuf_clear(struct databuf *db)
 	memset(db->h_sizes, 0,
 			db->max_chunks * sizeof(int));
 	memset(db->h_results, 0,
-			(db->max_chunks * db->max_results + 1) * sizeof(int));
+			(db->max_chunks * db->max_results + ACSM_MAX_GROUPS) *
+			sizeof(int));
 	memset(db->h_results2, 0,
-			(db->max_chunks * db->max_results + 1) * sizeof(int));
+			(db->max_chunks * db->max_results + ACSM_MAX_GROUPS) *
+			sizeof(int));
 	memset(db->h_results_comp, 0,
 			(db->results_comp_size) * sizeof(int));
 	memset(db->h_results2_comp, 0,
@@ -568,6 +624,39 @@ databuf_clear(struct databuf *db)
 	return;
 }
 
+/*
+ * interleaves the words of the chunks to h_words, word k of every chunk
+ * next to word k of the others; the chunks must lie in their slots of the
+ * maximum chunk size, one after the other, as databuf_add_fd() lays them
+ *
+ * ret: the words per chunk, 0 if the chunks were not interleaved
+ */
+static int
+databuf_interleave(struct databuf *db)
+{
+	size_t c;
+	size_t k;
+	size_t words;
+
+	if (!db->interleaved ||
+	    db->bytes != db->chunks * db->max_chunk_size)
+		return 0;
+
+	for (c = 0; c < db->chunks; c++)
+		if (db->h_indices[c] != c * db->max_chunk_size)
+			return 0;
+
+	words = db->max_chunk_size / sizeof(cl_uint4);
+	for (c = 0; c < db->chunks; c++)
+		for (k = 0; k < words; k++)
+			memcpy(db->h_words + (k * db->chunks + c) *
+			    sizeof(cl_uint4), db->h_data + (c * words + k) *
+			    sizeof(cl_uint4), sizeof(cl_uint4));
+
+	return words;
+}
+
+
 /*
  * copies the data buffer to the device
  */
@@ -576,12 +665,20 @@ databuf_copy_host_to_device(struct databuf *db, cl_command_queue queue)
 {
 	int e;
 
+	/* the states the first chunk starts from, never mapped */
+	e = clEnqueueWriteBuffer(queue, db->d_states, CL_TRUE, 0,
+	    sizeof(db->last_state), db->last_state, 0, NULL, NULL);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: write d_states: %s", clstrerror(e));
+
 	/* if the buffer is mapped, there is nothing to do */
 	if (db->mapped)
 		return;
 
+	db->words = databuf_interleave(db);
 	e = clEnqueueWriteBuffer(queue, db->d_data, CL_TRUE, 0,
-	    db->bytes * sizeof(cl_uchar), db->h_data, 0, NULL, NULL);
+	    db->bytes * sizeof(cl_uchar), db->words ? db->h_words : db->h_data,
+	    0, NULL, NULL);
 	if (e != CL_SUCCESS)
 		ERRXV(1, "ERROR: write d_data: %s", clstrerror(e));
 	e = clEnqueueWriteBuffer(queue, db->d_indices, CL_TRUE, 0,
@@ -592,6 +689,10 @@ databuf_copy_host_to_device(struct databuf *db, cl_command_queue queue)
 	    db->chunks * sizeof(cl_int), db->h_sizes, 0, NULL, NULL);
 	if (e != CL_SUCCESS)
 		ERRXV(1, "ERROR: write d_sizes: %s", clstrerror(e));
+	e = clEnqueueWriteBuffer(queue, db->d_offsets, CL_TRUE, 0,
+	    db->chunks * sizeof(cl_long), db->h_offsets, 0, NULL, NULL);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR: write d_offsets: %s", clstrerror(e));
 
 	return;
 }
@@ -607,26 +708,28 @@ databuf_copy_device_to_host(struct databuf *db, cl_command_queue queue)
 
 	/* if the buffer is mapped, there is nothing to do */
 	if (db->mapped) {
-		db->last_state = db->h_results[db->chunks * db->max_results];
+		memcpy(db->last_state, db->h_results + db->chunks *
+		    db->max_results, sizeof(db->last_state));
 		return;
 	}
 
 	/* XXX TODO do not copy d_results array if COMPACT_RESULTS is enabled */
 	e = clEnqueueReadBuffer(queue, db->d_results, CL_TRUE, 0,
-	    (db->max_results * db->chunks + 1) * sizeof(cl_int), db->h_results,
-	    0, NULL, NULL);
+	    (db->max_results * db->chunks + ACSM_MAX_GROUPS) * sizeof(cl_int),
+	    db->h_results, 0, NULL, NULL);
 	if (e != CL_SUCCESS)
 		ERRXV(1, "ERROR: read d_results: %s", clstrerror(e));
 
 	// XXX TODO Take care of last_state when COMPACT_RESULTS is enabled
-	db->last_state = db->h_results[db->chunks * db->max_results];
+	memcpy(db->last_state, db->h_results + db->chunks * db->max_results,
+	    sizeof(db->last_state));
 
 //#define COMPACT_RESULTS
 
 #ifndef COMPACT_RESULTS
 	e = clEnqueueReadBuffer(queue, db->d_results2, CL_TRUE, 0,
-	    (db->max_results * db->chunks + 1) * sizeof(cl_int), db->h_results2,
-	    0, NULL, NULL);
+	    (db->max_results * db->chunks + ACSM_MAX_GROUPS) * sizeof(cl_int),
+	    db->h_results2, 0, NULL, NULL);
 	if (e != CL_SUCCESS)
 		ERRXV(1, "ERROR: read d_results2: %s", clstrerror(e));
 
@@ -679,7 +782,7 @@ databuf_copy_device_to_host(struct databuf *db, cl_command_queue queue)
 		if (e != CL_SUCCESS)
 			ERRXV(1, "ERROR: read d_results2_comp: %s", clstrerror(e));
 
-		db->last_state = db->h_results_comp[m+1];
+		db->last_state[0] = db->h_results_comp[m+1];
 	
 		//for(int i=0;i<db->chunks;i++) {
 		//	printf("%d ", db->h_results[i]);
@@ -767,6 +870,8 @@ databuf_process_results_buckets(struct databuf *db, int (*cb)(int file_idx, int
 			    j < res[i] && (j < max_results - 1);
 			    j++) {
 				pat_index = res[(j+1)*db->chunks + i];
+				if (pat_index == RESULT_DROPPED)
+					continue;
 				/* XXX pat_len has never instantiated; */
 				offset    = res2[(j+1)*db->chunks + i] - pat_len + 1; /* XXX why need to +1 in the offset? */
 				file_id = db->file_ids[i];
@@ -787,9 +892,9 @@ databuf_process_results_buckets(struct databuf *db, int (*cb)(int file_idx, int
 int
 databuf_process_results(struct databuf *db, int (*cb)(int file_idx, int patrn_idx, int chunk_idx, int offset, void* uarg), void *uarg) {
 #ifdef COMPACT_RESULTS
-	databuf_process_results_compact(db, cb, uarg);
+	return databuf_process_results_compact(db, cb, uarg);
 #else
-	databuf_process_results_buckets(db, cb, uarg);
+	return databuf_process_results_buckets(db, cb, uarg);
 #endif
 }
 
@@ -807,6 +912,8 @@ databuf_free(struct databuf *db, int mapped, cl_command_queue queue)
 		    0, NULL, NULL);
 		clEnqueueUnmapMemObject(queue, db->d_sizes, db->h_sizes,
 		    0, NULL, NULL);
+		clEnqueueUnmapMemObject(queue, db->d_offsets, db->h_offsets,
+		    0, NULL, NULL);
 		clEnqueueUnmapMemObject(queue, db->d_results, db->h_results,
 		    0, NULL, NULL);
 		clEnqueueUnmapMemObject(queue, db->d_results2, db->h_results2,
@@ -820,8 +927,10 @@ databuf_free(struct databuf *db, int mapped, cl_command_queue queue)
 
 	} else {
 		FREE(db->h_data);
+		FREE(db->h_words);
 		FREE(db->h_indices);
 		FREE(db->h_sizes);
+		FREE(db->h_offsets);
 		FREE(db->h_results);
 		FREE(db->h_results2);
 		FREE(db->h_prefixsum);
@@ -829,12 +938,15 @@ databuf_free(struct databuf *db, int mapped, cl_command_queue queue)
 		FREE(db->h_results2_comp);
 		FREE(db->file_ids);
 	}
+	FREE(db->h_deferred);
 
 	clReleaseMemObject(db->d_data);
 	clReleaseMemObject(db->d_indices);
 	clReleaseMemObject(db->d_sizes);
+	clReleaseMemObject(db->d_offsets);
 	clReleaseMemObject(db->d_results);
 	clReleaseMemObject(db->d_results2);
+	clReleaseMemObject(db->d_states);
 	clReleaseMemObject(db->d_prefixsum);
 	clReleaseMemObject(db->d_results_comp);
 	clReleaseMemObject(db->d_results2_comp);
@@ -890,7 +1002,8 @@ int main(int argc, char *argv[]) {
 	printf("Testing databuf creation... ");
 
 	b = databuf_new(/*max_chunks*/ databuf_sz, /* max_chunk_size */ 80,
-			/*max_results */128 + 1, /*mapped*/1, &cl);
+			/*max_results */128 + 1, /*mapped*/1, /*interleaved*/0,
+			&cl);
 
 	if (b == NULL) {
 		printf("FAILED\n");
@@ -949,12 +1062,12 @@ int main(int argc, char *argv[]) {
 	}
 
 	int e = clEnqueueWriteBuffer(cl.queue, b->d_results, CL_TRUE, 0,
-	    (b->max_results * b->max_chunks + 1) * sizeof(int), b->h_results, 0, NULL, NULL);
+	    (b->max_results * b->max_chunks + ACSM_MAX_GROUPS) * sizeof(int), b->h_results, 0, NULL, NULL);
 	if (e != CL_SUCCESS)
 		ERRXV(1, "ERROR: write d_results: %s", clstrerror(e));
 
 	e = clEnqueueWriteBuffer(cl.queue, b->d_results2, CL_TRUE, 0,
-	    (b->max_results * b->max_chunks + 1) * sizeof(int), b->h_results2, 0, NULL, NULL);
+	    (b->max_results * b->max_chunks + ACSM_MAX_GROUPS) * sizeof(int), b->h_results2, 0, NULL, NULL);
 	if (e != CL_SUCCESS)
 		ERRXV(1, "ERROR: write d_results2: %s", clstrerror(e));
 
@@ -1061,7 +1174,7 @@ int main(int argc, char *argv[]) {
 	size_t bytes_total = 0;
 	size_t lines_total = 0;
 	do {
-		e = databuf_add_fp(b, fp, 0, 1, &bytes_total, &lines_total);
+		e = databuf_add_fp(b, fp, 0, 0, 1, &bytes_total, &lines_total);
 	} while (e != -1 && e != -2 && !feof(fp));
 
     	fclose(fp);
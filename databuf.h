@@ -4,18 +4,37 @@
 #include <CL/opencl.h>
 
 #include "ocl_context.h"
+#include "acsmx.h"
 
 /* maximum number of result cells per chunk */
 #define MAX_RESULTS 16
 
+/* a result cell whose match a later kernel dropped, see ahomatch.cl */
+#define RESULT_DROPPED -1
+
+/*
+ * a result cell of a match the host has to check, see
+ * ocl_aho_match_edges(); the macro is its own inverse
+ */
+#define RESULT_EDGE(pat) (-2 - (pat))
+
+/*
+ * the position of a result cell whose signature may continue past the
+ * end of the buffer, which the host checks against the next buffer,
+ * see ocl_aho_match_edges(); the macro is its own inverse
+ */
+#define RESULT_DEFER(pos) (-1 - (pos))
+
 
 /*
  * data buffer
  */
 struct databuf {
 	unsigned char	*h_data;	 /* host data array                 */
+	unsigned char	*h_words;	 /* host interleaved data array     */
 	int 		*h_indices;	 /* host chunk indices array        */
 	int		*h_sizes;	 /* host chunk sizes array          */
+	cl_long		*h_offsets;	 /* host chunk file offsets array   */
 	int		*h_results;	 /* host results array (pattern id) */
 	int		*h_results2;	 /* host results array (offset)     */
 	int		*h_prefixsum;	 /* host prefix sums array          */
@@ -30,9 +49,20 @@ struct databuf {
 	size_t		results2_comp_size;/* the size of h_results2_comp   */
 
 	int		*file_ids;	 /* file ID per chunk               */ 
+	int		*h_deferred;	 /* pattern id and position pairs of
+					  * the matches left to the next
+					  * buffer, the positions relative
+					  * to the end of this one          */
+	int		num_deferred;	 /* pairs in h_deferred             */
 	int		mapped;		 /* memory mapped buffer flag       */
+	int		interleaved;	 /* interleaved device data flag    */
+	int		words;		 /* 16 byte words per chunk on the
+					  * device if they are interleaved,
+					  * 0 if the chunks are linear      */
 	int		max_results;	 /* maximum result cells per chunk  */
-	long		last_state;	 /* last AC state at the last chunk */
+	cl_int		last_state[ACSM_MAX_GROUPS];
+					 /* last AC state of each group at
+					  * the last chunk                  */
 	size_t		max_chunks;	 /* maximum number of chunks        */
 	size_t		max_chunk_size;	 /* maximum chunk size (Bytes)      */
 	size_t		size;		 /* data buffer size (Bytes)        */
@@ -42,8 +72,10 @@ struct databuf {
 	cl_mem		d_data;		 /* device data array               */
 	cl_mem		d_indices;	 /* device chunk indices array      */
 	cl_mem		d_sizes;	 /* device chunk sizes array        */
+	cl_mem		d_offsets;	 /* device chunk file offsets array */
 	cl_mem		d_results;	 /* device results array            */
 	cl_mem		d_results2;	 /* device results array            */
+	cl_mem		d_states;	 /* device last states array        */
 	cl_mem		d_prefixsum;     /* device prefix sums array        */
 	cl_mem		d_results_comp;  /* device results compacted array  */
 	cl_mem		d_results2_comp; /* device results2 compacted array */
@@ -72,12 +104,17 @@ struct databuf {
  * arg1: maximum chunk size
  * arg2: maximum result cells per chunk
  * arg3: mapped buffer flag
- * arg4: OpenCL conf
+ * arg4: interleaved device data flag; the chunks that databuf_add_fd()
+ *       lays in slots of the maximum chunk size are copied to the device
+ *       with word k of every chunk next to word k of the others, so that
+ *       the threads of a work-group read adjacent words; ignored if the
+ *       buffer is mapped or the chunk size is not a multiple of 16
+ * arg5: OpenCL conf
  *
  * ret:  a new data buffer object
  */
 struct databuf *
-databuf_new(size_t, size_t, int, int, struct clconf*); 
+databuf_new(size_t, size_t, int, int, int, struct clconf*); 
 
 
 /*
@@ -86,15 +123,17 @@ databuf_new(size_t, size_t, int, int, struct clconf*);
  * arg0: data buffer
  * arg1: file descriptor
  * arg2: file id
- * arg3: read bytes counter
+ * arg3: file offset of the bytes read, i.e., the bytes read from the file
+ *       so far
+ * arg4: read bytes counter
  *
  * ret:   1 if the buffer can hold more data after this call
  *       -1 if the buffer is full of chunks
  *       -2 if the buffer is full of bytes
- * ret:  always returns the read bytes via arg3
+ * ret:  always returns the read bytes via arg4
  */
 int
-databuf_add_fd(struct databuf *, int, int, size_t *);
+databuf_add_fd(struct databuf *, int, int, size_t, size_t *);
 
 /*
  * adds lines to the data buffer using file pointer
@@ -102,17 +141,19 @@ databuf_add_fd(struct databuf *, int, int, size_t *);
  * arg0: data buffer
  * arg1: file pointer
  * arg2: file id
- * arg3: whether data will be stored aligned
- * arg4: read bytes counter
- * arg5: read lines counter
+ * arg3: file offset of the lines read, see databuf_add_fd()
+ * arg4: whether data will be stored aligned
+ * arg5: read bytes counter
+ * arg6: read lines counter
  *
  * ret:   1 if the buffer can hold more data after this call
  *       -1 if the buffer is full of chunks
  *       -2 if the buffer is full of bytes
- * ret:  always returns the read bytes and read lines via arg4 and arg5
+ * ret:  always returns the read bytes and read lines via arg5 and arg6
  */
 int
-databuf_add_fp(struct databuf *, FILE *, int, int, size_t *, size_t*);
+databuf_add_fp(struct databuf *, FILE *, int, size_t, int, size_t *,
+    size_t*);
 
 
 /*
@@ -134,7 +175,8 @@ databuf_clear(struct databuf *);
 
 
 /*
- * copies the data buffer to the device
+ * copies the data buffer to the device, interleaved if the buffer was
+ * created so and its chunks lie in their slots
  *
  * arg0: data buffer
  * arg1: OpenCL command queue
@@ -16,12 +16,16 @@
 #include "ocl_aho_match.h"
 #include "ocl_context.h"
 #include "ocl_worker.h"
+#include "regex_filter.h"
 #include "utils.h"
 
 
 int
 callback_match(int, int, int, int, void*);
 
+int
+callback_rule(int, int, int, int, void*);
+
 int terminate = 0;
 
 void
@@ -30,6 +34,67 @@ signal_handler(int signum)
 	terminate = 1;
 }
 
+
+/* pattern reload thread context */
+struct reload_ctx {
+	struct clconf	cl;		/* private queue on the workers' context */
+	char		*pat_path;	/* pattern file or compiled database     */
+	int		hex_pat;	/* printable hex patterns flag           */
+	int		regex;		/* regex patterns flag                   */
+	int		pat_size_limit;	/* maximum pattern size limit            */
+	int		nocase;		/* case insensitive patterns flag        */
+	int		groups;		/* number of pattern groups              */
+	char		*sample_path;	/* traffic the states are ordered by     */
+	int		mapped;		/* memory mapped buffers flag            */
+	int		image;		/* state table as an image flag          */
+	int		max_results;	/* result cells per chunk of the workers */
+	int		verbose;	/* verbosity flag                        */
+	acsm_t		*kept;		/* patterns and their trie, for deltas   */
+};
+
+
+/*
+ * pattern reload thread: on SIGHUP compiles the patterns anew, or applies
+ * the ones that changed, next to the running workers, and publishes the
+ * new automaton; the workers switch to it at their next buffer boundary
+ */
+void *
+reload_worker(void *reload_ctx)
+{
+	int sig;
+	sigset_t set;
+	struct reload_ctx *ctx;
+	struct ocl_automaton *automaton;
+
+	ctx = (struct reload_ctx *)reload_ctx;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+
+	for (;;) {
+		if (sigwait(&set, &sig) != 0 || terminate)
+			break;
+
+		automaton = ocl_automaton_reload(&ctx->cl, &ctx->kept,
+		    ctx->mapped, ctx->image, ctx->max_results, ctx->pat_path,
+		    ctx->hex_pat, ctx->regex, ctx->pat_size_limit, ctx->nocase,
+		    ctx->groups, ctx->sample_path);
+		if (!automaton) {
+			fprintf(stderr, "WARNING: could not reload '%s', the "
+			    "patterns stay as they are\n", ctx->pat_path);
+			continue;
+		}
+
+		ocl_automaton_publish(automaton);
+		if (ctx->verbose)
+			fprintf(stderr, "Reloaded '%s'\n", ctx->pat_path);
+	}
+
+	ocl_automaton_reload_free(ctx->kept);
+
+	return 0;
+}
+
 /*
  * CPU worker thread
  */
@@ -67,13 +132,16 @@ cpu_worker(void *worker_ctx)
 		/* read current file */
 		if (ctx->text_mode)
 			e = databuf_add_fp(ctx->db, fp, cur_file,
+					ctx->offsets[cur_file],
 					1 /* aligned */, &rd_bytes, &rd_lines);
 		else
 			e = databuf_add_fd(ctx->db, ctx->fds[cur_file],
-		    			cur_file, &rd_bytes);
+		    			cur_file, ctx->offsets[cur_file],
+					&rd_bytes);
 
 		ctx->lines += rd_lines;
 		ctx->bytes += rd_bytes;
+		ctx->offsets[cur_file] += rd_bytes;
 
 		/* current file has been read */
 		if (rd_bytes == 0) {
@@ -112,11 +180,15 @@ cpu_worker(void *worker_ctx)
 process:
 
 		if (ctx->db->chunks > 0) {
+			/* pick up reloaded patterns between two buffers */
+			if (ctx->follow)
+				ocl_worker_ctx_swap(ctx);
+
 			/* copy the data to the device */
 			databuf_copy_host_to_device(ctx->db, ctx->cl.queue);
 
 			/* scan data */
-			ocl_aho_match(&(ctx->cl), ctx->db, ctx->acsm, ctx->local_ws, 1 /* stream */);
+			ocl_aho_match(&(ctx->cl), ctx->db, ctx->acsm, ctx->local_ws);
 
 #ifdef COMPACT_RESULTS
 			/* compute prefix sums; will be used to do array compaction */
@@ -128,10 +200,20 @@ process:
 			/* get the results */
 			databuf_copy_device_to_host(ctx->db, ctx->cl.queue);
 
+			/* the matches that start in the last round */
+			ocl_worker_ctx_check_edges(ctx);
+
 			/* get the total matches */
 			int callback_match(int f_id, int p_idx, int c_id, int off, void *uarg);
 
-			ctx->matches_total += databuf_process_results(ctx->db, callback_match, ctx);
+			if (ctx->rules)
+				ctx->matches_total += regex_filter_match(
+				    ctx->rules, ctx->db, callback_rule, ctx);
+			else
+				ctx->matches_total += databuf_process_results(ctx->db, callback_match, ctx);
+
+			/* the end of the round, for the next one */
+			ocl_worker_ctx_keep_tail(ctx);
 
 			/* reset the buffer for the next batch */
 			databuf_reset(ctx->db);
@@ -155,7 +237,12 @@ usage(void)
 	    "Usage:\n"
 	    "    ocl_aho_grep -f file -p file -B chunk_size -D devpos\n"
 	    "                 -G global_ws -L local_ws [-m max]\n"
-	    "                 [-w cpu_threads] [-R max] [-tvxM]\n"
+	    "                 [-w cpu_threads] [-R max] [-k groups] [-S sample]\n"
+	    "                 [-itvxEIMT]\n"
+	    "    ocl_aho_grep -c db -p file [-m max] [-k groups] [-S sample]\n"
+	    "                 [-ix]\n"
+	    "    ocl_aho_grep -A levels -p file [-m max] [-k groups]\n"
+	    "                 [-S sample] [-ixE]\n"
 	    "    ocl_aho_grep -h\n"
 	);
 	printf(
@@ -165,10 +252,32 @@ usage(void)
 	    "                     ! The path can be a single directory, a\n"
 	    "                     single file or many comma-separated files.\n"
 	    "  -p    file         Path to the file containing the patterns, one\n"
-	    "                     pattern per line.\n"
+	    "                     pattern per line, or to a database compiled\n"
+	    "                     with -c.\n"
+	    "                     ! A quoted pattern may be followed by\n"
+	    "                     modifiers, e.g., \"pattern\" nocase.\n"
+	    "                     offset:N and depth:N limit the matches to\n"
+	    "                     start N bytes into the file or later and\n"
+	    "                     to end within N bytes from there.\n"
+	    "  -c    db           Compiles the patterns to the database db and\n"
+	    "                     exits.\n"
+	    "                     ! -i, -k, -m, -S and -x apply at compile\n"
+	    "                     time only.\n"
+	    "  -A    levels       Reports the automaton of the patterns and\n"
+	    "                     exits: the states and final states of the\n"
+	    "                     first levels depths, the working set down\n"
+	    "                     to each, the fan-out of the states and the\n"
+	    "                     byte classes.\n"
+	    "                     ! With -S, also the visits of the sample\n"
+	    "                     per depth and the hottest states.\n"
+	);
+	printf(
 	    "  -F                 Process appended data as files grow. It can\n"
 	    "                     be practical when needed to process data\n"
 	    "                     continuously, e.g., from a FIFO.\n"
+	    "                     ! SIGHUP reloads the patterns (-p) without\n"
+	    "                     stopping; the workers switch to them\n"
+	    "                     between two buffers.\n"
 	    "  -B    chunk_size   Maximum data chunk size (in bytes), that each\n"
 	    "                     OpenCL kernel thread will process.\n"
 	    "  -D    devpos       A number indicating which OpenCL device will.\n"
@@ -188,14 +297,45 @@ usage(void)
 	    "                     store the number of matches found per chunk.\n"
 	    "                     The rest are used to store the offsets where\n"
 	    "                     the patterns have been found. Default: 16.\n"
+	);
+	printf(
 	    "  -v                 Prints the file name and the patterns found.\n"
 	    "                     ! The number of pattern IDs reported is\n"
 	    "                     affected by [-R max].\n"
 	    "  -t                 Treats input files as text files; tries to\n"
 	    "                     ! read line-wise whenever possible.\n"
+	    "  -i                 Case insensitive matching for all patterns.\n"
+	    "  -k    groups       Splits the patterns into groups, by their first\n"
+	    "                     byte, each with an automaton of its own.\n"
+	    "                     ! Smaller automata stay in cache; every group\n"
+	    "                     scans the input once. Default: 1, max: 16.\n"
+	    "  -S    sample       Path to a sample of the traffic; the states\n"
+	    "                     it visits the most are packed together.\n"
+	    "                     ! Default: breadth first order.\n"
+	);
+	printf(
 	    "  -x                 Handles the patterns as printable hex.\n"
 	    "                     ! The patterns should not contain the '0x'\n"
-	    "                     notation.\n"
+	    "                     notation. ClamAV wildcards (??, a?, ?a,\n"
+	    "                     (aa|bb), {n}, {n-m}, {-m}, {n-} and *) are\n"
+	    "                     checked around the longest run of plain\n"
+	    "                     bytes; the parts may run into the buffers\n"
+	    "                     before and after, as long as the pattern\n"
+	    "                     starts within 4096 bytes of their edge.\n"
+	    "  -E                 Handles the patterns as POSIX extended\n"
+	    "                     regexes.\n"
+	    "                     ! The automaton looks for the literals a\n"
+	    "                     regex requires; the regex is run on the\n"
+	    "                     chunks where they all hit. A match must\n"
+	    "                     end in its chunk or the next one.\n"
+	    "  -I                 Interleaves the chunks on the device, word by\n"
+	    "                     word, so that adjacent threads read\n"
+	    "                     adjacent words (discrete GPUs).\n"
+	    "                     ! Has no effect with -M or -t.\n"
+	    "  -T                 Reads the state table as an image, through\n"
+	    "                     the texture cache of the device.\n"
+	    "                     ! The table stays a buffer if the device\n"
+	    "                     can not take it as an image.\n"
             "  -M                 Set mapped buffers (CPU or integrated GPU).\n"
 	    "                     ! Default: 0.\n"
 	    "  -h                 This help message.\n"
@@ -210,7 +350,7 @@ usage(void)
 void
 check_args(char *pat_path, char *file_path, int dev_pos, size_t global_ws,
     size_t local_ws, size_t max_chunk_size, int thread_no, int pat_size_limit,
-    int max_results)
+    int max_results, int hex_pat, int regex)
 {
 	int err;
 
@@ -261,6 +401,10 @@ check_args(char *pat_path, char *file_path, int dev_pos, size_t global_ws,
 		printf("ERROR: The maximum result cells should be >= 1\n");
 		err++;
 	}
+	if (regex && hex_pat) {
+		printf("ERROR: The patterns are either regexes or hex\n");
+		err++;
+	}
 
 	if (err)
 		usage();
@@ -307,6 +451,39 @@ int callback_match(int f_id, int p_idx, int c_id, int off, void *uarg) {
 	return 0;
 }
 
+/*
+ * Print details for each regex match found
+ */
+int
+callback_rule(int f_id, int r_idx, int c_id, int off, void *uarg)
+{
+	int i;
+	struct ocl_worker_ctx *ctx = (struct ocl_worker_ctx *)uarg;
+	struct regex_rule *rule = &ctx->rules->rules[r_idx];
+	char *fname = ctx->filenames[ctx->db->file_ids[c_id]];
+	int off_rel;
+
+	ctx->matches_reported += 1;
+
+	if (ctx->verbose) {
+		off_rel = off - ctx->db->h_indices[c_id];
+		printf("Regex %d ('%s') found in file '%s' at offset %d "
+		    "[relative: %d]\n", rule->id, rule->text, fname, off,
+		    off_rel);
+
+		/* the line of the match, up to the end of its chunk */
+		for (i = off; i > ctx->db->h_indices[c_id] &&
+		    ctx->db->h_data[i - 1] != '\n'; i--)
+			;
+		printf(" ... ");
+		for (; i < ctx->db->size && ctx->db->h_data[i] != '\n'; i++)
+			printf("%c", ctx->db->h_data[i]);
+		printf(" ... \n");
+	}
+
+	return 0;
+}
+
 /*
  * checks if the input parameters are aligned
  * changes those who are not
@@ -358,7 +535,14 @@ main(int argc, char *argv[])
 	int opt;			/* argument parsing option            */
 	int dev_pos;			/* device position (clinfo)           */
 	int mapped;			/* memory mapped buffers flag         */
+	int interleaved;		/* interleaved device data flag       */
+	int image;			/* state table as an image flag       */
 	int hex_pat;			/* printable hex patterns flag        */
+	int regex;			/* regex patterns flag                */
+	int report_levels;		/* depths reported, 0 for no report   */
+	int nocase;			/* case insensitive patterns flag     */
+	int groups;			/* number of pattern groups           */
+	char *sample_path;		/* traffic the states are ordered by  */
 	int verbose;			/* verbosity flag                     */
 	int text_mode;			/* try to read input files line-wise  */
 	int follow;			/* process appended data as files grow*/
@@ -378,6 +562,7 @@ main(int argc, char *argv[])
 	size_t max_chunk_size;		/* maximum data per thread (bytes     */
 	char *file;			/* a dummy for strtok                 */
 	char *pat_path;			/* path to pattern file               */
+	char *db_path;			/* path to compiled database output   */
 	char *data_path;		/* path to input file(s)              */
 	char *reg_files;		/* path to input every file in a dir  */
 	char **filenames;		/* string array with the filenames    */
@@ -385,6 +570,10 @@ main(int argc, char *argv[])
 	size_t end_time;		/* ending time end-to-end             */
 	size_t e2e_time;		/* end-to-end time in usecs           */
 	struct ocl_worker_ctx **w_ctx;	/* OpenCL worker contexts array       */
+	struct ocl_automaton *automaton;/* automaton shared by the workers    */
+	struct reload_ctx reload;	/* pattern reload thread context      */
+	pthread_t reload_thread;	/* pattern reload thread handle       */
+	sigset_t sigset;		/* signals handled by sigwait         */
 	pthread_t *threads;		/* thread handles                     */
 	struct rlimit rlim;		/* resource limits                    */
 
@@ -392,27 +581,55 @@ main(int argc, char *argv[])
 	/* initialize */
 	dev_pos        = -1;
 	mapped         = 0;
+	interleaved    = 0;
+	image          = 0;
 	global_ws      = -1;
 	local_ws       = -1;
 	max_chunk_size = -1;
 	pat_size_limit = -1;
 	pat_path       = NULL;
+	db_path        = NULL;
 	data_path      = NULL;
 	verbose        = 0;
 	text_mode      = 0;
 	follow         = 0;
 	hex_pat        = 0;
+	regex          = 0;
+	report_levels  = 0;
+	nocase         = 0;
+	groups         = 1;
+	sample_path    = NULL;
 	thread_no      = 2;
 	threads        = NULL;
 	max_results    = MAX_RESULTS;
 
+	/*
+	 * in follow mode SIGHUP reloads the patterns; it is blocked before
+	 * the OpenCL runtime starts any thread, so that every thread inherits
+	 * the mask and the reload thread alone takes it
+	 */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGHUP);
+	e = pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+	if (e != 0)
+		ERRXV(1, "ERROR: pthread_sigmask: %d\n", e);
+
 
 	/* get options */
-	while ((opt = getopt(argc, argv, "f:m:p:tw:vxB:D:FG:L:R:Mh")) != -1) {
+	while ((opt = getopt(argc, argv, "c:f:ik:m:p:tw:vxA:B:D:EFG:IL:R:S:TMh")) != -1) {
 		switch (opt) {
+		case 'c':
+			db_path = strdup(optarg);
+			break;
 		case 'f':
 			data_path = strdup(optarg);
 			break;
+		case 'i':
+			nocase = 1;
+			break;
+		case 'k':
+			groups = atoi(optarg);
+			break;
 		case 'm':
 			pat_size_limit = atoi(optarg);
 			break;
@@ -431,24 +648,41 @@ main(int argc, char *argv[])
 		case 'x':
 			hex_pat = 1;
 			break;
+		case 'A':
+			report_levels = atoi(optarg);
+			if (report_levels <= 0)
+				usage();
+			break;
 		case 'B':
 			max_chunk_size = atol(optarg);
 			break;
 		case 'D':
 			dev_pos = atoi(optarg);
 			break;
+		case 'E':
+			regex = 1;
+			break;
 		case 'F':
 			follow = 1;
 			break;
 		case 'G':
 			global_ws = atol(optarg);
 			break;
+		case 'I':
+			interleaved = 1;
+			break;
 		case 'L':
 			local_ws = atol(optarg);
 			break;
 		case 'R':
 			max_results = atoi(optarg);
 			break;
+		case 'S':
+			sample_path = strdup(optarg);
+			break;
+		case 'T':
+			image = 1;
+			break;
 		case 'M':
 			mapped = 1;
 			break;
@@ -458,6 +692,48 @@ main(int argc, char *argv[])
 		}
 	}
 
+	/* otherwise SIGHUP keeps its default action */
+	if (!follow) {
+		e = pthread_sigmask(SIG_UNBLOCK, &sigset, NULL);
+		if (e != 0)
+			ERRXV(1, "ERROR: pthread_sigmask: %d\n", e);
+	}
+
+
+	/* report the automaton, no device or input is needed */
+	if (report_levels) {
+		if (!pat_path || !file_exists(pat_path) || (regex && hex_pat))
+			usage();
+		if (ocl_automaton_report(pat_path, hex_pat, regex,
+		    pat_size_limit, nocase, groups, sample_path,
+		    report_levels) != 0)
+			ERRV(1, "ERROR: could not report '%s'", pat_path);
+		FREE(pat_path);
+		FREE(sample_path);
+		return 0;
+	}
+
+
+	/* compile the patterns offline, no device or input is needed */
+	if (db_path) {
+		if (!pat_path || !file_exists(pat_path))
+			usage();
+		if (regex) {
+			printf("ERROR: Regexes are not compiled to a "
+			    "database\n");
+			usage();
+		}
+		if (ocl_automaton_compile(db_path, pat_path, hex_pat,
+		    pat_size_limit, nocase, groups, sample_path) != 0)
+			ERRV(1, "ERROR: could not compile '%s' to '%s'",
+			    pat_path, db_path);
+		printf("Compiled '%s' to '%s'\n", pat_path, db_path);
+		FREE(pat_path);
+		FREE(db_path);
+		FREE(sample_path);
+		return 0;
+	}
+
 
 	/* Get the number of maximum open file descriptors */
 	if (getrlimit(RLIMIT_NOFILE, &rlim) == -1) {
@@ -474,7 +750,8 @@ main(int argc, char *argv[])
 
 	/* check arguments */
 	check_args(pat_path, data_path, dev_pos, global_ws, local_ws,
-	    max_chunk_size, thread_no, pat_size_limit, max_results);
+	    max_chunk_size, thread_no, pat_size_limit, max_results, hex_pat,
+	    regex);
 
 
 	/*
@@ -496,7 +773,7 @@ main(int argc, char *argv[])
 	if (!w_ctx)
 		ERRX(1, "ERROR: malloc ocl_worker_ctx\n");
 	for (i = 0; i < thread_no; i++) {
-		w_ctx[i] = ocl_worker_ctx_create(dev_pos);
+		w_ctx[i] = ocl_worker_ctx_create(dev_pos, i ? w_ctx[0] : NULL);
 		if (!w_ctx[i])
 			ERRX(1, "ERROR: create_ocl_worker\n");
 	}
@@ -557,10 +834,17 @@ main(int argc, char *argv[])
 	if (!total_files)
 		ERRX(1, "ERROR: Could not open input file(s) for reading.\n");
 
+	/* compile the automaton once; all workers share the device copy */
+	automaton = ocl_automaton_new(&w_ctx[0]->cl, mapped, image,
+	    max_results, pat_path, hex_pat, regex, pat_size_limit, nocase,
+	    groups, sample_path);
+	if (!automaton)
+		ERRX(1, "ERROR: ocl_automaton_new\n");
+
 	/* initialize the OpenCL worker contexts */
 	for (i = 0; i < thread_no; i++) {
 		if (ocl_worker_ctx_init(w_ctx[i], dev_pos, local_ws, global_ws,
-		    mapped, pat_path, hex_pat, pat_size_limit, max_chunk_size,
+		    mapped, interleaved, automaton, max_chunk_size,
 		    max_results, verbose, text_mode, follow, i, thread_no,
 		    total_files, fds, filenames) != 0) {
 			ERRX(1, "ERROR: init_ocl_worker_ctx\n");
@@ -576,6 +860,29 @@ main(int argc, char *argv[])
 
 	signal(SIGINT, signal_handler);
 
+	/* the workers use the published automaton from now on */
+	ocl_automaton_publish(automaton);
+
+	/* SIGHUP is blocked since the start, see above */
+	if (follow) {
+		clinitctx_shared(&reload.cl, &w_ctx[0]->cl);
+		reload.pat_path       = pat_path;
+		reload.hex_pat        = hex_pat;
+		reload.regex          = regex;
+		reload.pat_size_limit = pat_size_limit;
+		reload.nocase         = nocase;
+		reload.groups         = groups;
+		reload.sample_path    = sample_path;
+		reload.mapped         = mapped;
+		reload.image          = image;
+		reload.max_results    = max_results;
+		reload.verbose        = verbose;
+		reload.kept           = NULL;
+		if (pthread_create(&reload_thread, NULL, reload_worker,
+		    (void *)&reload) != 0)
+			ERRX(1, "ERROR: creating the reload thread\n");
+	}
+
 	/* spawn the OpenCL worker threads */
 	start_time = gettime();
 	for (i = 0; i < thread_no; ++i) {
@@ -597,6 +904,15 @@ main(int argc, char *argv[])
 	}
 	end_time = gettime();
 
+	/* wake the reload thread up to exit */
+	if (follow) {
+		terminate = 1;
+		pthread_kill(reload_thread, SIGHUP);
+		e = pthread_join(reload_thread, NULL);
+		if (e != 0)
+			ERRXV(1, "ERROR: pthread_join: %d reload thread\n", e);
+	}
+
 
 	/* stats */
 	total_matches     = 0;
@@ -618,6 +934,8 @@ main(int argc, char *argv[])
 	printf("Time (secs):         %.5f\n", (double)e2e_time / 1000000);
 	printf("Automaton states:    %d\n",
 	    acsm_get_states(w_ctx[0]->acsm));
+	printf("Automaton classes:   %d\n",
+	    acsm_get_classes(w_ctx[0]->acsm));
 	printf("Automaton size (MB): %.3f\n",
 	    (double)acsm_get_size(w_ctx[0]->acsm) / 1048576);
 	printf("Processed bytes:     %lu\n",  total_bytes);
@@ -634,8 +952,10 @@ main(int argc, char *argv[])
 	/* clean up */
 	FREE(data_path);
 	FREE(pat_path);
+	FREE(sample_path);
 	for (i = 0; i < thread_no; ++i)
 		ocl_worker_ctx_free(w_ctx[i]);
+	ocl_automaton_publish(NULL);
 	for (i = 0; i < total_files; ++i)
 		FREE(filenames[i]);
 	FREE(filenames);
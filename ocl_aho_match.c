@@ -1,22 +1,223 @@
+#include <pthread.h>
+#include <string.h>
+
 #include "ocl_aho_match.h"
 #include "utils.h"
 
 static void
-ocl_aho_match_kernel(struct clconf *cl, cl_mem trans,
-    cl_mem data, cl_mem indices, cl_mem sizes, cl_mem results, cl_mem results2,
-    cl_uint chunks, cl_ulong data_size, cl_long last_state, cl_int max_pat_size,
-    cl_int max_results, size_t local_ws, int stream);
+ocl_aho_match_kernel(struct clconf *cl, cl_mem trans, cl_mem out,
+    cl_mem out_ids, cl_mem verify, cl_mem window, cl_mem case_bytes,
+    cl_mem sigs, cl_mem classmap, cl_mem start_bytes, cl_mem data,
+    cl_mem indices, cl_mem sizes, cl_mem offsets, cl_mem results,
+    cl_mem results2,
+    cl_uint chunks, cl_ulong data_size, cl_mem states, cl_int max_pat_size,
+    cl_int max_results, cl_int num_classes, cl_int num_groups, cl_int words,
+    size_t local_ws);
+
+static void
+ocl_sig_verify_kernel(struct clconf *cl, cl_mem sigs, cl_mem sig_code,
+    cl_mem data, cl_mem indices, cl_mem sizes, cl_mem offsets,
+    cl_mem results, cl_mem results2, cl_uint chunks, cl_int max_results,
+    cl_int words, size_t local_ws);
 
 extern char* strload(const char *);
 
-void
-ocl_aho_match_init(struct clconf *cl) {
-	int e, ret = 0;
-	const char *opts = NULL;
+/* share of the local memory of the device that holds the top DFA rows */
+#define LOCAL_TRANS_SHARE	2
+
+/* most cases of an automaton generated as code, see acsm_gen_code() */
+#define TRANS_CODE_MAX_CASES	2048
+
+/* matching program variants kept built, the least recently used goes */
+#define PROGRAM_CACHE_SIZE	8
+
+/* length of the build options of a variant */
+#define PROGRAM_OPTS_SIZE	256
+
+
+/* a built matching program and what it was built for */
+struct program_variant {
+	cl_context	ctx;			/* context it was built on    */
+	cl_device_id	dev;			/* device it was built for    */
+	char		opts[PROGRAM_OPTS_SIZE];/* build options              */
+	cl_program	program;		/* the program, NULL if none  */
+	unsigned long	used;			/* time of its last use       */
+};
+
+static struct program_variant program_cache[PROGRAM_CACHE_SIZE];
+static unsigned long program_clock;
+static pthread_mutex_t program_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/*
+ * chooses where the matching kernel reads the serialized DFA from: the
+ * constant memory if the whole table fits there along with the byte class
+ * map and the start bytes, otherwise the local memory for as many of the
+ * top rows as fit in a share of it; writes the build options for the
+ * choice to opts
+ */
+static void
+trans_space(struct clconf *cl, acsm_t *acsm, char *opts, size_t len)
+{
+	int e;
+	int rows;
+	size_t row;
+	cl_ulong local_size;
+	cl_ulong const_size;
+
+	opts[0] = '\0';
+
+	e  = clGetDeviceInfo(cl->dev, CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE,
+	    sizeof(const_size), &const_size, NULL);
+	e |= clGetDeviceInfo(cl->dev, CL_DEVICE_LOCAL_MEM_SIZE,
+	    sizeof(local_size), &local_size, NULL);
+	if (e != CL_SUCCESS)
+		return;
+
+	/* the spare rows too, they take new states in place */
+	row = (size_t)acsm_get_classes(acsm) * acsm_get_state_size(acsm);
+	if (row * acsm->trans_rows + ALPHABET_SIZE + sizeof(acsm->start_bytes)
+	    <= const_size) {
+		snprintf(opts, len, " -D TRANS_CONSTANT");
+		return;
+	}
+
+	rows = acsm->trans_rows;
+	if (rows > local_size / LOCAL_TRANS_SHARE / row)
+		rows = local_size / LOCAL_TRANS_SHARE / row;
+	if (rows > 0)
+		snprintf(opts, len, " -D LOCAL_ROWS=%d", rows);
+}
+
+
+/*
+ * FNV-1a hash of the generated code of an automaton, part of the options
+ * of its program, so that a cached program is only used for the same DFA
+ */
+static unsigned long long
+code_hash(const char *code)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+
+	for (; *code; code++) {
+		h ^= (unsigned char)*code;
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+
+/*
+ * returns the cached program built with the options on the context of the
+ * configuration, with a reference for the caller, or NULL if there is none;
+ * called with the cache locked
+ */
+static cl_program
+cached_program(struct clconf *cl, const char *opts)
+{
+	int i;
+	struct program_variant *v;
+
+	for (i = 0; i < PROGRAM_CACHE_SIZE; i++) {
+		v = &program_cache[i];
+		if (v->program && v->ctx == cl->ctx && v->dev == cl->dev &&
+		    strcmp(v->opts, opts) == 0) {
+			v->used = ++program_clock;
+			clRetainProgram(v->program);
+			return v->program;
+		}
+	}
+
+	return NULL;
+}
+
+
+/*
+ * keeps a reference to a program just built in the cache, in place of the
+ * least recently used one if the cache is full; called with the cache
+ * locked
+ */
+static void
+cache_program(struct clconf *cl, const char *opts, cl_program program)
+{
+	int i;
+	struct program_variant *v;
+
+	v = &program_cache[0];
+	for (i = 0; i < PROGRAM_CACHE_SIZE; i++) {
+		if (!program_cache[i].program) {
+			v = &program_cache[i];
+			break;
+		}
+		if (program_cache[i].used < v->used)
+			v = &program_cache[i];
+	}
+
+	/* the automata using the evicted program hold their own references */
+	if (v->program)
+		clReleaseProgram(v->program);
+
+	v->ctx = cl->ctx;
+	v->dev = cl->dev;
+	snprintf(v->opts, sizeof(v->opts), "%s", opts);
+	v->program = program;
+	v->used = ++program_clock;
+	clRetainProgram(program);
+}
+
+
+cl_program
+ocl_aho_match_build(struct clconf *cl, acsm_t *acsm, int max_results) {
+	int e;
+	char opts[PROGRAM_OPTS_SIZE];
+	char space[64];
 	char *optbuf;
+	char *code = NULL;
 	unsigned int optlen;
 	const char *kstr = NULL;
-	const char *kname = "ahomatch";
+	const char *srcs[2];
+	const char *state_type;
+
+	/* build the kernel variant for the serialized DFA entry size */
+	switch (acsm_get_state_size(acsm)) {
+	case sizeof(cl_char):
+		state_type = "char";
+		break;
+	case sizeof(cl_short):
+		state_type = "short";
+		break;
+	default:
+		state_type = "int";
+		break;
+	}
+	/*
+	 * an image of the table is read through the texture cache; the DFA of
+	 * a small automaton is generated as code, put before the kernel
+	 */
+	if (acsm->d_trans_image)
+		snprintf(space, sizeof(space), " -D TRANS_IMAGE");
+	else if ((code = acsm_gen_code(acsm, TRANS_CODE_MAX_CASES)) != NULL)
+		snprintf(space, sizeof(space), " -D TRANS_CODE=0x%016llx",
+		    code_hash(code));
+	else
+		trans_space(cl, acsm, space, sizeof(space));
+retry:
+	snprintf(opts, sizeof(opts), "-D STATE_T=%s%s%s%s -D MAX_RESULTS=%d "
+	    "-D MAX_PAT_SIZE=%d -D NUM_CLASSES=%d -D NUM_GROUPS=%d",
+	    state_type, acsm->fold ? " -D CASE_FOLD" : "",
+	    acsm->windowed ? " -D WINDOW" : "", space, max_results,
+	    acsm_get_max_pattern_size(acsm), acsm_get_classes(acsm),
+	    acsm_get_groups(acsm));
+
+	/* the same variant may have been built for another automaton */
+	pthread_mutex_lock(&program_lock);
+	cl->program_aho_match = cached_program(cl, opts);
+	if (cl->program_aho_match) {
+		pthread_mutex_unlock(&program_lock);
+		free(code);
+		return cl->program_aho_match;
+	}
 
 	kstr = (const char*)strload("ahomatch.cl");
 
@@ -26,37 +227,74 @@ ocl_aho_match_init(struct clconf *cl) {
 	/* add cwd to include path to keep the amd sdk happy */
 #define CWDINCSTR "-I./ "
 
-	optlen = strlen(CWDINCSTR) + 1;
-	if (opts != NULL)
-		optlen += strlen(opts);
+	optlen = strlen(CWDINCSTR) + strlen(opts) + 1;
 
 	optbuf = calloc(1, optlen);
 	if (optbuf == NULL)
 		ERRX(1, "malloc optbuf");
 
 	strcpy(optbuf, CWDINCSTR);
-	if (opts != NULL)
-		strcpy(optbuf, opts);
+	strcat(optbuf, opts);
 
 	/* generate code */
-	cl->program_aho_match = clCreateProgramWithSource(cl->ctx, 1, &kstr, NULL, &e);
+	srcs[0] = code ? code : "";
+	srcs[1] = kstr;
+	cl->program_aho_match = clCreateProgramWithSource(cl->ctx, 2, srcs,
+	    NULL, &e);
 	if (e != CL_SUCCESS)
 		ERRXV(1, "ERROR creating OpenCL program: %s", clstrerror(e));
 
 	e = clBuildProgram(cl->program_aho_match, 0, NULL, optbuf, NULL, NULL);
 	clputlog(cl);
+	if (e != CL_SUCCESS && code) {
+		/* the compiler may not take the code; the table always does */
+		clReleaseProgram(cl->program_aho_match);
+		pthread_mutex_unlock(&program_lock);
+		free((char*)kstr);
+		free(optbuf);
+		free(code);
+		code = NULL;
+		trans_space(cl, acsm, space, sizeof(space));
+		goto retry;
+	}
 	if (e != CL_SUCCESS)
 		ERRXV(1, "ERROR building OpenCL program: %s", clstrerror(e));
 
+	if (kstr) {
+		free((char*)kstr);
+		kstr = NULL;
+	}
+
+	free(optbuf);
+	free(code);
+
+	cache_program(cl, opts, cl->program_aho_match);
+	pthread_mutex_unlock(&program_lock);
+
+	return cl->program_aho_match;
+}
+
+void
+ocl_aho_match_init(struct clconf *cl, cl_program program) {
+	int e;
+	const char *kname = "ahomatch";
+
+	/* the program may be shared; the kernel object is private */
+	e = clRetainProgram(program);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR retaining OpenCL program: %s", clstrerror(e));
+	cl->program_aho_match = program;
+
 	cl->kernel_aho_match = clCreateKernel(cl->program_aho_match, kname, &e);
 	if (e != CL_SUCCESS)
 		ERRXV(1, "ERROR creating OpenCL kernel: %s",
 				clstrerror(e));
 
-	if (kstr) {
-		free((char*)kstr);
-		kstr = NULL;
-	}
+	cl->kernel_sig_verify = clCreateKernel(cl->program_aho_match,
+	    "sigverify", &e);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ERROR creating OpenCL kernel: %s",
+				clstrerror(e));
 
 	return;
 }
@@ -66,6 +304,7 @@ ocl_aho_match_close(struct clconf *c) {
 	cl_int e;
 
 	e  = clReleaseKernel(c->kernel_aho_match);
+	e |= clReleaseKernel(c->kernel_sig_verify);
 	e |= clReleaseProgram(c->program_aho_match);
 
 	if (e != CL_SUCCESS)
@@ -81,12 +320,173 @@ ocl_aho_match_close(struct clconf *c) {
  */
 void
 ocl_aho_match(struct clconf *cl, struct databuf *db, acsm_t *acsm,
-    size_t local_ws, int stream)
+    size_t local_ws)
+{
+	ocl_aho_match_kernel(cl,
+	    acsm->d_trans_image ? acsm->d_trans_image : acsm->d_trans,
+	    acsm->d_out, acsm->d_out_ids,
+	    acsm->d_verify, acsm->d_window, acsm->d_case, acsm->d_sigs,
+	    acsm->d_classmap, acsm->d_start, db->d_data, db->d_indices,
+	    db->d_sizes, db->d_offsets, db->d_results, db->d_results2,
+	    db->chunks, db->bytes, db->d_states,
+	    acsm_get_max_pattern_size(acsm), db->max_results,
+	    acsm_get_classes(acsm), acsm_get_groups(acsm), db->words,
+	    local_ws);
+
+	/* drop the anchor matches whose signatures fail */
+	if (acsm->num_sigs > 0)
+		ocl_sig_verify_kernel(cl, acsm->d_sigs, acsm->d_sig_code,
+		    db->d_data, db->d_indices, db->d_sizes, db->d_offsets,
+		    db->d_results, db->d_results2, db->chunks,
+		    db->max_results, db->words, local_ws);
+}
+
+
+/*
+ * end of the bytes of the buffer from chunk i on that follow each other in
+ * its file, as file_span() in ahomatch.cl finds it
+ */
+static long
+span_end(struct databuf *db, size_t i)
+{
+	for (; i + 1 < db->chunks &&
+	    db->h_indices[i] + db->h_sizes[i] == db->h_indices[i + 1] &&
+	    db->h_offsets[i] + db->h_sizes[i] == db->h_offsets[i + 1]; i++)
+		;
+
+	return db->h_indices[i] + db->h_sizes[i];
+}
+
+
+/*
+ * keeps a match whose signature may continue past the end of the buffer
+ * for the next one, at its position from the end, if its pattern starts
+ * within the end of the buffer that is kept for it
+ */
+static void
+defer_match(struct databuf *db, acsm_t *acsm, int pat, long pos)
+{
+	size_t n;
+
+	n = db->num_deferred;
+	if (pos - acsm->h_verify[2 * pat + 1] + 1 < -MAX_PAT_SIZE ||
+	    n >= db->max_chunks * db->max_results)
+		return;
+
+	db->h_deferred[2 * n] = pat;
+	db->h_deferred[2 * n + 1] = pos;
+	db->num_deferred++;
+
+	return;
+}
+
+
+/*
+ * checks the flagged matches on the host and keeps the matches that pass
+ * in place, as sigverify does; the matches left to this buffer by the one
+ * before are checked and added to the first chunk
+ */
+int
+ocl_aho_match_edges(struct databuf *db, acsm_t *acsm, unsigned char *tail,
+    size_t tail_len)
 {
-	ocl_aho_match_kernel(cl, acsm->d_trans, db->d_data,
-	    db->d_indices, db->d_sizes, db->d_results, db->d_results2, db->chunks,
-	    db->bytes, db->last_state, acsm_get_max_pattern_size(acsm),
-	    db->max_results, local_ws, stream);
+	int j;
+	int k;
+	int n;
+	int old;
+	int pat;
+	int pos;
+	int kept;
+	int stored;
+	int failed;
+	int dropped;
+	long hi;
+	long end;
+	size_t i;
+
+	old = db->num_deferred;
+	end = 0;
+	if (db->chunks > 0)
+		end = db->h_indices[db->chunks - 1] +
+		    db->h_sizes[db->chunks - 1];
+
+	dropped = 0;
+	for (i = 0; i < db->chunks; i++) {
+		stored = db->h_results[i];
+		if (stored > db->max_results - 1)
+			stored = db->max_results - 1;
+
+		hi = -1;
+		kept = 0;
+		failed = 0;
+		for (k = 1; k <= stored; k++) {
+			pat = db->h_results[k * db->chunks + i];
+			pos = db->h_results2[k * db->chunks + i];
+			if (pat == RESULT_DROPPED)
+				continue;
+			if (pos < 0) {
+				if (pat < RESULT_DROPPED)
+					pat = RESULT_EDGE(pat);
+				defer_match(db, acsm, pat,
+				    RESULT_DEFER(pos) - end);
+				failed++;
+				continue;
+			}
+			if (pat < RESULT_DROPPED) {
+				if (hi < 0)
+					hi = span_end(db, i);
+				pat = RESULT_EDGE(pat);
+				if (!acsm_check_edge(acsm, pat, tail, tail_len,
+				    db->h_data, pos, hi)) {
+					failed++;
+					continue;
+				}
+			}
+			kept++;
+			db->h_results[kept * db->chunks + i] = pat;
+			db->h_results2[kept * db->chunks + i] = pos;
+		}
+		for (k = kept + 1; k <= stored; k++)
+			db->h_results[k * db->chunks + i] = RESULT_DROPPED;
+
+		db->h_results[i] -= failed;
+		db->h_results2[i] -= failed;
+		dropped += failed;
+	}
+
+	/*
+	 * the matches left by the buffer before, at their positions from its
+	 * end, which the first chunk continues; those that still fail in a
+	 * buffer of one span are left to the next one again
+	 */
+	n = 0;
+	hi = db->chunks > 0 ? span_end(db, 0) : 0;
+	for (j = 0; j < old && tail_len > 0 && db->chunks > 0; j++) {
+		pat = db->h_deferred[2 * j];
+		pos = db->h_deferred[2 * j + 1];
+		if (!acsm_check_edge(acsm, pat, tail, tail_len, db->h_data,
+		    pos, hi)) {
+			if (hi == end && pos - end -
+			    acsm->h_verify[2 * pat + 1] + 1 >= -MAX_PAT_SIZE) {
+				db->h_deferred[2 * n] = pat;
+				db->h_deferred[2 * n + 1] = pos - end;
+				n++;
+			}
+			continue;
+		}
+		k = db->h_results[0] + 1;
+		if (k <= db->max_results - 1) {
+			db->h_results[k * db->chunks] = pat;
+			db->h_results2[k * db->chunks] = pos;
+		}
+		db->h_results[0]++;
+		db->h_results2[0]++;
+	}
+	memmove(db->h_deferred + 2 * n, db->h_deferred + 2 * old,
+	    (db->num_deferred - old) * 2 * sizeof(int));
+	db->num_deferred += n - old;
+
+	return dropped;
 }
 
 
@@ -94,10 +494,14 @@ ocl_aho_match(struct clconf *cl, struct databuf *db, acsm_t *acsm,
  * OpenCL Aho-Corasick match kernel wrapper
  */
 static void
-ocl_aho_match_kernel(struct clconf *cl, cl_mem trans,
-    cl_mem data, cl_mem indices, cl_mem sizes, cl_mem results, cl_mem results2,
-    cl_uint chunks, cl_ulong data_size, cl_long last_state, cl_int max_pat_size,
-    cl_int max_results, size_t local_ws, int stream)
+ocl_aho_match_kernel(struct clconf *cl, cl_mem trans, cl_mem out,
+    cl_mem out_ids, cl_mem verify, cl_mem window, cl_mem case_bytes,
+    cl_mem sigs, cl_mem classmap, cl_mem start_bytes, cl_mem data,
+    cl_mem indices, cl_mem sizes, cl_mem offsets, cl_mem results,
+    cl_mem results2,
+    cl_uint chunks, cl_ulong data_size, cl_mem states, cl_int max_pat_size,
+    cl_int max_results, cl_int num_classes, cl_int num_groups, cl_int words,
+    size_t local_ws)
 {
 	int e;
 	size_t global = ROUNDUP(chunks, local_ws);
@@ -105,16 +509,28 @@ ocl_aho_match_kernel(struct clconf *cl, cl_mem trans,
 
 	/* Set the arguments */
 	clSetKernelArg(cl->kernel_aho_match, 0, sizeof(cl_mem),   &trans);
-	clSetKernelArg(cl->kernel_aho_match, 1, sizeof(cl_mem),   &data);
-	clSetKernelArg(cl->kernel_aho_match, 2, sizeof(cl_mem),   &indices);
-	clSetKernelArg(cl->kernel_aho_match, 3, sizeof(cl_mem),   &sizes);
-	clSetKernelArg(cl->kernel_aho_match, 4, sizeof(cl_mem),   &results);
-	clSetKernelArg(cl->kernel_aho_match, 5, sizeof(cl_mem),   &results2);
-	clSetKernelArg(cl->kernel_aho_match, 6, sizeof(cl_uint),  &chunks);
-	clSetKernelArg(cl->kernel_aho_match, 7, sizeof(cl_ulong), &data_size);
-	clSetKernelArg(cl->kernel_aho_match, 8, sizeof(cl_long),  &last_state);
-	clSetKernelArg(cl->kernel_aho_match, 9, sizeof(cl_int),   &max_pat_size);
-	clSetKernelArg(cl->kernel_aho_match, 10, sizeof(cl_int),   &max_results);
+	clSetKernelArg(cl->kernel_aho_match, 1, sizeof(cl_mem),   &out);
+	clSetKernelArg(cl->kernel_aho_match, 2, sizeof(cl_mem),   &out_ids);
+	clSetKernelArg(cl->kernel_aho_match, 3, sizeof(cl_mem),   &verify);
+	clSetKernelArg(cl->kernel_aho_match, 4, sizeof(cl_mem),   &window);
+	clSetKernelArg(cl->kernel_aho_match, 5, sizeof(cl_mem),   &case_bytes);
+	clSetKernelArg(cl->kernel_aho_match, 6, sizeof(cl_mem),   &sigs);
+	clSetKernelArg(cl->kernel_aho_match, 7, sizeof(cl_mem),   &classmap);
+	clSetKernelArg(cl->kernel_aho_match, 8, sizeof(cl_mem),   &start_bytes);
+	clSetKernelArg(cl->kernel_aho_match, 9, sizeof(cl_mem),   &data);
+	clSetKernelArg(cl->kernel_aho_match, 10, sizeof(cl_mem),   &indices);
+	clSetKernelArg(cl->kernel_aho_match, 11, sizeof(cl_mem),   &sizes);
+	clSetKernelArg(cl->kernel_aho_match, 12, sizeof(cl_mem),   &offsets);
+	clSetKernelArg(cl->kernel_aho_match, 13, sizeof(cl_mem),   &results);
+	clSetKernelArg(cl->kernel_aho_match, 14, sizeof(cl_mem),   &results2);
+	clSetKernelArg(cl->kernel_aho_match, 15, sizeof(cl_uint),  &chunks);
+	clSetKernelArg(cl->kernel_aho_match, 16, sizeof(cl_ulong), &data_size);
+	clSetKernelArg(cl->kernel_aho_match, 17, sizeof(cl_mem),   &states);
+	clSetKernelArg(cl->kernel_aho_match, 18, sizeof(cl_int),   &max_pat_size);
+	clSetKernelArg(cl->kernel_aho_match, 19, sizeof(cl_int),   &max_results);
+	clSetKernelArg(cl->kernel_aho_match, 20, sizeof(cl_int),   &num_classes);
+	clSetKernelArg(cl->kernel_aho_match, 21, sizeof(cl_int),   &num_groups);
+	clSetKernelArg(cl->kernel_aho_match, 22, sizeof(cl_int),   &words);
 
 	/* execute the matching kernel */
 	e = clEnqueueNDRangeKernel(cl->queue, cl->kernel_aho_match, 1, NULL, &global, &local, 0,
@@ -130,3 +546,350 @@ ocl_aho_match_kernel(struct clconf *cl, cl_mem trans,
 		ERRXV(1, "ocl_aho_match_kernel: ERROR finishing kernel: %s", clstrerror(e));
 }
 
+
+
+/*
+ * OpenCL signature verification kernel wrapper
+ */
+static void
+ocl_sig_verify_kernel(struct clconf *cl, cl_mem sigs, cl_mem sig_code,
+    cl_mem data, cl_mem indices, cl_mem sizes, cl_mem offsets,
+    cl_mem results, cl_mem results2, cl_uint chunks, cl_int max_results,
+    cl_int words, size_t local_ws)
+{
+	int e;
+	size_t global = ROUNDUP(chunks, local_ws);
+	size_t local = local_ws;
+
+	/* Set the arguments */
+	clSetKernelArg(cl->kernel_sig_verify, 0, sizeof(cl_mem),  &sigs);
+	clSetKernelArg(cl->kernel_sig_verify, 1, sizeof(cl_mem),  &sig_code);
+	clSetKernelArg(cl->kernel_sig_verify, 2, sizeof(cl_mem),  &data);
+	clSetKernelArg(cl->kernel_sig_verify, 3, sizeof(cl_mem),  &indices);
+	clSetKernelArg(cl->kernel_sig_verify, 4, sizeof(cl_mem),  &sizes);
+	clSetKernelArg(cl->kernel_sig_verify, 5, sizeof(cl_mem),  &offsets);
+	clSetKernelArg(cl->kernel_sig_verify, 6, sizeof(cl_mem),  &results);
+	clSetKernelArg(cl->kernel_sig_verify, 7, sizeof(cl_mem),  &results2);
+	clSetKernelArg(cl->kernel_sig_verify, 8, sizeof(cl_uint), &chunks);
+	clSetKernelArg(cl->kernel_sig_verify, 9, sizeof(cl_int),  &max_results);
+	clSetKernelArg(cl->kernel_sig_verify, 10, sizeof(cl_int), &words);
+
+	/* execute the verification kernel */
+	e = clEnqueueNDRangeKernel(cl->queue, cl->kernel_sig_verify, 1, NULL,
+	    &global, &local, 0, NULL, NULL);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ocl_sig_verify_kernel: ERROR executing kernel: %s",
+		    clstrerror(e));
+
+	/* wait until the kernel is done */
+	e = clFinish(cl->queue);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ocl_sig_verify_kernel: ERROR finishing kernel: %s",
+		    clstrerror(e));
+}
+
+#ifdef AHO_MATCH_TEST
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ocl_prefix_sum.h"
+
+/*
+ * counts the matches the host is given
+ */
+static int
+count_match(int f_id, int p_idx, int c_id, int off, void *uarg)
+{
+	(*(int *)uarg)++;
+
+	return 0;
+}
+
+/*
+ * scans the chunks over the compiled automaton, per_round chunks per
+ * buffer, as one stream: the last chunk of a round is the tail of the next
+ * one; returns the matches reported, and their count in total if set
+ */
+static int
+scan_chunks(struct clconf *cl, acsm_t *acsm, char **chunks, int n,
+    int per_round, int max_results, int *total)
+{
+	int i;
+	int k;
+	int count;
+	int reported;
+	size_t tail_len;
+	unsigned char *tail;
+	cl_program program;
+	struct databuf *db;
+
+	acsm_serialize(acsm);
+	acsm_upload(acsm, 0, 0, cl->ctx, cl->queue);
+	program = ocl_aho_match_build(cl, acsm, max_results);
+	ocl_aho_match_init(cl, program);
+	clReleaseProgram(program);
+
+	db = databuf_new(16, 256, max_results, 0, 0, cl);
+	count = 0;
+	reported = 0;
+	tail = NULL;
+	tail_len = 0;
+	for (i = 0; i < n; i += per_round) {
+		for (k = i; k < n && k < i + per_round; k++)
+			databuf_add_chunk(db, chunks[k], strlen(chunks[k]), k,
+			    1);
+
+		databuf_copy_host_to_device(db, cl->queue);
+		ocl_aho_match(cl, db, acsm, 16);
+		databuf_copy_device_to_host(db, cl->queue);
+
+		ocl_aho_match_edges(db, acsm, tail, tail_len);
+		count += databuf_process_results(db, count_match, &reported);
+
+		tail = (unsigned char *)chunks[k - 1];
+		tail_len = strlen(chunks[k - 1]);
+		databuf_reset(db);
+	}
+
+	databuf_free(db, 0, cl->queue);
+	ocl_aho_match_close(cl);
+	acsm_release(acsm, 0, cl->queue);
+
+	if (total)
+		*total = count;
+
+	return reported;
+}
+
+/*
+ * a kernel that walks the byte classes with next_state() from the root,
+ * storing the state after each
+ */
+static const char *walk_src =
+    "__kernel void\n"
+    "walk(__global uchar *cls, const int n, __global int *out)\n"
+    "{\n"
+    "\tint i;\n"
+    "\tint s = 0;\n"
+    "\n"
+    "\tfor (i = 0; i < n; i++) {\n"
+    "\t\ts = next_state(s, cls[i]);\n"
+    "\t\tif (s < 0)\n"
+    "\t\t\ts = -s;\n"
+    "\t\tout[i] = s;\n"
+    "\t}\n"
+    "}\n";
+
+/*
+ * walks the bytes with the code generated for the serialized automaton and
+ * with acsm_walk(); returns the bytes the two disagree on
+ */
+static int
+walk_code(struct clconf *cl, acsm_t *acsm, char *bytes)
+{
+	int e;
+	int i;
+	int n;
+	int diff;
+	int *out;
+	char *code;
+	unsigned char *cls;
+	const char *srcs[2];
+	size_t one = 1;
+	cl_mem d_cls;
+	cl_mem d_out;
+	cl_program program;
+	cl_kernel kernel;
+
+	code = acsm_gen_code(acsm, TRANS_CODE_MAX_CASES);
+	if (code == NULL)
+		return -1;
+
+	n = strlen(bytes);
+	cls = MALLOC(n);
+	out = MALLOC(n * sizeof(int));
+	for (i = 0; i < n; i++)
+		cls[i] = acsm->classmap[(unsigned char)bytes[i]];
+
+	srcs[0] = code;
+	srcs[1] = walk_src;
+	program = clCreateProgramWithSource(cl->ctx, 2, srcs, NULL, &e);
+	e |= clBuildProgram(program, 0, NULL, "", NULL, NULL);
+	kernel = clCreateKernel(program, "walk", &e);
+	d_cls = clCreateBuffer(cl->ctx, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+	    n, cls, &e);
+	d_out = clCreateBuffer(cl->ctx, CL_MEM_WRITE_ONLY, n * sizeof(int),
+	    NULL, &e);
+	clSetKernelArg(kernel, 0, sizeof(cl_mem), &d_cls);
+	clSetKernelArg(kernel, 1, sizeof(cl_int), &n);
+	clSetKernelArg(kernel, 2, sizeof(cl_mem), &d_out);
+	clEnqueueNDRangeKernel(cl->queue, kernel, 1, NULL, &one, &one, 0,
+	    NULL, NULL);
+	clEnqueueReadBuffer(cl->queue, d_out, CL_TRUE, 0, n * sizeof(int),
+	    out, 0, NULL, NULL);
+
+	diff = 0;
+	for (i = 0; i < n; i++)
+		if (out[i] != acsm_walk(acsm, 0, (unsigned char *)bytes, i + 1))
+			diff++;
+
+	clReleaseMemObject(d_cls);
+	clReleaseMemObject(d_out);
+	clReleaseKernel(kernel);
+	clReleaseProgram(program);
+	FREE(cls);
+	FREE(out);
+	free(code);
+
+	return diff;
+}
+
+int main(int argc, char *argv[]) {
+
+	struct clconf cl;
+	acsm_t *acsm;
+	char sig[] = "414243??44";
+	char fail[256];
+	char pass[] = "..ABCxD..";
+	char *chunks[2];
+	int i;
+	int failed = 0;
+
+	clinitctx(&cl, 0, -1);
+
+	ocl_prefix_sum_init(&cl);
+
+	/********************************************************************/
+
+	printf("Testing signature verification past the result cells... ");
+
+	/* many more anchor hits than result cells, all failing */
+	fail[0] = '\0';
+	for (i = 0; i < 3 * MAX_RESULTS; i++)
+		strcat(fail, "ABCxE");
+	chunks[0] = fail;
+	chunks[1] = pass;
+
+	acsm = acsm_new();
+	acsm_add_signature(acsm, sig, 0, 0, NULL, 0);
+	acsm_compile(acsm);
+
+	if (scan_chunks(&cl, acsm, chunks, 2, 2, MAX_RESULTS, &i) != 1 ||
+	    i != 1) {
+		printf("FAILED\n");
+		failed++;
+	} else
+		printf("OK\n");
+
+	acsm_cleanup(acsm);
+	acsm_free(acsm);
+
+	/********************************************************************/
+
+	printf("Testing the case of a match across two buffers... ");
+
+	/* the rounds end on 16 bytes, the kernel carries the state as is */
+	acsm = acsm_new();
+	acsm_add_pattern(acsm, (unsigned char *)"abCD", 4, 0, 0, 0, NULL, 0);
+	acsm_add_pattern(acsm, (unsigned char *)"xyz", 3, 1, 0, 0, NULL, 1);
+	acsm_compile(acsm);
+
+	chunks[0] = "..............Ab";
+	chunks[1] = "CD..............";
+	i = scan_chunks(&cl, acsm, chunks, 2, 1, MAX_RESULTS, NULL);
+	chunks[0] = "..............ab";
+	i += 10 * scan_chunks(&cl, acsm, chunks, 2, 1, MAX_RESULTS, NULL);
+	if (i != 10) {
+		printf("FAILED\n");
+		failed++;
+	} else
+		printf("OK\n");
+
+	acsm_cleanup(acsm);
+	acsm_free(acsm);
+
+	/********************************************************************/
+
+	printf("Testing signatures across two buffers... ");
+
+	/* the anchor is ABCD, the parts before it are in the last buffer */
+	acsm = acsm_new();
+	acsm_add_signature(acsm, "5858{2-4}41424344", 0, 0, NULL, 0);
+	acsm_add_signature(acsm, "5959*4142434445", 0, 0, NULL, 1);
+	acsm_compile(acsm);
+
+	chunks[0] = "............XX..";
+	chunks[1] = "ABCD............";
+	i = scan_chunks(&cl, acsm, chunks, 2, 1, MAX_RESULTS, NULL);
+	chunks[0] = ".........XX.....";
+	i += 10 * scan_chunks(&cl, acsm, chunks, 2, 1, MAX_RESULTS, NULL);
+	chunks[0] = "..YY............";
+	chunks[1] = "ABCDE...........";
+	i += 100 * scan_chunks(&cl, acsm, chunks, 2, 1, MAX_RESULTS, NULL);
+	if (i != 101) {
+		printf("FAILED\n");
+		failed++;
+	} else
+		printf("OK\n");
+
+	acsm_cleanup(acsm);
+	acsm_free(acsm);
+
+	/********************************************************************/
+
+	printf("Testing signatures that continue into the next buffer... ");
+
+	/* the parts after the anchor are in the next buffer */
+	acsm = acsm_new();
+	acsm_add_signature(acsm, "41424344*5a5a", 0, 0, NULL, 0);
+	acsm_add_signature(acsm, "45464748{2-6}5a5a", 0, 0, NULL, 1);
+	acsm_compile(acsm);
+
+	chunks[0] = "..........ABCD..";
+	chunks[1] = "....ZZ..........";
+	i = scan_chunks(&cl, acsm, chunks, 2, 1, MAX_RESULTS, NULL);
+	chunks[0] = "............EFGH";
+	chunks[1] = "..ZZ............";
+	i += 10 * scan_chunks(&cl, acsm, chunks, 2, 1, MAX_RESULTS, NULL);
+	chunks[1] = "........ZZ......";
+	i += 100 * scan_chunks(&cl, acsm, chunks, 2, 1, MAX_RESULTS, NULL);
+	if (i != 11) {
+		printf("FAILED\n");
+		failed++;
+	} else
+		printf("OK\n");
+
+	acsm_cleanup(acsm);
+	acsm_free(acsm);
+
+	/********************************************************************/
+
+	printf("Testing the DFA generated as code against the table... ");
+
+	acsm = acsm_new();
+	acsm_add_pattern(acsm, (unsigned char *)"he", 2, 0, 0, 0, NULL, 0);
+	acsm_add_pattern(acsm, (unsigned char *)"she", 3, 0, 0, 0, NULL, 1);
+	acsm_add_pattern(acsm, (unsigned char *)"his", 3, 0, 0, 0, NULL, 2);
+	acsm_add_pattern(acsm, (unsigned char *)"hers", 4, 0, 0, 0, NULL, 3);
+	acsm_add_pattern(acsm, (unsigned char *)"Usher", 5, 1, 0, 0, NULL, 4);
+	acsm_compile(acsm);
+	acsm_serialize(acsm);
+
+	/* a budget below a case per state generates nothing */
+	if (acsm_gen_code(acsm, acsm_get_states(acsm) - 1) != NULL ||
+	    walk_code(&cl, acsm, "ushers said his hershey was hers; "
+	    "USHERS shed the hish sheers") != 0) {
+		printf("FAILED\n");
+		failed++;
+	} else
+		printf("OK\n");
+
+	acsm_cleanup(acsm);
+	acsm_free(acsm);
+
+	/********************************************************************/
+
+	return failed;
+}
+#endif
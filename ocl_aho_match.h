@@ -9,25 +9,82 @@
 #include <CL/opencl.h>
 
 
+/*
+ * builds the matching program variant for the given automaton; the
+ * serialized DFA is read from constant memory if it fits the device's,
+ * otherwise its top rows are kept in local memory
+ *
+ * the result cells, the longest pattern, the byte classes and the groups
+ * are compiled in as constants; the variants built so far are kept, so an
+ * automaton of the same shape reuses its program
+ *
+ * the kernel scans in stream mode: the first chunk continues the state the
+ * last chunk of the buffer before ended in, and a match in progress at
+ * the end of a chunk is followed into the next one
+ *
+ * @arg0: OpenCL configuration
+ * @arg1: the serialized aho-corasick state machine
+ * @arg2: maximum result cells per chunk
+ *
+ * ret:   the matching program, with a reference for the caller; it can be
+ *        shared by all configurations on the same OpenCL context
+ */
+cl_program
+ocl_aho_match_build(struct clconf *c, acsm_t *, int);
+
+/*
+ * creates the matching and the signature verification kernels of a
+ * configuration
+ *
+ * @arg0: OpenCL configuration
+ * @arg1: matching program returned by ocl_aho_match_build()
+ */
 void
-ocl_aho_match_init(struct clconf *c);
+ocl_aho_match_init(struct clconf *c, cl_program);
 
 void
 ocl_aho_match_close(struct clconf *c);
 
 /*
- * OpenCL Aho-Corasick match kernel wrapper
+ * OpenCL Aho-Corasick match kernel wrapper; if the automaton has
+ * signatures, the verification kernel then drops the matches of the
+ * anchors whose signatures fail
  *
  * @arg0: OpenCL configuration
- * @arg1: databuf to search
+ * @arg1: databuf to search, with as many result cells per chunk as the
+ *        program was built for
  * @arg2: the aho-corasick state machine
  * @arg3: local work size
- * @arg4: stream mode: continue to
- *        consecutive chunks if on; otherwise
- *        match each chunk independently
  */
 void
-ocl_aho_match(struct clconf *, struct databuf *, acsm_t *, size_t, int);
+ocl_aho_match(struct clconf *, struct databuf *, acsm_t *, size_t);
+
+/*
+ * checks the matches that start before the buffer, which the kernels
+ * flagged since they could not check them in full, against the end of
+ * the buffer before (see acsm_check_edge()); must be called once the
+ * results are copied to the host, before they are processed. The matches
+ * that pass are kept in place, the cells freed are marked dropped and the
+ * counts lowered.
+ *
+ * The matches whose signatures may continue past the end of the buffer
+ * are taken out of it the same way and kept in the databuf; the next call
+ * checks them against its buffer and adds those that pass to the cells of
+ * its first chunk, at their negative positions before it. Those that
+ * still fail in a buffer of a single span are kept again, as long as
+ * their patterns start within the last MAX_PAT_SIZE bytes.
+ *
+ * @arg0: databuf scanned
+ * @arg1: the aho-corasick state machine it was scanned with
+ * @arg2: end of the buffer before, if the file of the first chunk
+ *        continues it there
+ * @arg3: number of bytes of arg2, 0 if the first chunk continues no tail;
+ *        the matches kept by the call before are dropped then
+ *
+ * ret:   number of matches dropped or kept for the next buffer
+ */
+int
+ocl_aho_match_edges(struct databuf *, acsm_t *, unsigned char *, size_t);
 
 
 #endif /* _OCL_AHO_MATCH_H_ */
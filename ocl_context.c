@@ -84,3 +84,28 @@ clinitctx(struct clconf *cl, int pos, int subpos)
 	return;
 }
 
+
+
+/*
+ * creates a new OpenCL configuration on the context of another one
+ */
+void
+clinitctx_shared(struct clconf *cl, struct clconf *parent)
+{
+	int e;
+
+	cl->platform = parent->platform;
+	cl->dev = parent->dev;
+	cl->type = parent->type;
+
+	/* share the environment, keep a private queue */
+	cl->ctx = parent->ctx;
+	e = clRetainContext(cl->ctx);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "ctx: %s", clstrerror(e));
+	cl->queue = clCreateCommandQueue(cl->ctx, cl->dev, 0, &e);
+	if (e != CL_SUCCESS)
+		ERRXV(1, "queue: %s", clstrerror(e));
+
+	return;
+}
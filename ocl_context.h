@@ -13,6 +13,7 @@ struct clconf {
 
 	cl_program       program_aho_match;	/* OpenCL matching program  */
 	cl_kernel        kernel_aho_match;	/* OpenCL matching kernel   */
+	cl_kernel        kernel_sig_verify;	/* signature check kernel   */
 
 	cl_program       program_prefixsum;	/* OpenCL prefixsum program */
 	cl_kernel        kernel_prescan;
@@ -37,4 +38,14 @@ struct clconf {
 void
 clinitctx(struct clconf *, int, int);
 
+/*
+ * creates a new OpenCL configuration on the context of another one; the
+ * two share the device and its buffers but have their own command queue
+ *
+ * arg0: OpenCL configuration
+ * arg1: OpenCL configuration to share the context with
+ */
+void
+clinitctx_shared(struct clconf *, struct clconf *);
+
 #endif /* _OCL_CONTEXT_H_ */
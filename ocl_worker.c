@@ -3,6 +3,12 @@
 #include <errno.h>
 #include <limits.h>
 #include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
 #include "common.h"
 #include "acsmx.h"
 #include "databuf.h"
@@ -14,11 +20,30 @@
 #include "utils.h"
 
 
+/* the automaton the worker contexts switch to and the reference counts */
+static struct ocl_automaton *published;
+static pthread_mutex_t automaton_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* sample traffic read at once for profiling */
+#define SAMPLE_BLOCK	(1 << 20)
+
+
+/* a pattern of the file in the dedupe table, while the file is read */
+struct pattern_slot {
+	unsigned char	*pat;		/* bytes, in the arena of the file */
+	int		n;		/* number of bytes                 */
+	int		nocase;		/* modifiers it is added with      */
+	int		offset;
+	int		depth;
+	long int	id;		/* ID, 0 if the lines have none    */
+};
+
+
 /*
  * creates a new worker context
  */
 struct ocl_worker_ctx *
-ocl_worker_ctx_create(int dev_pos)
+ocl_worker_ctx_create(int dev_pos, struct ocl_worker_ctx *parent)
 {
 	struct ocl_worker_ctx *ocl_w_ctx;
 
@@ -28,10 +53,14 @@ ocl_worker_ctx_create(int dev_pos)
 	if (!ocl_w_ctx)
 		return NULL;
 
-	/* create and initialize the OpenCL context */
-	clinitctx(&ocl_w_ctx->cl, dev_pos, -1);
-
-	ocl_aho_match_init(&ocl_w_ctx->cl);
+	/*
+	 * create and initialize the OpenCL context; workers on the same
+	 * device share the parent's context so they can share buffers
+	 */
+	if (parent)
+		clinitctx_shared(&ocl_w_ctx->cl, &parent->cl);
+	else
+		clinitctx(&ocl_w_ctx->cl, dev_pos, -1);
 
 	ocl_prefix_sum_init(&ocl_w_ctx->cl);
 
@@ -42,127 +71,872 @@ ocl_worker_ctx_create(int dev_pos)
 
 
 /*
- * initializes a new worker context
+ * parses the modifiers that follow a quoted pattern, e.g.,
+ * "Pattern" nocase; offset:4; depth:16;
  */
-int
-ocl_worker_ctx_init(struct ocl_worker_ctx *ocl_w_ctx, int dev_pos,
-    size_t local_ws, size_t global_ws, int mapped, char *pat_path, int hex_pat, 
-    int pat_size_limit, size_t max_chunk_size, int max_results, int verbose,
-    int text_mode, int follow, int id, int thread_no, int total_files, int *fds,
-    char **filenames)
+static void
+parse_modifiers(char *mods, int *nocase, int *offset, int *depth)
+{
+	char *tok;
+	char *last;
+
+	for (tok = strtok_r(mods, " \t;,", &last); tok;
+	    tok = strtok_r(NULL, " \t;,", &last)) {
+		if (strcmp(tok, "nocase") == 0)
+			*nocase = 1;
+		else if (strncmp(tok, "offset:", 7) == 0)
+			*offset = atoi(tok + 7);
+		else if (strncmp(tok, "depth:", 6) == 0)
+			*depth = atoi(tok + 6);
+		else
+			fprintf(stderr, "WARNING: unknown pattern modifier "
+			    "'%s'\n", tok);
+	}
+
+	return;
+}
+
+
+/*
+ * counts the visits of the states of the automaton over the sample traffic
+ */
+static int
+scan_sample(acsm_t *acsm, char *sample_path)
+{
+	size_t n;
+	FILE *sfp;
+	unsigned char *block;
+
+	if ((sfp = fopen(sample_path, "rb")) == NULL)
+		return -1;
+
+	block = MALLOC(SAMPLE_BLOCK);
+	if (!block) {
+		fclose(sfp);
+		return -1;
+	}
+
+	while ((n = fread(block, 1, SAMPLE_BLOCK, sfp)) > 0)
+		acsm_profile(acsm, block, n);
+	fclose(sfp);
+	FREE(block);
+
+	return 0;
+}
+
+
+/*
+ * scans the sample traffic over the compiled automaton and renumbers its
+ * states, so the rows the sample reads the most are adjacent
+ */
+static int
+profile_sample(acsm_t *acsm, char *sample_path)
 {
-	int i, j;
+	if (scan_sample(acsm, sample_path) != 0)
+		return -1;
+
+	return acsm_reorder(acsm);
+}
+
+
+/*
+ * checks if the first line of the pattern file is in the categorical
+ * format, "[ID] [PATTERN]", where ID is an integer
+ */
+static int
+is_categorical(const char *line, const char *end)
+{
+	const char *p;
+
+	p = line;
+	if (p < end && (*p == '+' || *p == '-'))
+		p++;
+	if (p == end || !isdigit((unsigned char)*p))
+		return 0;
+	while (p < end && isdigit((unsigned char)*p))
+		p++;
+
+	return p < end && (*p == ' ' || *p == '\t');
+}
+
+
+/*
+ * parses the ID that starts a line of the categorical format and skips the
+ * white space after it
+ *
+ * ret:   0 on success
+ *       -1 if the ID is out of range
+ */
+static int
+parse_id(const char **line, const char *end, long int *id)
+{
+	int neg;
+	unsigned long v;
+	const char *p;
+
+	p = *line;
+	neg = 0;
+	if (p < end && (*p == '+' || *p == '-'))
+		neg = (*p++ == '-');
+	for (v = 0; p < end && isdigit((unsigned char)*p); p++) {
+		if (v > ((unsigned long)LONG_MAX - (*p - '0')) / 10)
+			return -1;
+		v = v * 10 + (*p - '0');
+	}
+	while (p < end && isspace((unsigned char)*p))
+		p++;
+
+	*id = neg ? -(long int)v : (long int)v;
+	*line = p;
+
+	return 0;
+}
+
+
+/*
+ * returns the value of a printable hex digit
+ */
+static inline int
+hex_value(int c)
+{
+	return isdigit(c) ? c - '0' : tolower(c) - 'a' + 10;
+}
+
+
+/*
+ * decodes a printable hex pattern
+ *
+ * ret:  the number of bytes
+ *       -1 if the pattern has an odd length or a character that is not hex
+ */
+static int
+decode_hex(const char *hex, unsigned char *bytes)
+{
+	int n;
+
+	for (n = 0; hex[0]; hex += 2) {
+		if (!isxdigit((unsigned char)hex[0]) ||
+		    !isxdigit((unsigned char)hex[1]))
+			return -1;
+		bytes[n++] = hex_value((unsigned char)hex[0]) * 16 +
+		    hex_value((unsigned char)hex[1]);
+	}
+
+	return n;
+}
+
+
+/*
+ * hashes a pattern and the modifiers it is added with
+ */
+static size_t
+hash_pattern(struct pattern_slot *p)
+{
+	int i;
+	uint64_t h;
+
+	/* FNV-1a */
+	h = 0xcbf29ce484222325ULL;
+	for (i = 0; i < p->n; i++)
+		h = (h ^ p->pat[i]) * 0x100000001b3ULL;
+	h = (h ^ (uint64_t)p->nocase) * 0x100000001b3ULL;
+	h = (h ^ (uint64_t)p->offset) * 0x100000001b3ULL;
+	h = (h ^ (uint64_t)p->depth) * 0x100000001b3ULL;
+	h = (h ^ (uint64_t)p->id) * 0x100000001b3ULL;
+
+	return (size_t)h;
+}
+
+
+/*
+ * keeps the pattern in the dedupe table, unless it holds an identical one
+ *
+ * ret: 1 if the pattern is new, 0 if it is a duplicate
+ */
+static int
+dedupe_pattern(struct pattern_slot *table, size_t mask,
+    struct pattern_slot *p)
+{
+	size_t h;
+	struct pattern_slot *s;
+
+	for (h = hash_pattern(p) & mask; table[h].pat; h = (h + 1) & mask) {
+		s = &table[h];
+		if (s->n == p->n && s->nocase == p->nocase &&
+		    s->offset == p->offset && s->depth == p->depth &&
+		    s->id == p->id && memcmp(s->pat, p->pat, p->n) == 0)
+			return 0;
+	}
+	table[h] = *p;
+
+	return 1;
+}
+
+
+/*
+ * reads the patterns of the pattern file to a state machine, not compiled
+ *
+ * the file is mapped and split at its newlines in one pass; the bytes of
+ * the patterns, copied or decoded from hex, are laid out in a single
+ * arena, and a pattern identical to an earlier one, in its bytes, its
+ * modifiers and, in the categorical format, its ID, is added once
+ */
+static acsm_t *
+parse_patterns(char *pat_path, int hex_pat, struct regex_filter *rules,
+    int pat_size_limit, int nocase)
+{
+	int fd;
+	int n;
+	int categ;	/* categorical format means patterns
+			   are in the form "[ID] [PATTERN]", where ID is int */
+	int pat_nocase;
+	int pat_offset;
+	int pat_depth;
 	long int pat_id;
+	long int i;
+	size_t size;
+	size_t lines;
+	size_t mask;
+	size_t arena_len;
+	const char *map;
+	const char *line;
+	const char *end;
+	const char *next;
 	char *ptr;
-	FILE *pfp;
-	char line[MAX_PAT_SIZE];
 	char *pattern;
-	unsigned int pattern_len;
-	char pid[MAX_PAT_SIZE];
-	int categ = 0; /* categorical format means patterns
-			  are in the form "[ID] [PATTERN]", where ID is int */
+	char text[MAX_PAT_SIZE];
+	unsigned char *arena;
+	struct stat st;
+	struct pattern_slot slot;
+	struct pattern_slot *table;
+	acsm_t *acsm;
 
-	/* read the pattern file and make the serialized DFA, copy to device */
-	ocl_w_ctx->acsm = acsm_new();
+	/* map the file with the patterns */
+	if ((fd = open(pat_path, O_RDONLY)) == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1) {
+		close(fd);
+		return NULL;
+	}
+	size = st.st_size;
+	map = NULL;
+	if (size > 0) {
+		map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			return NULL;
+		}
+		madvise((void *)map, size, MADV_SEQUENTIAL);
+	}
+	close(fd);
 
-	/* open file with patterns */
-	if ((pfp = fopen(pat_path, "r")) == NULL) {
-		return -1;
+	/* the newlines are found by memchr(), a vector at a time */
+	lines = 1;
+	for (line = map; line < map + size &&
+	    (line = memchr(line, '\n', map + size - line)); line++)
+		lines++;
+
+	/* the bytes of a pattern are at most as many as those of its line */
+	for (mask = 1; mask < 2 * lines; mask <<= 1)
+		;
+	table = calloc(mask--, sizeof(struct pattern_slot));
+	arena = MALLOC(size + 1);
+	if (!table || !arena) {
+		free(table);
+		FREE(arena);
+		if (map)
+			munmap((void *)map, size);
+		return NULL;
 	}
+	arena_len = 0;
 
-	i = 0;
-	while (fgets(line, sizeof(line), pfp)) {
-		/* strip ending newlines */
-		if (line[strlen(line) - 1] == '\n')
-			line[strlen(line) - 1] = '\0';
+	acsm = acsm_new();
 
-		if (i == 0) { /* if first line, check for the format */
-			j = 0;
-			categ = 0;
+	categ = 0;
+	for (i = 0, line = map; line < map + size; i++, line = next) {
+		end = memchr(line, '\n', map + size - line);
+		next = end ? end + 1 : map + size;
+		if (!end)
+			end = map + size;
 
-			/* find the first space */
-			for (j=0; i < strlen(line); j++) {
-				if (line[j] == ' ' || line[j] == '\t') {
-					j--;
-					break;
-				}
-			}
+		/* the format is told by the first line */
+		if (i == 0)
+			categ = is_categorical(line, end);
 
-			/* go back to the start and check if everything is a digit */
-			for (j; j > 0; j--) {
-				if (!isdigit(line[j]))
-					break;
-			}
+		pat_id = i;
+		if (categ && parse_id(&line, end, &pat_id) != 0) {
+			acsm_cleanup(acsm);
+			acsm_free(acsm);
+			acsm = NULL;
+			break;
+		}
 
-			/* final check for the first one; it can also be a '+' or a '-' */
-			if (j == 0) {
-			       if (line[0] == '+' || line[0] == '-' || isdigit(line[0]))
-				       categ = 1;
-			}
+		/* a cut line would be another pattern */
+		if (end - line > MAX_PAT_SIZE - 1) {
+			fprintf(stderr, "WARNING: skipping the pattern of line "
+			    "%ld, longer than %d bytes\n", i + 1,
+			    MAX_PAT_SIZE - 1);
+			continue;
 		}
 
-		if (categ == 1) {
-			errno = 0;
-			pat_id = strtol(line, &ptr, 10);
-	
-			if ((errno == ERANGE && (pat_id == LONG_MAX || pat_id == LONG_MIN))
-		     			|| (errno != 0 && pat_id == 0)) {
-				return -1;
-			}
-	
-			/* eat white spaces */
-			while (isspace(*ptr) && ptr != &line[MAX_PAT_SIZE - 1])
-				ptr++;
+		/* the text of the pattern, NUL terminated for its parsers */
+		n = end - line;
+		memcpy(text, line, n);
+		text[n] = '\0';
+		pattern = text;
 
-			pattern = ptr;
-			pattern_len = strlen(pattern);
-		} else {
-			pattern = line;
-			pattern_len = strlen(pattern);
-			pat_id = i;
+		/* a quoted pattern may be followed by its modifiers */
+		pat_nocase = nocase;
+		pat_offset = 0;
+		pat_depth = 0;
+		if (pattern[0] == '"' && (ptr = strrchr(pattern, '"')) &&
+		    ptr != pattern) {
+			*ptr = '\0';
+			parse_modifiers(ptr + 1, &pat_nocase, &pat_offset,
+			    &pat_depth);
+			pattern = &pattern[1];
 		}
 
-		if (pattern[0] == '"' && pattern[pattern_len - 1] == '"') {
-			pattern[pattern_len - 1] = '\0';
-			pattern = &pattern[1];
-			pattern_len -= 2;
+		/*
+		 * the automaton looks for the literals a regex requires, or
+		 * for the anchor of a signature with wildcards
+		 */
+		if (rules) {
+			switch (regex_filter_add(rules, acsm, pattern,
+			    pat_nocase, pat_id)) {
+			case -1:
+				fprintf(stderr, "WARNING: skipping malformed "
+				    "regex '%s'\n", pattern);
+				break;
+			case 1:
+				fprintf(stderr, "WARNING: regex '%s' has no "
+				    "required literal, it is checked on every "
+				    "chunk\n", pattern);
+				break;
+			}
+			continue;
+		}
+		if (hex_pat && strpbrk(pattern, "?{*(")) {
+			if (acsm_add_signature(acsm, pattern, pat_offset,
+			    pat_depth, 0, pat_id) != 0)
+				fprintf(stderr, "WARNING: skipping malformed "
+				    "signature '%s'\n", pattern);
+			continue;
 		}
 
+		/* the bytes of the pattern go to the end of the arena */
+		slot.pat = arena + arena_len;
 		if (hex_pat) {
-			if (pat_size_limit != -1)
-				pattern[pat_size_limit * 2] = '\0';
-			acsm_add_pattern(ocl_w_ctx->acsm,
-			    printable_hex_to_bytes((unsigned char *)pattern),
-			    strlen(pattern) / 2,  0, 0, 0, 0, pat_id);
+			n = decode_hex(pattern, slot.pat);
+			if (n == -1) {
+				fprintf(stderr, "WARNING: skipping malformed "
+				    "hex pattern '%s'\n", pattern);
+				continue;
+			}
 		} else {
-			if (pat_size_limit != -1)
-				pattern[pat_size_limit] = '\0';
-			acsm_add_pattern(ocl_w_ctx->acsm,
-			    (unsigned char *)pattern,
-			    strlen(pattern), 0, 0, 0, 0, pat_id);
+			n = strlen(pattern);
+			memcpy(slot.pat, pattern, n);
 		}
-		i++;
+		if (pat_size_limit != -1 && n > pat_size_limit)
+			n = pat_size_limit;
+		if (n == 0)
+			continue;
+
+		/* without IDs of their own, identical lines are one pattern */
+		slot.n = n;
+		slot.nocase = pat_nocase;
+		slot.offset = pat_offset;
+		slot.depth = pat_depth;
+		slot.id = categ ? pat_id : 0;
+		if (!dedupe_pattern(table, mask, &slot))
+			continue;
+		arena_len += n;
+
+		acsm_add_pattern(acsm, slot.pat, n, pat_nocase, pat_offset,
+		    pat_depth, 0, pat_id);
 	}
-	fclose(pfp);
 
+	/* the automaton holds copies of the patterns */
+	free(table);
+	FREE(arena);
+	if (map)
+		munmap((void *)map, size);
+
+	return acsm;
+}
+
+
+/*
+ * compiles the patterns read to a serialized DFA, keeping the trie; the
+ * state machine is freed if the sample traffic can not be read
+ */
+static acsm_t *
+compile_patterns(acsm_t *acsm, int groups, char *sample_path)
+{
 	/* compile added patterns to a state machine */
-	acsm_compile(ocl_w_ctx->acsm);
+	acsm_set_groups(acsm, groups);
+	acsm_compile(acsm);
+
+	/* pack the rows the sample traffic reads the most */
+	if (sample_path && profile_sample(acsm, sample_path) != 0) {
+		acsm_cleanup(acsm);
+		acsm_free(acsm);
+		return NULL;
+	}
+
+	/* generate the serialized state machine in host memory */
+	acsm_serialize(acsm);
+
+	return acsm;
+}
+
+
+/*
+ * reads the pattern file and compiles the patterns to a serialized DFA
+ */
+static acsm_t *
+read_patterns(char *pat_path, int hex_pat, struct regex_filter *rules,
+    int pat_size_limit, int nocase, int groups, char *sample_path)
+{
+	acsm_t *acsm;
+
+	acsm = parse_patterns(pat_path, hex_pat, rules, pat_size_limit,
+	    nocase);
+	if (!acsm)
+		return NULL;
+
+	return compile_patterns(acsm, groups, sample_path);
+}
+
+
+/*
+ * compiles the pattern file to a database that ocl_automaton_new() loads
+ */
+int
+ocl_automaton_compile(char *db_path, char *pat_path, int hex_pat,
+    int pat_size_limit, int nocase, int groups, char *sample_path)
+{
+	int e;
+	acsm_t *acsm;
+	acsm_pattern_t *patterns;
+
+	acsm = read_patterns(pat_path, hex_pat, NULL, pat_size_limit, nocase,
+	    groups, sample_path);
+	if (!acsm)
+		return -1;
+
+	patterns = acsm_get_patterns_table(acsm);
+
+	e = acsm_dump(acsm, patterns, db_path);
+
+	acsm_cleanup(acsm);
+	acsm_free(acsm);
+
+	return e;
+}
+
+
+/*
+ * reports the shape of the automaton, compiled or loaded, and its visits
+ * over the sample traffic
+ */
+int
+ocl_automaton_report(char *pat_path, int hex_pat, int regex,
+    int pat_size_limit, int nocase, int groups, char *sample_path,
+    int levels)
+{
+	acsm_t *acsm;
+	acsm_pattern_t *patterns;
+	struct regex_filter *rules;
+
+	/* the literals of the regexes are what the automaton looks for */
+	acsm = NULL;
+	rules = NULL;
+	if (regex) {
+		rules = regex_filter_new();
+		if (!rules)
+			return -1;
+	} else if (acsm_load(pat_path, &acsm, &patterns) == -1)
+		return -1;
+
+	if (!acsm) {
+		acsm = read_patterns(pat_path, hex_pat, rules, pat_size_limit,
+		    nocase, groups, sample_path);
+		if (rules)
+			regex_filter_free(rules);
+		if (!acsm)
+			return -1;
+		patterns = acsm_get_patterns_table(acsm);
+		acsm_cleanup(acsm);
+	}
+
+	/* the visits are counted on the serialized DFA, as it is scanned */
+	if (sample_path && scan_sample(acsm, sample_path) != 0) {
+		acsm_free(acsm);
+		return -1;
+	}
+
+	acsm_report(acsm, levels, stdout);
+
+	FREE(patterns);
+	acsm_free(acsm);
+
+	return 0;
+}
+
+
+/*
+ * creates the automaton shared by the workers for a serialized state
+ * machine without its trie; on failure the state machine, its patterns and
+ * its regexes are freed
+ */
+static struct ocl_automaton *
+automaton_new(struct clconf *cl, acsm_t *acsm, acsm_pattern_t *patterns,
+    struct regex_filter *rules, int mapped, int image, int max_results)
+{
+	struct ocl_automaton *automaton;
 
-	/* generate a serialized state machine and load it to the device */
-	acsm_gen_state_table(ocl_w_ctx->acsm, mapped, ocl_w_ctx->cl.ctx,
-	    ocl_w_ctx->cl.queue);
+	automaton = MALLOC(sizeof(struct ocl_automaton));
+	if (!automaton) {
+		acsm_release(acsm, 0, cl->queue);
+		acsm_free(acsm);
+		FREE(patterns);
+		if (rules)
+			regex_filter_free(rules);
+		return NULL;
+	}
+
+	automaton->acsm = acsm;
+	automaton->patterns = patterns;
+	automaton->rules = rules;
+	automaton->patterns_size = acsm->num_patterns;
+	automaton->refs = 1;
+	automaton->mapped = mapped;
+	automaton->queue = cl->queue;
+
+	/* load the serialized state machine to the device */
+	acsm_upload(acsm, mapped, image, cl->ctx, cl->queue);
+
+	/* build the matching program for the serialized state machine */
+	automaton->program = ocl_aho_match_build(cl, acsm, max_results);
+
+	return automaton;
+}
+
+
+/*
+ * loads a compiled database or reads the pattern file and creates the
+ * automaton shared by the workers
+ */
+struct ocl_automaton *
+ocl_automaton_new(struct clconf *cl, int mapped, int image, int max_results,
+    char *pat_path, int hex_pat, int regex, int pat_size_limit, int nocase,
+    int groups, char *sample_path)
+{
+	acsm_t *acsm;
+	acsm_pattern_t *patterns;
+	struct regex_filter *rules;
+
+	rules = NULL;
+	if (regex) {
+		rules = regex_filter_new();
+		if (!rules)
+			return NULL;
+	}
+
+	/*
+	 * a compiled database is mapped as is, no compilation needed; the
+	 * regexes are compiled from their pattern file only
+	 */
+	acsm = NULL;
+	if (!regex && acsm_load(pat_path, &acsm, &patterns) == -1)
+		return NULL;
+	if (!acsm) {
+		acsm = read_patterns(pat_path, hex_pat, rules, pat_size_limit,
+		    nocase, groups, sample_path);
+		if (!acsm) {
+			if (rules)
+				regex_filter_free(rules);
+			return NULL;
+		}
+
+		/* get the table with all patterns and their metadata */
+		patterns = acsm_get_patterns_table(acsm);
+
+		/* cleanup to save some space */
+		acsm_cleanup(acsm);
+	}
+
+	return automaton_new(cl, acsm, patterns, rules, mapped, image,
+	    max_results);
+}
 
-	/* get the table with all patterns and their metadata */
-	ocl_w_ctx->patterns = acsm_get_patterns_table(ocl_w_ctx->acsm);
 
-	ocl_w_ctx->patterns_size = ocl_w_ctx->acsm->num_patterns;
+/*
+ * orders the patterns by ID, then by their bytes and modifiers
+ */
+static int
+pattern_cmp(const void *a, const void *b)
+{
+	const acsm_pattern_t *p = *(acsm_pattern_t * const *)a;
+	const acsm_pattern_t *q = *(acsm_pattern_t * const *)b;
+
+	if (p->iid != q->iid)
+		return (p->iid < q->iid) ? -1 : 1;
+	if (p->n != q->n)
+		return (p->n < q->n) ? -1 : 1;
+	if (p->nocase != q->nocase)
+		return (p->nocase < q->nocase) ? -1 : 1;
+	if (p->offset != q->offset)
+		return (p->offset < q->offset) ? -1 : 1;
+	if (p->depth != q->depth)
+		return (p->depth < q->depth) ? -1 : 1;
+
+	return memcmp(p->casepattern, q->casepattern, p->n);
+}
+
+
+/*
+ * returns the patterns of a state machine sorted by pattern_cmp()
+ */
+static acsm_pattern_t **
+sort_patterns(acsm_t *acsm, int *count)
+{
+	int n;
+	acsm_pattern_t *p;
+	acsm_pattern_t **sorted;
+
+	n = 0;
+	for (p = acsm->patterns; p; p = p->next)
+		n++;
+
+	sorted = MALLOC((n > 0 ? n : 1) * sizeof(acsm_pattern_t *));
+	if (!sorted)
+		return NULL;
+
+	n = 0;
+	for (p = acsm->patterns; p; p = p->next)
+		sorted[n++] = p;
+	qsort(sorted, n, sizeof(acsm_pattern_t *), pattern_cmp);
+	*count = n;
+
+	return sorted;
+}
+
+
+/*
+ * applies the patterns read anew to the state machine kept by the reload
+ * thread: the patterns of an ID that changed, in any of its patterns, are
+ * deleted and those read are inserted; returns -1, leaving the state
+ * machine as it is, if a quarter of the patterns changed, if the deleted
+ * ones left as many holes in the pattern table as there are patterns, or
+ * if there is a signature, which is compiled in full
+ */
+static int
+apply_patterns(acsm_t *acsm, acsm_t *fresh)
+{
+	int i;
+	int j;
+	int k;
+	int l;
+	int m;
+	int iid;
+	int same;
+	int changed;
+	int num_iids;
+	int n_old;
+	int n_new;
+	int *iids;
+	acsm_pattern_t *p;
+	acsm_pattern_t **old;
+	acsm_pattern_t **new;
 
-	/* cleanup to save some space */
-	acsm_cleanup(ocl_w_ctx->acsm);
+	for (p = fresh->patterns; p; p = p->next)
+		if (p->sig)
+			return -1;
+
+	old = sort_patterns(acsm, &n_old);
+	new = sort_patterns(fresh, &n_new);
+	iids = MALLOC((n_old + n_new + 1) * sizeof(int));
+	if (!old || !new || !iids) {
+		FREE(old);
+		FREE(new);
+		FREE(iids);
+		return -1;
+	}
+
+	/* the IDs whose patterns differ, in order */
+	changed = 0;
+	num_iids = 0;
+	for (i = j = 0; i < n_old || j < n_new; i = k, j = l) {
+		if (j == n_new || (i < n_old && old[i]->iid < new[j]->iid))
+			iid = old[i]->iid;
+		else
+			iid = new[j]->iid;
+		for (k = i; k < n_old && old[k]->iid == iid; k++)
+			;
+		for (l = j; l < n_new && new[l]->iid == iid; l++)
+			;
+
+		same = (k - i == l - j);
+		for (m = 0; same && m < k - i; m++)
+			same = (pattern_cmp(&old[i + m], &new[j + m]) == 0);
+		if (same)
+			continue;
+
+		changed += (k - i) + (l - j);
+		iids[num_iids++] = iid;
+	}
+
+	/* the deleted patterns may move, see acsm_delete_pattern() */
+	FREE(old);
+
+	if (changed > n_old / 4 || acsm->num_patterns > 2 * n_old) {
+		FREE(new);
+		FREE(iids);
+		return -1;
+	}
+
+	for (m = 0; m < num_iids; m++)
+		acsm_delete_pattern(acsm, iids[m]);
+	for (j = m = 0; j < n_new; j++) {
+		while (m < num_iids && iids[m] < new[j]->iid)
+			m++;
+		if (m == num_iids)
+			break;
+		p = new[j];
+		if (p->iid == iids[m])
+			acsm_insert_pattern(acsm, p->casepattern, p->n,
+			    p->nocase, p->offset, p->depth, 0, p->iid);
+	}
+
+	FREE(new);
+	FREE(iids);
+
+	return 0;
+}
+
+
+/*
+ * reloads the patterns for the reload thread and creates the automaton
+ * shared by the workers
+ */
+struct ocl_automaton *
+ocl_automaton_reload(struct clconf *cl, acsm_t **kept, int mapped, int image,
+    int max_results, char *pat_path, int hex_pat, int regex,
+    int pat_size_limit, int nocase, int groups, char *sample_path)
+{
+	acsm_t *acsm;
+	acsm_t *fresh;
+	acsm_pattern_t *patterns;
+
+	/* the regexes and the compiled databases are loaded in full */
+	acsm = NULL;
+	if (!regex && acsm_load(pat_path, &acsm, &patterns) == -1)
+		return NULL;
+	if (regex || acsm) {
+		ocl_automaton_reload_free(*kept);
+		*kept = NULL;
+		if (acsm)
+			return automaton_new(cl, acsm, patterns, NULL, mapped,
+			    image, max_results);
+		return ocl_automaton_new(cl, mapped, image, max_results,
+		    pat_path, hex_pat, regex, pat_size_limit, nocase, groups,
+		    sample_path);
+	}
+
+	fresh = parse_patterns(pat_path, hex_pat, NULL, pat_size_limit,
+	    nocase);
+	if (!fresh)
+		return NULL;
+
+	/*
+	 * a few changed patterns are applied to the kept trie; if they can
+	 * not reach its tables, the next reload compiles the patterns in full
+	 */
+	if (*kept && apply_patterns(*kept, fresh) == 0) {
+		acsm_cleanup(fresh);
+		acsm_free(fresh);
+		if (acsm_update(*kept, 0, NULL, NULL) == -1) {
+			ocl_automaton_reload_free(*kept);
+			*kept = NULL;
+			return NULL;
+		}
+	} else {
+		fresh = compile_patterns(fresh, groups, sample_path);
+		if (!fresh)
+			return NULL;
+		ocl_automaton_reload_free(*kept);
+		*kept = fresh;
+	}
+
+	/* the workers get a copy, the kept one takes the next reload */
+	acsm = acsm_snapshot(*kept);
+	if (!acsm)
+		return NULL;
+	patterns = acsm_get_patterns_table(*kept);
+
+	return automaton_new(cl, acsm, patterns, NULL, mapped, image,
+	    max_results);
+}
+
+
+/*
+ * frees the state machine kept by ocl_automaton_reload()
+ */
+void
+ocl_automaton_reload_free(acsm_t *acsm)
+{
+	if (!acsm)
+		return;
+
+	acsm_release(acsm, 0, NULL);
+	acsm_cleanup(acsm);
+	acsm_free(acsm);
+
+	return;
+}
+
+
+/*
+ * initializes a new worker context
+ */
+int
+ocl_worker_ctx_init(struct ocl_worker_ctx *ocl_w_ctx, int dev_pos,
+    size_t local_ws, size_t global_ws, int mapped, int interleaved,
+    struct ocl_automaton *automaton, size_t max_chunk_size, int max_results,
+    int verbose, int text_mode, int follow, int id, int thread_no,
+    int total_files, int *fds, char **filenames)
+{
+	/* the automaton is shared read-only by all the workers */
+	pthread_mutex_lock(&automaton_lock);
+	automaton->refs++;
+	pthread_mutex_unlock(&automaton_lock);
+	ocl_w_ctx->automaton     = automaton;
+	ocl_w_ctx->acsm          = automaton->acsm;
+	ocl_w_ctx->tail_len      = 0;
+	ocl_w_ctx->tail_file     = -1;
+	ocl_w_ctx->tail_end      = 0;
+	ocl_w_ctx->patterns      = automaton->patterns;
+	ocl_w_ctx->patterns_size = automaton->patterns_size;
+	ocl_w_ctx->rules         = automaton->rules;
+
+	/* each worker needs its own kernel object for the shared program */
+	ocl_aho_match_init(&ocl_w_ctx->cl, automaton->program);
 
 	/* create a new data buffer */
 	ocl_w_ctx->db = databuf_new(global_ws, max_chunk_size, max_results,
-	    mapped, &ocl_w_ctx->cl);
+	    mapped, interleaved, &ocl_w_ctx->cl);
+
+	/* end of the last round, for the matches that cross into the next */
+	ocl_w_ctx->tail = MALLOC(MAX_PAT_SIZE);
+	if (!ocl_w_ctx->tail)
+		return -1;
+
+	/* file offsets of the chunks, for the pattern windows */
+	ocl_w_ctx->offsets = calloc(total_files, sizeof(size_t));
+	if (!ocl_w_ctx->offsets)
+		return -1;
 	
 	/* init OpenCL worker context variables */
 	ocl_w_ctx->local_ws         = local_ws;
@@ -185,6 +959,134 @@ ocl_worker_ctx_init(struct ocl_worker_ctx *ocl_w_ctx, int dev_pos,
 }
 
 
+/*
+ * tells whether the first chunk of the round continues the file of the
+ * tail where it ends
+ */
+static int
+tail_continues(struct ocl_worker_ctx *ctx)
+{
+	struct databuf *db;
+
+	db = ctx->db;
+
+	return ctx->tail_len > 0 && db->chunks > 0 &&
+	    db->file_ids[0] == ctx->tail_file &&
+	    db->h_offsets[0] == ctx->tail_end;
+}
+
+
+/*
+ * keeps the last bytes of the file that the round ends with, up to
+ * MAX_PAT_SIZE: the last chunk, the chunks before it that it continues and,
+ * if they are not enough and the round continues the tail kept before, the
+ * end of that tail
+ */
+void
+ocl_worker_ctx_keep_tail(struct ocl_worker_ctx *ctx)
+{
+	int c;
+	size_t n;
+	size_t m;
+	size_t keep;
+	struct databuf *db;
+
+	db = ctx->db;
+	if (db->chunks == 0)
+		return;
+
+	c = db->chunks - 1;
+	n = db->h_sizes[c];
+	while (c > 0 && n < MAX_PAT_SIZE &&
+	    db->file_ids[c - 1] == db->file_ids[c] &&
+	    db->h_offsets[c - 1] + db->h_sizes[c - 1] == db->h_offsets[c])
+		n += db->h_sizes[--c];
+
+	keep = 0;
+	if (n < MAX_PAT_SIZE && c == 0 && tail_continues(ctx))
+		keep = MIN(ctx->tail_len, MAX_PAT_SIZE - n);
+	memmove(ctx->tail, ctx->tail + ctx->tail_len - keep, keep);
+
+	/* the chunks go after the bytes kept, the last one first */
+	n = MIN(n, MAX_PAT_SIZE - keep);
+	ctx->tail_len = keep + n;
+	for (c = db->chunks - 1; n > 0; c--) {
+		m = MIN((size_t)db->h_sizes[c], n);
+		n -= m;
+		memcpy(ctx->tail + keep + n,
+		    db->h_data + db->h_indices[c] + db->h_sizes[c] - m, m);
+	}
+
+	c = db->chunks - 1;
+	ctx->tail_file = db->file_ids[c];
+	ctx->tail_end = db->h_offsets[c] + db->h_sizes[c];
+
+	return;
+}
+
+
+/*
+ * checks the matches that start in the last round
+ */
+void
+ocl_worker_ctx_check_edges(struct ocl_worker_ctx *ctx)
+{
+	ocl_aho_match_edges(ctx->db, ctx->acsm, ctx->tail,
+	    tail_continues(ctx) ? ctx->tail_len : 0);
+
+	return;
+}
+
+
+/*
+ * switches the worker context to the published automaton if it changed
+ */
+void
+ocl_worker_ctx_swap(struct ocl_worker_ctx *ctx)
+{
+	int g;
+	size_t n;
+	struct ocl_automaton *automaton;
+
+	pthread_mutex_lock(&automaton_lock);
+	automaton = published;
+	if (!automaton || automaton == ctx->automaton) {
+		pthread_mutex_unlock(&automaton_lock);
+		return;
+	}
+	automaton->refs++;
+	pthread_mutex_unlock(&automaton_lock);
+
+	/*
+	 * the longest pattern prefix in progress lies in the end of the last
+	 * round, as long as the longest pattern at most; each group is walked
+	 * from its root
+	 */
+	n = acsm_get_max_pattern_size(automaton->acsm);
+	if (n > ctx->tail_len)
+		n = ctx->tail_len;
+	for (g = 0; g < acsm_get_groups(automaton->acsm); g++)
+		ctx->db->last_state[g] = acsm_walk(automaton->acsm, g,
+		    ctx->tail + ctx->tail_len - n, n);
+
+	/* the matches left to this round are of the old patterns */
+	ctx->db->num_deferred = 0;
+
+	/* a kernel object of the new program */
+	ocl_aho_match_close(&ctx->cl);
+	ocl_aho_match_init(&ctx->cl, automaton->program);
+
+	ocl_automaton_put(ctx->automaton);
+	ctx->automaton     = automaton;
+	ctx->acsm          = automaton->acsm;
+	ctx->patterns      = automaton->patterns;
+	ctx->patterns_size = automaton->patterns_size;
+	ctx->rules         = automaton->rules;
+
+	return;
+}
+
+
 /*
  * frees the worker context
  */
@@ -192,8 +1094,61 @@ void
 ocl_worker_ctx_free(struct ocl_worker_ctx *ctx)
 {
 	databuf_free(ctx->db, ctx->db->mapped, ctx->cl.queue);
-	acsm_free(ctx->acsm);
+	ocl_aho_match_close(&ctx->cl);
+	ocl_automaton_put(ctx->automaton);
+	FREE(ctx->tail);
+	free(ctx->offsets);
 	FREE(ctx);
 
 	return;
 }
+
+
+/*
+ * publishes the automaton the worker contexts use
+ */
+void
+ocl_automaton_publish(struct ocl_automaton *automaton)
+{
+	struct ocl_automaton *prev;
+
+	pthread_mutex_lock(&automaton_lock);
+	prev = published;
+	published = automaton;
+	pthread_mutex_unlock(&automaton_lock);
+
+	if (prev)
+		ocl_automaton_put(prev);
+
+	return;
+}
+
+
+/*
+ * drops a reference to the shared automaton, frees it if none is left
+ */
+void
+ocl_automaton_put(struct ocl_automaton *automaton)
+{
+	int refs;
+
+	pthread_mutex_lock(&automaton_lock);
+	refs = --automaton->refs;
+	pthread_mutex_unlock(&automaton_lock);
+	if (refs > 0)
+		return;
+
+	clReleaseProgram(automaton->program);
+	acsm_release(automaton->acsm, automaton->mapped, automaton->queue);
+
+	/* the strings are in the table, or in the mapping of a database */
+	FREE(automaton->patterns);
+
+	if (automaton->rules)
+		regex_filter_free(automaton->rules);
+
+	acsm_free(automaton->acsm);
+	FREE(automaton);
+
+	return;
+}
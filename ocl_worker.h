@@ -4,6 +4,22 @@
 #include "ocl_context.h"
 #include "acsmx.h"
 #include "databuf.h"
+#include "regex_filter.h"
+
+
+/* automaton shared read-only by all worker contexts */
+struct ocl_automaton {
+	acsm_t         *acsm;		/* serialized Aho-Corasick automaton  */
+	acsm_pattern_t *patterns;	/* patterns and their metadata        */
+	size_t         patterns_size;	/* total number of the patterns       */
+	cl_program     program;		/* matching program for the automaton */
+	struct regex_filter *rules;	/* regexes the literals stand for, or
+					 * NULL                              */
+	int            refs;		/* worker contexts using it, and the
+					 * published reference               */
+	int            mapped;		/* mapped buffers flag                */
+	cl_command_queue queue;		/* queue the tables were mapped with  */
+};
 
 
 /* worker context */
@@ -16,6 +32,7 @@ struct ocl_worker_ctx {
 	int            total_files;	/* total number of files              */
 	int            *fds;		/* all file descriptors               */
 	char           **filenames;	/* all file names                     */
+	size_t         *offsets;	/* bytes read so far from each file   */
 	size_t         matches_total;	/* total matches in context           */
 	size_t         matches_reported; /* matches reported                 */
 	size_t         bytes;		/* total processed bytes in context   */
@@ -25,9 +42,15 @@ struct ocl_worker_ctx {
 	size_t         local_ws;	/* context's local work size          */
 	struct clconf  cl;		/* context's OpenCL configuration     */
 	struct databuf *db;		/* context's data buffer              */
+	struct ocl_automaton *automaton; /* automaton the context uses       */
 	acsm_t         *acsm;		/* context's Aho-Corasick automaton   */
 	acsm_pattern_t *patterns;	/* context's patterns                 */
 	size_t         patterns_size;	/* total number of the patterns       */
+	struct regex_filter *rules;	/* context's regexes, or NULL         */
+	unsigned char  *tail;		/* end of the last round's data       */
+	size_t         tail_len;	/* bytes in tail                      */
+	int            tail_file;	/* file ID of the tail                */
+	long           tail_end;	/* file offset the tail ends at       */
 };
 
 
@@ -35,12 +58,147 @@ struct ocl_worker_ctx {
  * creates a new worker context
  *
  * arg0: device possition
+ * arg1: worker context whose OpenCL context will be shared
+ *       NULL to create a new OpenCL context
  *
  * ret:  a new worker context
  *       NULL if the creation fails
  */
 struct ocl_worker_ctx *
-ocl_worker_ctx_create(int);
+ocl_worker_ctx_create(int, struct ocl_worker_ctx *);
+
+
+/*
+ * compiles the pattern file offline to a database that can be passed to
+ * ocl_automaton_new() instead of the pattern file; no device is needed
+ *
+ * arg0: database path
+ * arg1: pattern file path
+ * arg2: hex patterns flag
+ * arg3: pattern size limit
+ * arg4: case insensitive flag for all patterns
+ * arg5: number of pattern groups, see acsm_set_groups()
+ * arg6: sample traffic the states are ordered by, see acsm_reorder()
+ *       NULL to order them breadth first
+ *
+ * ret:   0 on success
+ *       -1 if the pattern file or the sample could not be read or the
+ *          database written
+ */
+int
+ocl_automaton_compile(char *, char *, int, int, int, int, char *);
+
+
+/*
+ * prints the shape of the automaton that ocl_automaton_new() would build,
+ * see acsm_report(); no device is needed
+ *
+ * arg0: compiled database or pattern file path
+ * arg1: hex patterns flag (pattern file only)
+ * arg2: regex patterns flag (pattern file only)
+ * arg3: pattern size limit (pattern file only)
+ * arg4: case insensitive flag for all patterns (pattern file only)
+ * arg5: number of pattern groups (pattern file only)
+ * arg6: sample traffic whose visits to the states are reported; a pattern
+ *       file is also compiled in its visit order, see acsm_reorder()
+ *       NULL to report no visits
+ * arg7: number of depths listed
+ *
+ * ret:   0 on success
+ *       -1 if the pattern file or the sample could not be read, or the
+ *          database is unusable, see acsm_load()
+ */
+int
+ocl_automaton_report(char *, int, int, int, int, int, char *, int);
+
+
+/*
+ * loads the compiled database, or reads the pattern file and compiles the
+ * automaton, transfers it to the device and builds its matching program;
+ * the result is shared by all the worker contexts that use the same
+ * OpenCL context
+ *
+ * arg00: OpenCL configuration
+ * arg01: mapped buffers flag
+ * arg02: image flag, the state table is read through the texture cache
+ *        if the device can take it as an image, see acsm_upload()
+ * arg03: maximum result cells per chunk of the workers, the matching
+ *        program is built for it
+ * arg04: compiled database or pattern file path
+ * arg05: hex patterns flag (pattern file only)
+ * arg06: regex patterns flag (pattern file only), see regex_filter_add();
+ *        the automaton looks for the literals the regexes require
+ * arg07: pattern size limit (pattern file only)
+ * arg08: case insensitive flag for all patterns (pattern file only)
+ * arg09: number of pattern groups (pattern file only)
+ * arg10: sample traffic the states are ordered by (pattern file only)
+ *        NULL to order them breadth first
+ *
+ * ret:   a new automaton, with a single reference held by the caller
+ *        NULL if the pattern file or the sample could not be read, or the
+ *        database is unusable, see acsm_load(); it is not read as a
+ *        pattern file then
+ */
+struct ocl_automaton *
+ocl_automaton_new(struct clconf *, int, int, int, char *, int, int, int,
+    int, int, char *);
+
+
+/*
+ * reloads the pattern file for the reload thread and creates the automaton
+ * shared by the workers, as ocl_automaton_new() does
+ *
+ * the reload thread keeps the state machine of a plain pattern file with
+ * its trie; the patterns of the IDs that changed since the last reload are
+ * deleted and inserted anew and only the rows they affect are recomputed
+ * (see acsm_update()), the workers get a copy of its tables; the first
+ * reload, a quarter of the patterns changed, signatures, regexes and
+ * compiled databases take a full compilation instead
+ *
+ * arg00: OpenCL configuration
+ * arg01: state machine kept between the reloads, NULL before the first;
+ *        it is replaced on a full compilation
+ * arg02-arg11: as the arguments of ocl_automaton_new()
+ *
+ * ret:   a new automaton, with a single reference held by the caller
+ *        NULL if the pattern file or the sample could not be read, the
+ *        database is unusable or the kept state machine could not be
+ *        updated; the automaton in use is left as it is
+ */
+struct ocl_automaton *
+ocl_automaton_reload(struct clconf *, acsm_t **, int, int, int, char *, int,
+    int, int, int, int, char *);
+
+
+/*
+ * frees the state machine kept by ocl_automaton_reload()
+ *
+ * arg0: kept state machine, or NULL
+ */
+void
+ocl_automaton_reload_free(acsm_t *);
+
+
+/*
+ * publishes the automaton the worker contexts use; the contexts switch to
+ * it at their next buffer boundary (see ocl_worker_ctx_swap()) and the
+ * previous one is freed when the last context stops using it
+ *
+ * arg0: shared automaton, its caller's reference is handed over
+ *       NULL to drop the published automaton
+ */
+void
+ocl_automaton_publish(struct ocl_automaton *);
+
+
+/*
+ * drops a reference to the shared automaton and frees it, along with its
+ * device buffers and matching program, when none is left
+ *
+ * arg0: shared automaton
+ */
+void
+ocl_automaton_put(struct ocl_automaton *);
 
 
 /*
@@ -51,30 +209,69 @@ ocl_worker_ctx_create(int);
  * arg02: local work size
  * arg03: global work size
  * arg04: mapped buffers flag
- * arg05: pattern file path
- * arg06: hex patterns flag
- * arg07: pattern size limit
- * arg08: maximum chunk size
- * arg09: maximum result cells per chunk
- * arg10: verbosity flag
- * arg11: text mode
- * arg12: follow
- * arg13: thread id
- * arg14: maximum number of cpu threads
- * arg15: total input files
- * arg16: file descriptors
- * arg17: file names
+ * arg05: interleaved device data flag, see databuf_new()
+ * arg06: shared automaton, the context takes a reference
+ * arg07: maximum chunk size
+ * arg08: maximum result cells per chunk
+ * arg09: verbosity flag
+ * arg10: text mode
+ * arg11: follow
+ * arg12: thread id
+ * arg13: maximum number of cpu threads
+ * arg14: total input files
+ * arg15: file descriptors
+ * arg16: file names
  *
  * ret:    0 if initialization was successful
  *        -1 if the initialization failed
  */
 int
-ocl_worker_ctx_init(struct ocl_worker_ctx *, int, size_t, size_t, int, char *,
-    int, int, size_t, int, int, int, int, int, int, int, int *, char **);
+ocl_worker_ctx_init(struct ocl_worker_ctx *, int, size_t, size_t, int, int,
+    struct ocl_automaton *, size_t, int, int, int, int, int, int, int, int *,
+    char **);
+
+
+/*
+ * keeps the end of the data of the round just scanned, see
+ * ocl_worker_ctx_check_edges() and ocl_worker_ctx_swap()
+ *
+ * arg0: worker context
+ */
+void
+ocl_worker_ctx_keep_tail(struct ocl_worker_ctx *);
+
+
+/*
+ * checks the matches of the round that start in the last round against the
+ * end of it kept by ocl_worker_ctx_keep_tail(), and those the last round
+ * left to this one, see ocl_aho_match_edges(); they are dropped if the
+ * round does not continue the file of the last one where it ended
+ *
+ * arg0: worker context
+ */
+void
+ocl_worker_ctx_check_edges(struct ocl_worker_ctx *);
+
+
+/*
+ * switches the worker context to the published automaton if it changed;
+ * must be called at a buffer boundary, before the launch, once the results
+ * of the last launch are read, so that no launch of the context uses the
+ * previous automaton
+ *
+ * the stream state of the context is carried over: the new automaton runs
+ * over the end of the last round kept by ocl_worker_ctx_keep_tail(), as
+ * long as its longest pattern; the matches the last round left to this one
+ * are dropped
+ *
+ * arg0: worker context
+ */
+void
+ocl_worker_ctx_swap(struct ocl_worker_ctx *);
 
 
 /*
- * frees the worker context
+ * frees the worker context and drops its automaton reference
  *
  * arg0: worker context 
  */
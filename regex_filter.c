@@ -0,0 +1,679 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <regex.h>
+
+#include "regex_filter.h"
+#include "acsmx.h"
+#include "common.h"
+#include "databuf.h"
+#include "utils.h"
+
+/* deepest group the literals are looked for in */
+#define MAX_GROUP_LEVEL	16
+
+/* quantifiers of an atom */
+#define QUANT_ONE	0	/* exactly once            */
+#define QUANT_OPT	1	/* possibly never          */
+#define QUANT_REP	2	/* at least once, repeated */
+
+
+/* the literals a part of a regex requires and the run being collected */
+struct factors {
+	unsigned char	*lit[REGEX_MAX_FACTORS];
+	int		len[REGEX_MAX_FACTORS];
+	int		n;
+	unsigned char	run[MAX_PAT_SIZE];
+	int		run_len;
+};
+
+
+/*
+ * creates an empty set of regexes
+ */
+struct regex_filter *
+regex_filter_new(void)
+{
+	struct regex_filter *rf;
+
+	rf = calloc(1, sizeof(struct regex_filter));
+
+	return rf;
+}
+
+
+/*
+ * keeps a required literal; past the limit, the longest ones are kept
+ */
+static void
+add_factor(struct factors *f, unsigned char *lit, int len)
+{
+	int i, k;
+
+	if (len < 2) {
+		free(lit);
+		return;
+	}
+
+	if (f->n < REGEX_MAX_FACTORS) {
+		f->lit[f->n] = lit;
+		f->len[f->n++] = len;
+		return;
+	}
+
+	for (k = 0, i = 1; i < f->n; i++)
+		if (f->len[i] < f->len[k])
+			k = i;
+	if (f->len[k] >= len) {
+		free(lit);
+		return;
+	}
+	free(f->lit[k]);
+	f->lit[k] = lit;
+	f->len[k] = len;
+
+	return;
+}
+
+
+/*
+ * ends the run of plain bytes being collected
+ */
+static void
+flush_run(struct factors *f)
+{
+	unsigned char *lit;
+
+	if (f->run_len >= 2) {
+		lit = malloc(f->run_len);
+		if (!lit)
+			ERR(1, "ERROR: malloc literal");
+		memcpy(lit, f->run, f->run_len);
+		add_factor(f, lit, f->run_len);
+	}
+	f->run_len = 0;
+
+	return;
+}
+
+
+/*
+ * drops the literals collected
+ */
+static void
+drop_factors(struct factors *f)
+{
+	int i;
+
+	for (i = 0; i < f->n; i++)
+		free(f->lit[i]);
+	f->n = 0;
+
+	return;
+}
+
+
+/*
+ * skips a bracket expression, the regex is known to compile
+ */
+static const char *
+skip_bracket(const char *p)
+{
+	char end;
+
+	p++;
+	if (*p == '^')
+		p++;
+	if (*p == ']')
+		p++;
+	while (*p && *p != ']') {
+		if (p[0] == '[' && strchr(":.=", p[1]) && p[1]) {
+			end = p[1];
+			for (p += 2; *p && !(p[0] == end && p[1] == ']'); p++)
+				;
+			if (*p)
+				p += 2;
+			continue;
+		}
+		p++;
+	}
+	if (*p)
+		p++;
+
+	return p;
+}
+
+
+/*
+ * parses the quantifiers that follow an atom
+ */
+static int
+parse_quantifier(const char **re)
+{
+	int q;
+	const char *p;
+
+	q = QUANT_ONE;
+	for (p = *re; ; ) {
+		if (*p == '*' || *p == '?') {
+			q = QUANT_OPT;
+			p++;
+		} else if (*p == '+') {
+			if (q == QUANT_ONE)
+				q = QUANT_REP;
+			p++;
+		} else if (*p == '{' && isdigit((unsigned char)p[1])) {
+			if (atoi(p + 1) == 0)
+				q = QUANT_OPT;
+			else if (q == QUANT_ONE)
+				q = QUANT_REP;
+			while (*p && *p != '}')
+				p++;
+			if (*p)
+				p++;
+		} else
+			break;
+	}
+	*re = p;
+
+	return q;
+}
+
+
+/*
+ * collects the literals every match of a sequence contains, up to the
+ * closing parenthesis of its group or the end of the regex
+ *
+ * ret: 1 if the sequence has alternatives at its level, 0 otherwise
+ */
+static int
+parse_sequence(const char **re, struct factors *f, int level)
+{
+	int i, q;
+	int alt;
+	int lit;
+	int group_alt;
+	const char *p;
+	struct factors *inner;
+
+	alt = 0;
+	f->n = 0;
+	f->run_len = 0;
+	for (p = *re; *p && *p != ')'; ) {
+		lit = -1;
+		inner = NULL;
+		group_alt = 0;
+
+		switch (*p) {
+		case '(':
+			p++;
+			inner = malloc(sizeof(struct factors));
+			if (!inner)
+				ERR(1, "ERROR: malloc factors");
+			group_alt = parse_sequence(&p, inner, level + 1);
+			if (*p == ')')
+				p++;
+			break;
+		case '[':
+			p = skip_bracket(p);
+			break;
+		case '|':
+			/* the literals of one alternative are not required */
+			alt = 1;
+			flush_run(f);
+			p++;
+			continue;
+		case '\\':
+			if (p[1] && !isalnum((unsigned char)p[1]))
+				lit = (unsigned char)p[1];
+			p += p[1] ? 2 : 1;
+			break;
+		case '.':
+		case '^':
+		case '$':
+			p++;
+			break;
+		default:
+			lit = (unsigned char)*p++;
+			break;
+		}
+
+		q = parse_quantifier(&p);
+
+		if (lit != -1) {
+			if (q == QUANT_OPT) {
+				flush_run(f);
+				continue;
+			}
+			if (f->run_len == MAX_PAT_SIZE)
+				flush_run(f);
+			f->run[f->run_len++] = lit;
+			if (q == QUANT_REP)
+				flush_run(f);
+			continue;
+		}
+
+		flush_run(f);
+		if (!inner)
+			continue;
+
+		/* a group is required once, unless optional or alternated */
+		if (q != QUANT_OPT && !group_alt &&
+		    level < MAX_GROUP_LEVEL) {
+			for (i = 0; i < inner->n; i++)
+				add_factor(f, inner->lit[i],
+				    inner->len[i]);
+			inner->n = 0;
+		}
+		drop_factors(inner);
+		free(inner);
+	}
+	flush_run(f);
+	*re = p;
+
+	return alt;
+}
+
+
+/*
+ * makes room for one more automaton pattern
+ */
+static int
+grow_patterns(struct regex_filter *rf, int pats)
+{
+	int n;
+	int *rule, *bit;
+
+	if (pats < rf->max_pats)
+		return 0;
+
+	n = rf->max_pats ? rf->max_pats * 2 : 64;
+	while (n <= pats)
+		n *= 2;
+	rule = realloc(rf->pat_rule, n * sizeof(int));
+	if (!rule)
+		return -1;
+	rf->pat_rule = rule;
+	bit = realloc(rf->pat_bit, n * sizeof(int));
+	if (!bit)
+		return -1;
+	rf->pat_bit = bit;
+
+	/* patterns that are no literal of a regex hit nothing */
+	memset(&rf->pat_rule[rf->max_pats], 0xff,
+	    (n - rf->max_pats) * sizeof(int));
+	rf->max_pats = n;
+
+	return 0;
+}
+
+
+/*
+ * compiles the regex and adds its required literals to the automaton
+ */
+int
+regex_filter_add(struct regex_filter *rf, acsm_t *acsm, char *regex,
+    int nocase, int id)
+{
+	int i, r;
+	int *unfiltered;
+	const char *p;
+	struct factors *f;
+	struct regex_rule *rule;
+
+	if (rf->num_rules == rf->max_rules) {
+		rf->max_rules = rf->max_rules ? rf->max_rules * 2 : 16;
+		rule = realloc(rf->rules,
+		    rf->max_rules * sizeof(struct regex_rule));
+		if (!rule)
+			ERR(1, "ERROR: realloc regexes");
+		rf->rules = rule;
+		unfiltered = realloc(rf->unfiltered,
+		    rf->max_rules * sizeof(int));
+		if (!unfiltered)
+			ERR(1, "ERROR: realloc regexes");
+		rf->unfiltered = unfiltered;
+	}
+
+	r = rf->num_rules;
+	rule = &rf->rules[r];
+	if (regcomp(&rule->re, regex, REG_EXTENDED | REG_NEWLINE |
+	    (nocase ? REG_ICASE : 0)) != 0)
+		return -1;
+	rule->id = id;
+	rule->text = strdup(regex);
+	rule->factors = 0;
+	rf->num_rules++;
+
+	f = malloc(sizeof(struct factors));
+	if (!f)
+		ERR(1, "ERROR: malloc factors");
+	p = regex;
+	if (parse_sequence(&p, f, 0))
+		drop_factors(f);
+
+	for (i = 0; i < f->n; i++) {
+		if (grow_patterns(rf, acsm->num_patterns) != 0)
+			ERR(1, "ERROR: realloc regex patterns");
+		rf->pat_rule[acsm->num_patterns] = r;
+		rf->pat_bit[acsm->num_patterns] = i;
+		acsm_add_pattern(acsm, f->lit[i], f->len[i], nocase, 0, 0, 0,
+		    id);
+	}
+	rule->factors = f->n;
+	drop_factors(f);
+	free(f);
+
+	if (rule->factors == 0) {
+		rf->unfiltered[rf->num_unfiltered++] = r;
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * checks if the chunk goes on where the previous one of the buffer ends
+ */
+static int
+follows(struct databuf *db, int c)
+{
+	return c > 0 && db->file_ids[c] == db->file_ids[c - 1] &&
+	    db->h_offsets[c - 1] + db->h_sizes[c - 1] == db->h_offsets[c];
+}
+
+
+/*
+ * runs the regex over the chunk and the next one of the same file and
+ * reports the matches that start in the chunk
+ */
+static int
+verify(struct regex_filter *rf, int r, struct databuf *db, int c,
+    int (*cb)(int, int, int, int, void *), void *uarg)
+{
+	int lo, end, hi;
+	int eflags;
+	int matches;
+	regmatch_t m;
+	unsigned char prev;
+
+	lo = db->h_indices[c];
+	end = lo + db->h_sizes[c];
+	hi = end;
+	if (c + 1 < db->chunks && follows(db, c + 1) &&
+	    db->h_indices[c + 1] == end)
+		hi += db->h_sizes[c + 1];
+
+	/* the chunk starts a line if the byte before it is known to end one */
+	eflags = REG_STARTEND;
+	if (db->h_offsets[c] != 0) {
+		prev = follows(db, c) ?
+		    db->h_data[db->h_indices[c - 1] + db->h_sizes[c - 1] - 1] :
+		    0;
+		if (prev != '\n')
+			eflags |= REG_NOTBOL;
+	}
+
+	matches = 0;
+	m.rm_so = 0;
+	while (lo + m.rm_so < end) {
+		m.rm_eo = hi - lo;
+		if (regexec(&rf->rules[r].re, (char *)db->h_data + lo, 1, &m,
+		    eflags) != 0 || lo + m.rm_so >= end)
+			break;
+
+		matches++;
+		if (cb)
+			cb(db->file_ids[c], r, c, lo + m.rm_so, uarg);
+
+		/* go on after the match, or a byte on if it is empty */
+		m.rm_so = (m.rm_eo > m.rm_so) ? m.rm_eo : m.rm_so + 1;
+	}
+
+	return matches;
+}
+
+
+/*
+ * verifies the regexes whose required literals all hit around each chunk
+ */
+int
+regex_filter_match(struct regex_filter *rf, struct databuf *db,
+    int (*cb)(int, int, int, int, void *), void *uarg)
+{
+	int c, i, j, k;
+	int r, pat;
+	int last;
+	int factors;
+	int every;
+	int matches;
+	int candidates;
+	int *cand;
+	unsigned int *hits;
+
+	if (rf->num_rules == 0)
+		return 0;
+
+	hits = calloc(rf->num_rules, sizeof(unsigned int));
+	cand = malloc(rf->num_rules * sizeof(int));
+	if (!hits || !cand)
+		ERR(1, "ERROR: malloc regex hits");
+
+	matches = 0;
+	for (c = 0; c < db->chunks; c++) {
+		/* a match may end in the next chunk of the same file */
+		last = (c + 1 < db->chunks && follows(db, c + 1)) ? c + 1 : c;
+
+		every = 0;
+		candidates = 0;
+		for (k = c; k <= last; k++) {
+			if (db->h_results[k] > db->max_results - 1)
+				every = 1;
+			for (j = 0; j < db->h_results[k] &&
+			    j < db->max_results - 1; j++) {
+				pat = db->h_results[(j + 1) * db->chunks + k];
+				if (pat < 0 || pat >= rf->max_pats ||
+				    (r = rf->pat_rule[pat]) == -1)
+					continue;
+				if (hits[r] == 0)
+					cand[candidates++] = r;
+				hits[r] |= 1U << rf->pat_bit[pat];
+			}
+		}
+
+		if (every) {
+			for (r = 0; r < rf->num_rules; r++)
+				matches += verify(rf, r, db, c, cb, uarg);
+		} else {
+			for (i = 0; i < candidates; i++) {
+				r = cand[i];
+				factors = rf->rules[r].factors;
+				if (hits[r] == (factors == REGEX_MAX_FACTORS ?
+				    ~0U : (1U << factors) - 1))
+					matches += verify(rf, r, db, c, cb,
+					    uarg);
+			}
+			for (i = 0; i < rf->num_unfiltered; i++)
+				matches += verify(rf, rf->unfiltered[i], db, c,
+				    cb, uarg);
+		}
+
+		for (i = 0; i < candidates; i++)
+			hits[cand[i]] = 0;
+	}
+
+	free(hits);
+	free(cand);
+
+	return matches;
+}
+
+
+/*
+ * frees the set of regexes
+ */
+void
+regex_filter_free(struct regex_filter *rf)
+{
+	int i;
+
+	for (i = 0; i < rf->num_rules; i++) {
+		regfree(&rf->rules[i].re);
+		free(rf->rules[i].text);
+	}
+	free(rf->rules);
+	free(rf->pat_rule);
+	free(rf->pat_bit);
+	free(rf->unfiltered);
+	free(rf);
+
+	return;
+}
+
+
+#ifdef REGEX_FILTER_TEST
+
+/*
+ * returns the literals the automaton got for a regex, in the order they
+ * were added and separated by commas
+ */
+static char *
+literals(acsm_t *acsm, int id, char *buf)
+{
+	int i;
+	acsm_pattern_t *p;
+
+	buf[0] = '\0';
+	for (i = 0; i < acsm->num_patterns; i++)
+		for (p = acsm->patterns; p; p = p->next)
+			if ((int)p->index == i && p->iid == id) {
+				if (buf[0])
+					strcat(buf, ",");
+				strncat(buf, (char *)p->pattern, p->n);
+			}
+
+	return buf;
+}
+
+/*
+ * counts the matches and adds up the offsets they start at
+ */
+static int
+count_match(int file, int r, int c, int off, void *arg)
+{
+	int *sum = arg;
+
+	*sum += off;
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+
+	int sum;
+	int failed = 0;
+	char buf[128];
+	char data[] = "xx foo12" "3bar dog" "foo9bar";
+	int indices[] = { 0, 8, 16 };
+	int sizes[] = { 8, 8, 7 };
+	cl_long offsets[] = { 0, 8, 0 };
+	int file_ids[] = { 0, 0, 1 };
+	int results[3 * 4];
+	acsm_t *acsm;
+	struct databuf db;
+	struct regex_filter *rf;
+
+	/********************************************************************/
+
+	printf("Testing the literals required by regexes... ");
+
+	rf = regex_filter_new();
+	acsm = acsm_new();
+	if (regex_filter_add(rf, acsm, "foo[0-9]+bar", 0, 0) != 0 ||
+	    strcmp(literals(acsm, 0, buf), "foo,bar") != 0 ||
+	    regex_filter_add(rf, acsm, "ab?cde", 0, 1) != 0 ||
+	    strcmp(literals(acsm, 1, buf), "cde") != 0 ||
+	    regex_filter_add(rf, acsm, "x(yz)+w(q|r)st", 0, 2) != 0 ||
+	    strcmp(literals(acsm, 2, buf), "yz,st") != 0 ||
+	    regex_filter_add(rf, acsm, "www\\.example\\.com", 0, 3) != 0 ||
+	    strcmp(literals(acsm, 3, buf), "www.example.com") != 0 ||
+	    regex_filter_add(rf, acsm, "(cat|dog)", 0, 4) != 1 ||
+	    regex_filter_add(rf, acsm, "a(b", 0, 5) != -1 ||
+	    rf->num_rules != 5 || rf->num_unfiltered != 1) {
+		printf("FAILED\n");
+		failed++;
+	} else
+		printf("OK\n");
+
+	acsm_cleanup(acsm);
+	acsm_free(acsm);
+	regex_filter_free(rf);
+
+	/********************************************************************/
+
+	printf("Testing regexes verified on the chunks of their hits... ");
+
+	/* foo and bar are patterns 0 and 1 */
+	rf = regex_filter_new();
+	acsm = acsm_new();
+	regex_filter_add(rf, acsm, "foo[0-9]+bar", 0, 0);
+	regex_filter_add(rf, acsm, "(cat|dog)", 0, 1);
+
+	/* the first two chunks follow each other in the same file */
+	memset(&db, 0, sizeof(db));
+	db.h_data = (unsigned char *)data;
+	db.h_indices = indices;
+	db.h_sizes = sizes;
+	db.h_offsets = offsets;
+	db.file_ids = file_ids;
+	db.h_results = results;
+	db.max_results = 4;
+	db.chunks = 3;
+
+	/* a count per chunk, then a pattern per row */
+	memset(results, 0, sizeof(results));
+	results[0] = 1;
+	results[3 + 0] = 0;
+	results[1] = 1;
+	results[3 + 1] = 1;
+	results[2] = 2;
+	results[3 + 2] = 0;
+	results[6 + 2] = 1;
+
+	/* foo123bar across the first two chunks, dog, foo9bar */
+	sum = 0;
+	if (regex_filter_match(rf, &db, count_match, &sum) != 3 ||
+	    sum != 3 + 13 + 16) {
+		printf("FAILED\n");
+		failed++;
+	} else {
+		/* without the hit of bar, foo9bar is not verified */
+		results[2] = 1;
+		sum = 0;
+		if (regex_filter_match(rf, &db, count_match, &sum) != 2 ||
+		    sum != 3 + 13) {
+			printf("FAILED\n");
+			failed++;
+		} else {
+			/* unless the hits of the chunk are not all known */
+			results[2] = db.max_results;
+			sum = 0;
+			if (regex_filter_match(rf, &db, count_match, &sum) !=
+			    3 || sum != 3 + 13 + 16) {
+				printf("FAILED\n");
+				failed++;
+			} else
+				printf("OK\n");
+		}
+	}
+
+	acsm_cleanup(acsm);
+	acsm_free(acsm);
+	regex_filter_free(rf);
+
+	/********************************************************************/
+
+	return failed;
+}
+#endif
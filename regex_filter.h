@@ -0,0 +1,96 @@
+#ifndef _REGEX_FILTER_H_
+#define _REGEX_FILTER_H_
+
+#include <regex.h>
+
+#include "acsmx.h"
+#include "databuf.h"
+
+/* most required literals of a regex that the automaton looks for */
+#define REGEX_MAX_FACTORS	32
+
+
+/* a regex and the literals every match of it contains */
+struct regex_rule {
+	int		id;		/* pattern ID of the regex            */
+	char		*text;		/* the regex, as given                */
+	regex_t		re;		/* compiled regex, for the verifier   */
+	int		factors;	/* required literals in the automaton */
+};
+
+
+/* the regexes of a pattern file */
+struct regex_filter {
+	struct regex_rule *rules;	/* the regexes                        */
+	int		num_rules;	/* number of the regexes              */
+	int		max_rules;	/* allocated regexes                  */
+	int		*pat_rule;	/* regex of each automaton pattern    */
+	int		*pat_bit;	/* its bit in the hits of the regex   */
+	int		max_pats;	/* allocated automaton patterns       */
+	int		*unfiltered;	/* regexes without a required literal */
+	int		num_unfiltered;	/* number of those                    */
+};
+
+
+/*
+ * creates an empty set of regexes
+ *
+ * ret:  a new set of regexes
+ *       NULL if the allocation fails
+ */
+struct regex_filter *
+regex_filter_new(void);
+
+
+/*
+ * compiles a POSIX extended regex and adds the literals every match of it
+ * contains, the longest runs of plain bytes of its top level concatenation,
+ * to the automaton; a literal shorter than 2 bytes is not added
+ *
+ * arg0: set of regexes
+ * arg1: automaton, not compiled yet
+ * arg2: regex
+ * arg3: case insensitive flag
+ * arg4: pattern ID of the regex
+ *
+ * ret:   0 on success
+ *        1 if the regex has no required literal, e.g., it has alternatives
+ *          at its top level; it is verified on every chunk
+ *       -1 if the regex does not compile
+ */
+int
+regex_filter_add(struct regex_filter *, acsm_t *, char *, int, int);
+
+
+/*
+ * verifies the regexes on the chunks of the data buffer whose results hold
+ * every required literal of the regex, after the results are copied to the
+ * host; a match must start in the chunk and end in it or in the next chunk
+ * of the same file
+ *
+ * a chunk that ran out of result cells (-R) is verified against every
+ * regex, as its hits are not all known
+ *
+ * arg0: set of regexes
+ * arg1: data buffer
+ * arg2: callback for each match, with the file, the regex index, the chunk
+ *       and the buffer offset the match starts at
+ * arg3: argument passed to the callback
+ *
+ * ret:  number of regex matches
+ */
+int
+regex_filter_match(struct regex_filter *, struct databuf *,
+    int (*)(int, int, int, int, void *), void *);
+
+
+/*
+ * frees the set of regexes
+ *
+ * arg0: set of regexes
+ */
+void
+regex_filter_free(struct regex_filter *);
+
+
+#endif /* _REGEX_FILTER_H_ */
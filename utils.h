@@ -24,18 +24,21 @@ usage(void);
 /*
  * checks the user's arguments
  *
- * arg0: pattern file path
- * arg1: input file path
- * arg2: device possition
- * arg3: global work size
- * arg4: local work size
- * arg5: maximum chunk size
- * arg6: number of threads
- * arg7: pattern size limit in Bytes
- * arg8: maximum result cells per chunk
+ * arg00: pattern file path
+ * arg01: input file path
+ * arg02: device possition
+ * arg03: global work size
+ * arg04: local work size
+ * arg05: maximum chunk size
+ * arg06: number of threads
+ * arg07: pattern size limit in Bytes
+ * arg08: maximum result cells per chunk
+ * arg09: hex patterns flag
+ * arg10: regex patterns flag
  */
 void
-check_args(char *, char *, int, size_t, size_t, size_t, int, int, int);
+check_args(char *, char *, int, size_t, size_t, size_t, int, int, int, int,
+    int);
 
 
 /*